@@ -0,0 +1,100 @@
+// Subset of the fluid particles that still needs work.
+//
+// The set is kept as one flag per particle plus a compact list of the
+// particle indices, so parallel loops over the set only touch its members.
+// Flags can be added concurrently (several threads may add the same
+// particle), compact() rebuilds the index list from the flags afterwards.
+// Indices refer to the sorted particle arrays of the current step.
+
+#pragma once
+
+#include "NeighborList.h"
+
+#include "utils/ConcurrentUtils.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace cs224 {
+
+class ActiveSet {
+public:
+    // Resize to count particles, all of them active or inactive.
+    void reset(size_t count, bool active) {
+        if (count != m_count) {
+            m_flags.reset(new std::atomic<uint8_t>[count]);
+            m_offsets.resize(count);
+            m_count = count;
+        }
+        ConcurrentUtils::ccLoop(count, [&] (size_t i) {
+            m_flags[i].store(active ? 1 : 0, std::memory_order_relaxed);
+        });
+        m_indices.clear();
+        if (active) {
+            compact();
+        }
+    }
+
+    // Remove all members, only touches the flags of the current members.
+    void clear() {
+        forEach([&] (size_t i) {
+            m_flags[i].store(0, std::memory_order_relaxed);
+        });
+        m_indices.clear();
+    }
+
+    inline void add(size_t i) { m_flags[i].store(1, std::memory_order_relaxed); }
+    inline void remove(size_t i) { m_flags[i].store(0, std::memory_order_relaxed); }
+    inline bool contains(size_t i) const { return m_flags[i].load(std::memory_order_relaxed) != 0; }
+
+    // Add the members of set and their neighbours (one-ring) in the neighbour
+    // lists, only neighbours in mask if it is given. The sets must be compacted
+    // and index the particles of the lists.
+    void addNeighbors(const ActiveSet &set, const NeighborList &neighbors, const ActiveSet *mask = nullptr) {
+        set.forEach([&] (size_t i) {
+            add(i);
+            const uint32_t *indices = neighbors.neighbors(i);
+            for (uint32_t k = 0; k < neighbors.count(i); ++k) {
+                if (!mask || mask->contains(indices[k])) {
+                    add(indices[k]);
+                }
+            }
+        });
+    }
+
+    // Rebuild the index list from the flags, in particle order.
+    void compact() {
+        size_t size = ConcurrentUtils::exclusiveScan<size_t>(m_count, [&] (size_t i) {
+            return size_t(contains(i));
+        }, m_offsets);
+        m_indices.resize(size);
+        ConcurrentUtils::ccLoop(m_count, [&] (size_t i) {
+            if (contains(i)) {
+                m_indices[m_offsets[i]] = uint32_t(i);
+            }
+        });
+    }
+
+    // Parallel loop over the members (as of the last compact), calling func(i).
+    template<typename Func>
+    inline void forEach(Func func) const {
+        const uint32_t *indices = m_indices.data();
+        ConcurrentUtils::ccLoop(m_indices.size(), [&] (size_t k) {
+            func(size_t(indices[k]));
+        });
+    }
+
+    size_t size() const { return m_indices.size(); }
+    bool empty() const { return m_indices.empty(); }
+    float fraction() const { return m_count > 0 ? float(m_indices.size()) / m_count : 0.f; }
+
+private:
+    size_t m_count = 0;
+    std::unique_ptr<std::atomic<uint8_t>[]> m_flags;
+    std::vector<size_t> m_offsets;
+    std::vector<uint32_t> m_indices;
+};
+
+} // namespace cs224
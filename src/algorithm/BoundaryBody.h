@@ -0,0 +1,96 @@
+// Keyframed rigid motion of the boundary boxes and meshes, see SPH::moveBoundaries.
+//
+// A boundary with keyframes in the scene is a rigid body. Its particles keep
+// their positions in the scene (the rest positions) and are moved to the pose
+// of the current time, rest -> rotation * rest + translation. Translations are
+// interpolated linearly and rotations spherically between the keyframes, the
+// first and the last keyframe hold before and after them.
+
+#pragma once
+
+#include "utils/Def.h"
+
+#include <Eigen/Geometry>
+
+#include <algorithm>
+#include <vector>
+
+namespace cs224 {
+
+struct BoundaryBody {
+    struct Keyframe {
+        float time;
+        Vector3f translation;
+        Eigen::Matrix3f rotation;
+    };
+
+    std::vector<Keyframe> keyframes;  // sorted by time
+    Vector3f center;                  // centre of the rotations
+    float radius;                     // of a sphere around center containing the body
+    int mesh;                         // index of the boundary mesh of the body
+    int collider = -1;                // index of the SDF collider of the body, -1 if it has none
+
+    // Current pose, and the pose at the end of the step.
+    Eigen::Matrix3f rotation = Eigen::Matrix3f::Identity();
+    Vector3f translation = Vector3f(0.f);
+    Eigen::Matrix3f nextRotation = Eigen::Matrix3f::Identity();
+    Vector3f nextTranslation = Vector3f(0.f);
+
+    // keyframes are (time, translation, euler angles in degrees) of the bounds centred at center.
+    template<typename SceneKeyframes>
+    BoundaryBody(const SceneKeyframes &sceneKeyframes, const Box3f &bounds, int mesh) :
+        center(bounds.center()), radius(0.5f * bounds.extents().norm()), mesh(mesh) {
+
+        for (const auto &keyframe : sceneKeyframes) {
+            keyframes.push_back({ keyframe.time, keyframe.translation, eulerRotation(keyframe.rotation) });
+        }
+        std::stable_sort(keyframes.begin(), keyframes.end(), [] (const Keyframe &a, const Keyframe &b) {
+            return a.time < b.time;
+        });
+    }
+
+    // Move to the pose at time, the step ends at time + timeStep.
+    void update(float time, float timeStep) {
+        pose(time, rotation, translation);
+        pose(time + timeStep, nextRotation, nextTranslation);
+    }
+
+    // Pose at time as rest -> rotation * rest + translation.
+    void pose(float time, Eigen::Matrix3f &poseRotation, Vector3f &poseTranslation) const {
+        auto next = std::upper_bound(keyframes.begin(), keyframes.end(), time, [] (float t, const Keyframe &keyframe) {
+            return t < keyframe.time;
+        });
+        Vector3f offset;
+        if (next == keyframes.begin() || next == keyframes.end()) {
+            const Keyframe &keyframe = next == keyframes.begin() ? keyframes.front() : keyframes.back();
+            poseRotation = keyframe.rotation;
+            offset = keyframe.translation;
+        } else {
+            const Keyframe &a = *(next - 1);
+            const Keyframe &b = *next;
+            float u = (time - a.time) / (b.time - a.time);
+            poseRotation = Eigen::Quaternionf(a.rotation).slerp(u, Eigen::Quaternionf(b.rotation)).toRotationMatrix();
+            offset = (1.f - u) * a.translation + u * b.translation;
+        }
+        poseTranslation = center + offset - poseRotation * center;
+    }
+
+    // Every position the centre of the body reaches, the centres of the keyframes span them.
+    template<typename Func>
+    void forEachCenter(Func func) const {
+        for (const auto &keyframe : keyframes) {
+            func(Vector3f(center + keyframe.translation));
+        }
+    }
+
+private:
+    // Same convention as the rotated collision boxes.
+    static Eigen::Matrix3f eulerRotation(const Vector3f &degrees) {
+        Vector3f radians = degrees * (float(PI) / 180.f);
+        return (Eigen::AngleAxisf(radians.z(), Eigen::Vector3f::UnitZ()) *
+                Eigen::AngleAxisf(radians.y(), Eigen::Vector3f::UnitY()) *
+                Eigen::AngleAxisf(radians.x(), Eigen::Vector3f::UnitX())).toRotationMatrix();
+    }
+};
+
+} // namespace cs224
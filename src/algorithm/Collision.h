@@ -0,0 +1,147 @@
+// Collision primitives for the clamp-and-reflect pass of SPH::adjustParticles.
+//
+// Every primitive is a set of constraint planes. collide(p, func) calls
+// func(n, d) once per plane, where n is the plane normal pointing into the
+// allowed region and d the signed penetration depth of p (d > 0 when p is on
+// the wrong side). The callbacks are templated so the whole pass inlines into
+// the parallel particle loop, and responses can be applied without branches.
+// A signed distance field has a plane per particle, the tangent plane of the
+// surface, and only calls func when p penetrates it.
+
+#pragma once
+
+#include "visualization/geometry/VoxelGrid.h"
+
+#include "utils/Def.h"
+
+#include <Eigen/Geometry>
+
+#include <utility>
+#include <vector>
+
+namespace cs224 {
+
+// Half-space: keeps particles on the side the normal points to.
+struct CollisionPlane {
+    Vector3f normal;
+    float offset;
+
+    CollisionPlane(const Vector3f &point, const Vector3f &n) {
+        normal = n.normalized();
+        offset = normal.dot(point);
+    }
+
+    template<typename Func>
+    inline void collide(const Vector3f &p, Func func) const {
+        func(normal, offset - normal.dot(p));
+    }
+};
+
+// Oriented box: keeps particles inside. The box is given by its axis aligned
+// bounds and a rotation around its center (euler angles in degrees, applied
+// in x, y, z order).
+struct CollisionBox {
+    Vector3f center;
+    Vector3f halfExtents;
+    Vector3f axes[3];
+
+    CollisionBox(const Box3f &bounds, const Vector3f &rotation = Vector3f(0.f)) {
+        center = bounds.center();
+        halfExtents = 0.5f * bounds.extents();
+        Eigen::Matrix3f m = (Eigen::AngleAxisf(toRadians(rotation.z()), Eigen::Vector3f::UnitZ()) *
+                             Eigen::AngleAxisf(toRadians(rotation.y()), Eigen::Vector3f::UnitY()) *
+                             Eigen::AngleAxisf(toRadians(rotation.x()), Eigen::Vector3f::UnitX())).toRotationMatrix();
+        for (int k = 0; k < 3; ++k) {
+            axes[k] = m.col(k);
+        }
+    }
+
+    template<typename Func>
+    inline void collide(const Vector3f &p, Func func) const {
+        // p may be moved by func, so every face re-reads it.
+        for (int k = 0; k < 3; ++k) {
+            func(axes[k], -halfExtents[k] - axes[k].dot(p - center));
+            func(-axes[k], axes[k].dot(p - center) - halfExtents[k]);
+        }
+    }
+
+private:
+    static float toRadians(float degrees) { return degrees * float(PI) / 180.f; }
+};
+
+// Solid of a closed mesh given by its signed distance field (negative inside, sampled at
+// the voxel corners, see ParticleGenerator::generateSDF): keeps particles margin outside
+// of the surface. The normal is the gradient of the field, particles outside of the
+// field are not tested. The field of a moving mesh stays in the rest frame of the mesh,
+// the frame maps it to the current pose (x -> rotation * x + translation).
+struct CollisionSDF {
+    VoxelGrid<float> sdf;
+    float margin;
+    Vector3f maxVoxel;
+    Eigen::Matrix3f rotation = Eigen::Matrix3f::Identity();
+    Vector3f translation = Vector3f(0.f);
+
+    CollisionSDF(VoxelGrid<float> sdf, float margin) : sdf(std::move(sdf)), margin(margin) {
+        maxVoxel = this->sdf.size().cast<float>() - Vector3f(0.5f);
+    }
+
+    void setFrame(const Eigen::Matrix3f &frameRotation, const Vector3f &frameTranslation) {
+        rotation = frameRotation;
+        translation = frameTranslation;
+    }
+
+    template<typename Func>
+    inline void collide(const Vector3f &p, Func func) const {
+        // trilinear expects the values at the voxel centres.
+        Vector3f v = sdf.toVoxelSpace(Vector3f(rotation.transpose() * (p - translation))) + Vector3f(0.5f);
+        if ((v.array() < 0.5f).any() || (v.array() > maxVoxel.array()).any()) {
+            return;
+        }
+        float d = margin - sdf.trilinear(v);
+        if (d > 0.f) {
+            Vector3f n = sdf.gradient(v, 0.5f);
+            float length = n.norm();
+            if (length > 0.f) {
+                func(Vector3f(rotation * n) * (1.f / length), d);
+            }
+        }
+    }
+};
+
+class CollisionSet {
+public:
+    void clear() {
+        m_boxes.clear();
+        m_planes.clear();
+        m_sdfs.clear();
+    }
+
+    void add(const CollisionBox &box) { m_boxes.emplace_back(box); }
+    void add(const CollisionPlane &plane) { m_planes.emplace_back(plane); }
+    void add(CollisionSDF &&sdf) { m_sdfs.emplace_back(std::move(sdf)); }
+
+    size_t sdfCount() const { return m_sdfs.size(); }
+    void setFrame(size_t sdf, const Eigen::Matrix3f &rotation, const Vector3f &translation) { m_sdfs[sdf].setFrame(rotation, translation); }
+
+    bool empty() const { return m_boxes.empty() && m_planes.empty() && m_sdfs.empty(); }
+
+    template<typename Func>
+    inline void collide(const Vector3f &p, Func func) const {
+        for (const auto &box : m_boxes) {
+            box.collide(p, func);
+        }
+        for (const auto &plane : m_planes) {
+            plane.collide(p, func);
+        }
+        for (const auto &sdf : m_sdfs) {
+            sdf.collide(p, func);
+        }
+    }
+
+private:
+    std::vector<CollisionBox> m_boxes;
+    std::vector<CollisionPlane> m_planes;
+    std::vector<CollisionSDF> m_sdfs;
+};
+
+} // namespace cs224
@@ -0,0 +1,112 @@
+// Inflow and outflow of fluid particles, see SPH::updatePool.
+//
+// An emitter holds the layout of one layer of particles on its disc or
+// rectangle, a lattice with the particle diameter as spacing. Every step the
+// emitter advances by speed * dt, and whenever it advanced by another
+// diameter a new layer leaves it, already moved by the remaining distance.
+// Sinks reuse the collision primitives: a box removes the particles inside
+// of it, a plane the particles behind it.
+
+#pragma once
+
+#include "Collision.h"
+
+#include "utils/Def.h"
+
+#include <vector>
+
+namespace cs224 {
+
+struct Emitter {
+    Vector3f position;
+    Vector3f direction;
+    float speed;
+    float start;
+    float end;
+    float spacing;
+    std::vector<Vector3f> layer;  // offsets of the particles of a layer from position
+    float distance = 0.f;         // travelled since the last layer left
+
+    // Lattice of a disc (radius > 0) or a width x height rectangle around position,
+    // perpendicular to direction. width runs along up x direction.
+    Emitter(const Vector3f &position, const Vector3f &direction, const Vector3f &up, float speed,
+            float radius, float width, float height, float start, float end, float spacing) :
+        position(position), direction(direction.normalized()), speed(speed), start(start), end(end), spacing(spacing) {
+
+        Vector3f u = up.cross(this->direction);
+        if (u.squaredNorm() < 1e-6f) {
+            u = this->direction.unitOrthogonal();
+        }
+        u.normalize();
+        Vector3f v = this->direction.cross(u);
+
+        float halfWidth = radius > 0.f ? radius : 0.5f * width;
+        float halfHeight = radius > 0.f ? radius : 0.5f * height;
+        int nu = std::max(1, int(std::floor(2.f * halfWidth / spacing)));
+        int nv = std::max(1, int(std::floor(2.f * halfHeight / spacing)));
+        for (int i = 0; i < nu; ++i) {
+            for (int j = 0; j < nv; ++j) {
+                float a = (i - 0.5f * (nu - 1)) * spacing;
+                float b = (j - 0.5f * (nv - 1)) * spacing;
+                if (radius > 0.f && pow2(a) + pow2(b) > pow2(radius)) {
+                    continue;
+                }
+                layer.emplace_back(a * u + b * v);
+            }
+        }
+    }
+
+    // Advance by one time step ending at time, calling func(position, velocity) for every
+    // particle of the layers that left the emitter during the step.
+    template<typename Func>
+    void emit(float time, float timeStep, Func func) {
+        if (time < start || time > end) {
+            return;
+        }
+        distance += speed * timeStep;
+        const Vector3f velocity = speed * direction;
+        while (distance >= spacing) {
+            distance -= spacing;
+            for (const Vector3f &offset : layer) {
+                func(position + offset + distance * direction, velocity);
+            }
+        }
+    }
+};
+
+class SinkSet {
+public:
+    void add(const CollisionBox &box) { m_boxes.emplace_back(box); }
+    void add(const CollisionPlane &plane) { m_planes.emplace_back(plane); }
+
+    bool empty() const { return m_boxes.empty() && m_planes.empty(); }
+
+    // Whether a particle at p is removed.
+    inline bool contains(const Vector3f &p) const {
+        for (const auto &box : m_boxes) {
+            bool inside = true;
+            box.collide(p, [&] (const Vector3f &n, float d) {
+                inside = inside && d <= 0.f;
+            });
+            if (inside) {
+                return true;
+            }
+        }
+        for (const auto &plane : m_planes) {
+            bool behind = false;
+            plane.collide(p, [&] (const Vector3f &n, float d) {
+                behind = d > 0.f;
+            });
+            if (behind) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    std::vector<CollisionBox> m_boxes;
+    std::vector<CollisionPlane> m_planes;
+};
+
+} // namespace cs224
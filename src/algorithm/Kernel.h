@@ -8,6 +8,17 @@
 // 3. Viscosity : For interpolating viscosity computations
 // 4. Surface tension : For interpolating surface tensions
 // Zihao Li 2016/4/16
+//
+// Poly6 and spiky form the Muller kernel family. The density kernel and its
+// gradients can also come from the cubic spline or the Wendland C2/C4 kernels
+// ("kernel" setting), the viscosity and surface tension kernels are shared by
+// every family. All families have the same interface:
+//   density(r2)      * densityC      : W(r)
+//   densityGrad(r2)  * densityGradC  : gradient of W divided by r (normals, density variance scale)
+//   pressureGrad(r2) * pressureGradC : pressure gradient divided by r
+// plus viscosityLaplace(r2) * viscosityGrad2 and r * cohesion(r2) * surfaceTensionConstant
+// from Kernel. The SPH phases are templated on the family, so the per pair
+// terms inline into the neighbour loops. h is the support radius of every family.
 
 #pragma once
 
@@ -16,32 +27,32 @@
 namespace cs224 {
 
 struct Kernel {
-  
+
+    enum Family {
+        Muller,
+        CubicSpline,
+        WendlandC2,
+        WendlandC4
+    };
+
 	// Declear the constant part of the kernel.
 	// The constant part of the kernel is independent from
 	// the particle geometry and physical status.
 	// Since the efficiency of the kernel significantly
 	// affect the efficiency of the simulation since each
-	// iteration involves kernel computation, its 
-	// good to pre-compute all constant values. 
+	// iteration involves kernel computation, its
+	// good to pre-compute all constant values.
 
 	// Smoothing Length : represents "h" in the paper
 	float smoothLength, squaredSmoothLength, halfSmoothLength;
 	float pow6SmoothLength, pow9SmoothLength;
 
-	// Poly6 kernel constants (3.12~3.14)
-	// Poly6 Constant, Poly6 first/second order derivative constant.
-	float poly6C, poly6Grad1, poly6Grad2;
-
-	// Spiky kernel constants (3.15)
-	float spikyGrad1;
-
 	// Viscosity kernel constants (3.16)
-	float viscosityGrad2; 
+	float viscosityGrad2;
+
+	// Surface tension constants
+	float surfaceTensionConstant,surfaceTensionOffset;
 
-	// Surface tension constants 
-	float surfaceTensionConstant,surfaceTensionOffset; 
-    
     // Build the kernel
     void buildKernel(float h) {
     	smoothLength = h;
@@ -49,55 +60,151 @@ struct Kernel {
         halfSmoothLength = 0.5f * smoothLength;
         pow6SmoothLength = pow6(smoothLength);
         pow9SmoothLength = pow9(smoothLength);
-        poly6C = 315.f / (64.f * PI * pow9SmoothLength);
-        poly6Grad1 = -945.f / (32.f * PI * pow9SmoothLength);
-        poly6Grad2 = -945.f / (32.f * PI * pow9SmoothLength);
-        spikyGrad1 = -45.f / (PI * pow6SmoothLength);
         viscosityGrad2 = 45.f / (PI * pow6SmoothLength);
-        
+
         surfaceTensionConstant = 32.f / (PI * pow9SmoothLength);
         surfaceTensionOffset = -pow6SmoothLength / 64.f;
     }
 
 
     // Below this part is the variant part of kernel.
-    // The variant part of the kernel is based on the 
+    // The variant part of the kernel is based on the
     // squared distance between the current particle and
     // referencing neighbour particle, and the vector <r - rn>.
 
+    // Viscosity kernel (3.16)
+    inline float viscosityLaplace(float squaredR) const {
+        return smoothLength - std::sqrt(squaredR);
+    }
+
+    // Surface tension
+    inline float surfaceTension(float normalizedR) const {
+        if (normalizedR < halfSmoothLength) {
+            return 2.f * pow3(smoothLength - normalizedR) * pow3(normalizedR) + surfaceTensionOffset;
+        } else {
+            return pow3(normalizedR) * pow3(smoothLength - normalizedR);
+        }
+    }
+
+    // Surface tension divided by r, the cohesion force points along r.
+    inline float cohesion(float squaredR) const {
+        float normalizedR = std::sqrt(squaredR);
+        return surfaceTension(normalizedR) / normalizedR;
+    }
+};
+
+struct MullerKernel : Kernel {
+
+	// Poly6 kernel constants (3.12~3.13)
+	// Poly6 Constant, Poly6 first order derivative constant.
+	float densityC, densityGradC;
+
+	// Spiky kernel constants (3.15)
+	float pressureGradC;
+
+    void build(float h) {
+        buildKernel(h);
+        densityC = 315.f / (64.f * PI * pow9SmoothLength);
+        densityGradC = -945.f / (32.f * PI * pow9SmoothLength);
+        pressureGradC = -45.f / (PI * pow6SmoothLength);
+    }
+
     // Poly6 kernel (3.12)
-    inline float poly6(float squaredR) const {
+    inline float density(float squaredR) const {
         return pow3(squaredSmoothLength - squaredR);
     }
-    
+
     // First order gradiant variant term of poly6 kernel (3.13)
-    inline Vector3f poly6Grad(const Vector3f &r, float squaredR) const {
-    	return r * pow2(squaredSmoothLength - squaredR);
+    inline float densityGrad(float squaredR) const {
+    	return pow2(squaredSmoothLength - squaredR);
     }
 
-    // Second order gradiant variant term of poly6 kernel (3.14)
-    inline float poly6Laplace(float squaredR) const {
-    	return (squaredSmoothLength - squaredR) * (3.f * squaredSmoothLength - 7.f * squaredR);
+    // Spiky kernel (3.15)
+    inline float pressureGrad(float squaredR) const {
+        float normalizedR = std::sqrt(squaredR);
+        return pow2(smoothLength - normalizedR) / normalizedR;
     }
+};
 
-    // Spiky kernel (3.15)
-    inline Vector3f spikyGrad(const Vector3f &r, float normalizedR) const {
-        return r * (1.f / normalizedR) * pow2(smoothLength - normalizedR);
-    } 
+// Cubic spline kernel (Monaghan 1992), q = r / h.
+struct CubicSplineKernel : Kernel {
+    float densityC, densityGradC, pressureGradC;
+    float inverseSmoothLength;
 
-    // Viscosity kernel (3.16)
-    inline float viscosityLaplace(float normalizedR) const {
-        return smoothLength - normalizedR;
+    void build(float h) {
+        buildKernel(h);
+        inverseSmoothLength = 1.f / h;
+        densityC = 8.f / (PI * pow3(h));
+        densityGradC = pressureGradC = 48.f / (PI * pow5(h));
     }
 
-    // Surface tension
-    inline float surfaceTension(float normalizedR) const {
-        if (normalizedR < halfSmoothLength) {
-            return 2.f * pow3(smoothLength - normalizedR) * pow3(normalizedR) + surfaceTensionOffset;
-        } else {
-            return pow3(normalizedR) * pow3(smoothLength - normalizedR);
-        }
+    inline float density(float squaredR) const {
+        float q = std::sqrt(squaredR) * inverseSmoothLength;
+        return q <= 0.5f ? 6.f * (pow3(q) - pow2(q)) + 1.f : 2.f * pow3(1.f - q);
+    }
+
+    inline float densityGrad(float squaredR) const {
+        float q = std::sqrt(squaredR) * inverseSmoothLength;
+        return q <= 0.5f ? 3.f * q - 2.f : -pow2(1.f - q) / q;
+    }
+
+    inline float pressureGrad(float squaredR) const {
+        return densityGrad(squaredR);
+    }
+};
+
+// Wendland C2 kernel (Wendland 1995, 3D), q = r / h.
+struct WendlandC2Kernel : Kernel {
+    float densityC, densityGradC, pressureGradC;
+    float inverseSmoothLength;
+
+    void build(float h) {
+        buildKernel(h);
+        inverseSmoothLength = 1.f / h;
+        densityC = 21.f / (2.f * PI * pow3(h));
+        densityGradC = pressureGradC = -210.f / (PI * pow5(h));
+    }
+
+    inline float density(float squaredR) const {
+        float q = std::sqrt(squaredR) * inverseSmoothLength;
+        return pow4(1.f - q) * (1.f + 4.f * q);
+    }
+
+    inline float densityGrad(float squaredR) const {
+        float q = std::sqrt(squaredR) * inverseSmoothLength;
+        return pow3(1.f - q);
+    }
+
+    inline float pressureGrad(float squaredR) const {
+        return densityGrad(squaredR);
+    }
+};
+
+// Wendland C4 kernel (Wendland 1995, 3D), q = r / h.
+struct WendlandC4Kernel : Kernel {
+    float densityC, densityGradC, pressureGradC;
+    float inverseSmoothLength;
+
+    void build(float h) {
+        buildKernel(h);
+        inverseSmoothLength = 1.f / h;
+        densityC = 495.f / (32.f * PI * pow3(h));
+        densityGradC = pressureGradC = -1155.f / (4.f * PI * pow5(h));
+    }
+
+    inline float density(float squaredR) const {
+        float q = std::sqrt(squaredR) * inverseSmoothLength;
+        return pow6(1.f - q) * (1.f + 6.f * q + 35.f / 3.f * pow2(q));
+    }
+
+    inline float densityGrad(float squaredR) const {
+        float q = std::sqrt(squaredR) * inverseSmoothLength;
+        return pow5(1.f - q) * (1.f + 5.f * q);
+    }
+
+    inline float pressureGrad(float squaredR) const {
+        return densityGrad(squaredR);
     }
 };
 
-}
\ No newline at end of file
+}
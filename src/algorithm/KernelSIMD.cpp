@@ -0,0 +1,302 @@
+#include "KernelSIMD.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+    #define PCI_SIMD_X86 1
+    #include <immintrin.h>
+    #if defined(_MSC_VER)
+        #include <intrin.h>
+    #endif
+#endif
+
+// GCC and Clang only emit AVX instructions in functions compiled for the target,
+// so the rest of the library keeps its baseline instruction set.
+#if defined(__GNUC__) || defined(__clang__)
+    #define PCI_TARGET_AVX2 __attribute__((target("avx2,fma")))
+    #define PCI_TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+    #define PCI_TARGET_AVX2
+    #define PCI_TARGET_AVX512
+#endif
+
+namespace cs224 {
+namespace KernelSIMD {
+
+// ---------------- Scalar ----------------
+
+static float poly6SumScalar(const uint32_t *indices, uint32_t count,
+                            const float *x, const float *y, const float *z,
+                            const Vector3f &p, float squaredH, const float *weights) {
+    float sum = 0.f;
+    for (uint32_t k = 0; k < count; ++k) {
+        uint32_t j = indices[k];
+        float r2 = pow2(p.x() - x[j]) + pow2(p.y() - y[j]) + pow2(p.z() - z[j]);
+        if (r2 < squaredH) {
+            sum += pow3(squaredH - r2) * (weights ? weights[j] : 1.f);
+        }
+    }
+    return sum;
+}
+
+static Vector3f spikyGradSumScalar(const uint32_t *indices, uint32_t count,
+                                   const float *x, const float *y, const float *z,
+                                   const Vector3f &p, float h, float squaredH,
+                                   const float *weights, float a, float c, const float *s) {
+    Vector3f sum;
+    for (uint32_t k = 0; k < count; ++k) {
+        uint32_t j = indices[k];
+        Vector3f r(p.x() - x[j], p.y() - y[j], p.z() - z[j]);
+        float r2 = r.squaredNorm();
+        if (r2 < 1e-5f || r2 >= squaredH) {
+            continue;
+        }
+        float rn = std::sqrt(r2);
+        float w = (weights ? weights[j] : 1.f) * (a + c * s[j]);
+        sum += r * (w * pow2(h - rn) / rn);
+    }
+    return sum;
+}
+
+#if defined(PCI_SIMD_X86)
+
+// ---------------- AVX2 ----------------
+
+PCI_TARGET_AVX2
+static inline float horizontalSum(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+// Mask of the first n of 8 lanes.
+PCI_TARGET_AVX2
+static inline __m256i laneMask(uint32_t n) {
+    return _mm256_cmpgt_epi32(_mm256_set1_epi32(int(n)), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+}
+
+// Load 8 neighbour indices and the squared distances to p, lanes outside the mask get r^2 = 0 and index 0.
+PCI_TARGET_AVX2
+static inline __m256 distancesAVX2(const uint32_t *indices, __m256i mask, const float *x, const float *y, const float *z,
+                                   __m256 px, __m256 py, __m256 pz, __m256i &index, __m256 &rx, __m256 &ry, __m256 &rz) {
+    index = _mm256_maskload_epi32(reinterpret_cast<const int *>(indices), mask);
+    __m256 fmask = _mm256_castsi256_ps(mask);
+    __m256 zero = _mm256_setzero_ps();
+    rx = _mm256_and_ps(_mm256_sub_ps(px, _mm256_mask_i32gather_ps(zero, x, index, fmask, 4)), fmask);
+    ry = _mm256_and_ps(_mm256_sub_ps(py, _mm256_mask_i32gather_ps(zero, y, index, fmask, 4)), fmask);
+    rz = _mm256_and_ps(_mm256_sub_ps(pz, _mm256_mask_i32gather_ps(zero, z, index, fmask, 4)), fmask);
+    return _mm256_fmadd_ps(rx, rx, _mm256_fmadd_ps(ry, ry, _mm256_mul_ps(rz, rz)));
+}
+
+PCI_TARGET_AVX2
+static float poly6SumAVX2(const uint32_t *indices, uint32_t count,
+                          const float *x, const float *y, const float *z,
+                          const Vector3f &p, float squaredH, const float *weights) {
+    const __m256 px = _mm256_set1_ps(p.x()), py = _mm256_set1_ps(p.y()), pz = _mm256_set1_ps(p.z());
+    const __m256 h2 = _mm256_set1_ps(squaredH);
+    __m256 sum = _mm256_setzero_ps();
+
+    for (uint32_t k = 0; k < count; k += 8) {
+        __m256i mask = laneMask(count - k);
+        __m256i index;
+        __m256 rx, ry, rz;
+        __m256 r2 = distancesAVX2(indices + k, mask, x, y, z, px, py, pz, index, rx, ry, rz);
+        __m256 valid = _mm256_and_ps(_mm256_castsi256_ps(mask), _mm256_cmp_ps(r2, h2, _CMP_LT_OQ));
+        __m256 d = _mm256_sub_ps(h2, r2);
+        __m256 term = _mm256_mul_ps(_mm256_mul_ps(d, d), d);
+        if (weights) {
+            term = _mm256_mul_ps(term, _mm256_mask_i32gather_ps(_mm256_setzero_ps(), weights, index, valid, 4));
+        }
+        sum = _mm256_add_ps(sum, _mm256_and_ps(term, valid));
+    }
+    return horizontalSum(sum);
+}
+
+PCI_TARGET_AVX2
+static Vector3f spikyGradSumAVX2(const uint32_t *indices, uint32_t count,
+                                 const float *x, const float *y, const float *z,
+                                 const Vector3f &p, float h, float squaredH,
+                                 const float *weights, float a, float c, const float *s) {
+    const __m256 px = _mm256_set1_ps(p.x()), py = _mm256_set1_ps(p.y()), pz = _mm256_set1_ps(p.z());
+    const __m256 vh = _mm256_set1_ps(h), h2 = _mm256_set1_ps(squaredH);
+    const __m256 va = _mm256_set1_ps(a), vc = _mm256_set1_ps(c), minR2 = _mm256_set1_ps(1e-5f);
+    const __m256 zero = _mm256_setzero_ps();
+    __m256 sx = zero, sy = zero, sz = zero;
+
+    for (uint32_t k = 0; k < count; k += 8) {
+        __m256i mask = laneMask(count - k);
+        __m256i index;
+        __m256 rx, ry, rz;
+        __m256 r2 = distancesAVX2(indices + k, mask, x, y, z, px, py, pz, index, rx, ry, rz);
+        __m256 valid = _mm256_and_ps(_mm256_castsi256_ps(mask),
+                       _mm256_and_ps(_mm256_cmp_ps(r2, h2, _CMP_LT_OQ), _mm256_cmp_ps(r2, minR2, _CMP_GE_OQ)));
+        if (_mm256_testz_ps(valid, valid)) {
+            continue;
+        }
+        // Invalid lanes may divide by zero, their coefficient is masked out below.
+        __m256 rn = _mm256_sqrt_ps(r2);
+        __m256 d = _mm256_sub_ps(vh, rn);
+        __m256 w = _mm256_fmadd_ps(vc, _mm256_mask_i32gather_ps(zero, s, index, valid, 4), va);
+        if (weights) {
+            w = _mm256_mul_ps(w, _mm256_mask_i32gather_ps(zero, weights, index, valid, 4));
+        }
+        __m256 coef = _mm256_and_ps(_mm256_div_ps(_mm256_mul_ps(w, _mm256_mul_ps(d, d)), rn), valid);
+        sx = _mm256_fmadd_ps(coef, rx, sx);
+        sy = _mm256_fmadd_ps(coef, ry, sy);
+        sz = _mm256_fmadd_ps(coef, rz, sz);
+    }
+    return Vector3f(horizontalSum(sx), horizontalSum(sy), horizontalSum(sz));
+}
+
+// ---------------- AVX-512 ----------------
+
+PCI_TARGET_AVX512
+static inline __mmask16 laneMask16(uint32_t n) {
+    return n >= 16 ? __mmask16(0xffff) : __mmask16((1u << n) - 1u);
+}
+
+PCI_TARGET_AVX512
+static inline __m512 distancesAVX512(const uint32_t *indices, __mmask16 mask, const float *x, const float *y, const float *z,
+                                     __m512 px, __m512 py, __m512 pz, __m512i &index, __m512 &rx, __m512 &ry, __m512 &rz) {
+    index = _mm512_maskz_loadu_epi32(mask, indices);
+    __m512 zero = _mm512_setzero_ps();
+    rx = _mm512_maskz_sub_ps(mask, px, _mm512_mask_i32gather_ps(zero, mask, index, x, 4));
+    ry = _mm512_maskz_sub_ps(mask, py, _mm512_mask_i32gather_ps(zero, mask, index, y, 4));
+    rz = _mm512_maskz_sub_ps(mask, pz, _mm512_mask_i32gather_ps(zero, mask, index, z, 4));
+    return _mm512_fmadd_ps(rx, rx, _mm512_fmadd_ps(ry, ry, _mm512_mul_ps(rz, rz)));
+}
+
+PCI_TARGET_AVX512
+static float poly6SumAVX512(const uint32_t *indices, uint32_t count,
+                            const float *x, const float *y, const float *z,
+                            const Vector3f &p, float squaredH, const float *weights) {
+    const __m512 px = _mm512_set1_ps(p.x()), py = _mm512_set1_ps(p.y()), pz = _mm512_set1_ps(p.z());
+    const __m512 h2 = _mm512_set1_ps(squaredH);
+    __m512 sum = _mm512_setzero_ps();
+
+    for (uint32_t k = 0; k < count; k += 16) {
+        __mmask16 mask = laneMask16(count - k);
+        __m512i index;
+        __m512 rx, ry, rz;
+        __m512 r2 = distancesAVX512(indices + k, mask, x, y, z, px, py, pz, index, rx, ry, rz);
+        __mmask16 valid = _mm512_mask_cmp_ps_mask(mask, r2, h2, _CMP_LT_OQ);
+        __m512 d = _mm512_sub_ps(h2, r2);
+        __m512 term = _mm512_mul_ps(_mm512_mul_ps(d, d), d);
+        if (weights) {
+            term = _mm512_mul_ps(term, _mm512_mask_i32gather_ps(_mm512_setzero_ps(), valid, index, weights, 4));
+        }
+        sum = _mm512_mask_add_ps(sum, valid, sum, term);
+    }
+    return _mm512_reduce_add_ps(sum);
+}
+
+PCI_TARGET_AVX512
+static Vector3f spikyGradSumAVX512(const uint32_t *indices, uint32_t count,
+                                   const float *x, const float *y, const float *z,
+                                   const Vector3f &p, float h, float squaredH,
+                                   const float *weights, float a, float c, const float *s) {
+    const __m512 px = _mm512_set1_ps(p.x()), py = _mm512_set1_ps(p.y()), pz = _mm512_set1_ps(p.z());
+    const __m512 vh = _mm512_set1_ps(h), h2 = _mm512_set1_ps(squaredH);
+    const __m512 va = _mm512_set1_ps(a), vc = _mm512_set1_ps(c), minR2 = _mm512_set1_ps(1e-5f);
+    const __m512 zero = _mm512_setzero_ps();
+    __m512 sx = zero, sy = zero, sz = zero;
+
+    for (uint32_t k = 0; k < count; k += 16) {
+        __mmask16 mask = laneMask16(count - k);
+        __m512i index;
+        __m512 rx, ry, rz;
+        __m512 r2 = distancesAVX512(indices + k, mask, x, y, z, px, py, pz, index, rx, ry, rz);
+        __mmask16 valid = _mm512_mask_cmp_ps_mask(_mm512_mask_cmp_ps_mask(mask, r2, h2, _CMP_LT_OQ), r2, minR2, _CMP_GE_OQ);
+        if (!valid) {
+            continue;
+        }
+        __m512 rn = _mm512_maskz_sqrt_ps(valid, r2);
+        __m512 d = _mm512_sub_ps(vh, rn);
+        __m512 w = _mm512_fmadd_ps(vc, _mm512_mask_i32gather_ps(zero, valid, index, s, 4), va);
+        if (weights) {
+            w = _mm512_mul_ps(w, _mm512_mask_i32gather_ps(zero, valid, index, weights, 4));
+        }
+        __m512 coef = _mm512_maskz_div_ps(valid, _mm512_mul_ps(w, _mm512_mul_ps(d, d)), rn);
+        sx = _mm512_fmadd_ps(coef, rx, sx);
+        sy = _mm512_fmadd_ps(coef, ry, sy);
+        sz = _mm512_fmadd_ps(coef, rz, sz);
+    }
+    return Vector3f(_mm512_reduce_add_ps(sx), _mm512_reduce_add_ps(sy), _mm512_reduce_add_ps(sz));
+}
+
+#endif // PCI_SIMD_X86
+
+// ---------------- Dispatch ----------------
+
+Level detect() {
+#if defined(PCI_SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return AVX2;
+    }
+#elif defined(PCI_SIMD_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool fma = (info[2] & (1 << 12)) != 0;
+    if (osxsave) {
+        unsigned long long xcr0 = _xgetbv(0);
+        __cpuidex(info, 7, 0);
+        bool avx2 = (info[1] & (1 << 5)) != 0;
+        bool avx512f = (info[1] & (1 << 16)) != 0;
+        if (avx512f && (xcr0 & 0xe6) == 0xe6) {
+            return AVX512;
+        }
+        if (avx2 && fma && (xcr0 & 0x6) == 0x6) {
+            return AVX2;
+        }
+    }
+#endif
+    return Scalar;
+}
+
+Level select(const std::string &name) {
+    Level supported = detect();
+    Level requested = supported;
+    if (name == "scalar") {
+        requested = Scalar;
+    } else if (name == "avx2") {
+        requested = AVX2;
+    } else if (name == "avx512") {
+        requested = AVX512;
+    } else if (name != "auto") {
+        std::cout << "Unknown simd level " << name << ", using auto" << std::endl;
+    }
+    return std::min(requested, supported);
+}
+
+const char *name(Level level) {
+    switch (level) {
+    case AVX2: return "avx2";
+    case AVX512: return "avx512";
+    default: return "scalar";
+    }
+}
+
+const Functions &functions(Level level) {
+    static const Functions scalar = { poly6SumScalar, spikyGradSumScalar };
+#if defined(PCI_SIMD_X86)
+    static const Functions avx2 = { poly6SumAVX2, spikyGradSumAVX2 };
+    static const Functions avx512 = { poly6SumAVX512, spikyGradSumAVX512 };
+    switch (level) {
+    case AVX2: return avx2;
+    case AVX512: return avx512;
+    default: break;
+    }
+#endif
+    return scalar;
+}
+
+} // namespace KernelSIMD
+} // namespace cs224
@@ -0,0 +1,58 @@
+// Vectorized neighbour sums for the hottest loops of the PCISPH correction loop
+// (the densities in updatePressures and the pressure forces in updatePressureForces).
+//
+// Each function processes the neighbour list of one particle, gathering the
+// neighbour positions from structure-of-arrays storage, and evaluates 8 (AVX2)
+// or 16 (AVX-512) neighbours per instruction. The instruction set is selected
+// at runtime, the scalar implementation is the fallback on every other CPU.
+//
+// The sums use exact square roots and divisions, the results only differ from
+// the scalar path by the summation order: the relative difference of a sum is
+// below 1e-5 (tested with random neighbourhoods of 1 to 300 particles).
+//
+// Like the variant terms in Kernel.h, the sums leave out the kernel constants:
+// callers still multiply by poly6C, spikyGrad1 and the masses.
+
+#pragma once
+
+#include "utils/Def.h"
+
+#include <cstdint>
+#include <string>
+
+namespace cs224 {
+namespace KernelSIMD {
+
+enum Level {
+    Scalar,
+    AVX2,
+    AVX512
+};
+
+// Best instruction set supported by the running CPU.
+Level detect();
+
+// Parse a level name ("scalar", "avx2", "avx512" or "auto") and clamp it to the detected level.
+Level select(const std::string &name);
+
+const char *name(Level level);
+
+struct Functions {
+    // Sum of the poly6 variant terms (h^2 - r^2)^3 over the neighbours closer than h,
+    // weighted by weights[j] if weights is not null.
+    float (*poly6Sum)(const uint32_t *indices, uint32_t count,
+                      const float *x, const float *y, const float *z,
+                      const Vector3f &p, float squaredH, const float *weights);
+
+    // Sum of w_j * (a + c * s[j]) * r * (h - |r|)^2 / |r| over the neighbours with
+    // 1e-5 <= r^2 < h^2, where w_j = weights[j] or 1 if weights is null.
+    Vector3f (*spikyGradSum)(const uint32_t *indices, uint32_t count,
+                             const float *x, const float *y, const float *z,
+                             const Vector3f &p, float h, float squaredH,
+                             const float *weights, float a, float c, const float *s);
+};
+
+const Functions &functions(Level level);
+
+} // namespace KernelSIMD
+} // namespace cs224
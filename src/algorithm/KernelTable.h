@@ -0,0 +1,101 @@
+// Tabulated kernel backend ("kernelBackend" : "table").
+//
+// The kernel families of Kernel.h evaluate their terms analytically, which
+// takes a sqrt per pair for every term that is not polynomial in r^2.
+// TabulatedKernel precomputes the variant terms of a family on a uniform grid
+// over r^2 in [0, h^2] and linearly interpolates, so no sqrt and no branch is
+// needed per pair. It has the same interface as the families, the SPH phases
+// are instantiated once for the table, whichever family it was built from.
+//
+// The resolution is the number of table intervals, the interpolation error
+// decreases quadratically with it (see the "kernels" suite of pcisph_bench).
+// The pressure gradient of the Muller family and the cohesion term are
+// divided by |r| and diverge at r = 0, the first entry of every table is
+// clamped to the value of the second one. All evaluators expect r^2 < h^2.
+
+#pragma once
+
+#include "Kernel.h"
+
+#include <vector>
+
+namespace cs224 {
+
+class TabulatedKernel {
+public:
+    // Constant factors, copied from the family.
+    float densityC, densityGradC, pressureGradC;
+    float viscosityGrad2, surfaceTensionConstant;
+
+    template<typename KernelType>
+    void build(const KernelType &W, int resolution) {
+        m_resolution = std::max(resolution, 2);
+        m_inverseStep = m_resolution / W.squaredSmoothLength;
+
+        densityC = W.densityC;
+        densityGradC = W.densityGradC;
+        pressureGradC = W.pressureGradC;
+        viscosityGrad2 = W.viscosityGrad2;
+        surfaceTensionConstant = W.surfaceTensionConstant;
+
+        m_density.resize(m_resolution + 1);
+        m_densityGrad.resize(m_resolution + 1);
+        m_pressureGrad.resize(m_resolution + 1);
+        m_viscosityLaplace.resize(m_resolution + 1);
+        m_cohesion.resize(m_resolution + 1);
+
+        for (int k = 1; k <= m_resolution; ++k) {
+            float squaredR = W.squaredSmoothLength * k / m_resolution;
+            m_density[k] = W.density(squaredR);
+            m_densityGrad[k] = W.densityGrad(squaredR);
+            m_pressureGrad[k] = W.pressureGrad(squaredR);
+            m_viscosityLaplace[k] = W.viscosityLaplace(squaredR);
+            m_cohesion[k] = W.cohesion(squaredR);
+        }
+        m_density[0] = W.density(0.f);
+        m_densityGrad[0] = m_densityGrad[1];
+        m_pressureGrad[0] = m_pressureGrad[1];
+        m_viscosityLaplace[0] = W.viscosityLaplace(0.f);
+        m_cohesion[0] = m_cohesion[1];
+    }
+
+    int resolution() const { return m_resolution; }
+
+    inline float density(float squaredR) const {
+        return lookup(m_density, squaredR);
+    }
+
+    inline float densityGrad(float squaredR) const {
+        return lookup(m_densityGrad, squaredR);
+    }
+
+    inline float pressureGrad(float squaredR) const {
+        return lookup(m_pressureGrad, squaredR);
+    }
+
+    inline float viscosityLaplace(float squaredR) const {
+        return lookup(m_viscosityLaplace, squaredR);
+    }
+
+    inline float cohesion(float squaredR) const {
+        return lookup(m_cohesion, squaredR);
+    }
+
+private:
+    inline float lookup(const std::vector<float> &table, float squaredR) const {
+        float x = squaredR * m_inverseStep;
+        int k = std::min(int(x), m_resolution - 1);
+        float t = x - k;
+        return table[k] + t * (table[k + 1] - table[k]);
+    }
+
+    int m_resolution = 0;
+    float m_inverseStep = 0.f;
+    std::vector<float> m_density;
+    std::vector<float> m_densityGrad;
+    std::vector<float> m_pressureGrad;
+    std::vector<float> m_viscosityLaplace;
+    std::vector<float> m_cohesion;
+};
+
+} // namespace cs224
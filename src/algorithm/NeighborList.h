@@ -0,0 +1,124 @@
+// Per-step neighbour lists.
+//
+// The PCISPH correction loop visits the neighbourhood of every fluid
+// particle several times per step. Instead of walking the 27 grid cells
+// and rejecting most candidates by distance on every visit, the list is
+// built once per step from the grid and stores compact 32-bit neighbour
+// indices with a fixed stride per particle.
+//
+// Neighbours are collected within (kernel radius + skin), so the list
+// still covers the neighbourhood once particles move to their predicted
+// positions during the correction loop, as long as no particle moves by
+// more than half the skin. Queries re-check the actual distance against
+// the kernel radius. Distances on the periodic axes of the grid are
+// minimum images.
+
+#pragma once
+
+#include "utils/Def.h"
+#include "utils/ConcurrentUtils.h"
+#include "visualization/grid/Grid.h"
+
+#include <vector>
+#include <cstdint>
+
+namespace cs224 {
+
+class NeighborList {
+public:
+    // Collect, for each of the count query points, the particles of the grid
+    // closer than radius. capacity is the expected number of neighbours
+    // and only serves as the initial stride, the stride grows when a
+    // particle has more neighbours.
+    template<typename Positions, typename QueryPositions>
+    void build(const Grid &grid, const Positions &positions, const QueryPositions &queries, size_t count, float radius, int capacity) {
+        build(grid, positions, queries, count, radius, capacity, [] (size_t) { return true; });
+    }
+
+    // Same as above, but only collects the neighbours of the query points for
+    // which include(i) is true, the others get empty lists.
+    template<typename Positions, typename QueryPositions, typename Filter>
+    void build(const Grid &grid, const Positions &positions, const QueryPositions &queries, size_t count, float radius, int capacity, Filter include) {
+
+        const PeriodicDomain &domain = grid.domain();
+        const float squaredRadius = pow2(radius);
+        collect(grid, queries, count, radius, capacity, include, [&] (size_t i, size_t j) {
+            return domain.minimumImage(queries[i] - positions[j]).squaredNorm() < squaredRadius;
+        });
+    }
+
+    // Collect, for each of the count query points with include(i), the particles
+    // of the grid within searchRadius for which accept(i, j) is true.
+    template<typename QueryPositions, typename Filter, typename Accept>
+    void collect(const Grid &grid, const QueryPositions &queries, size_t count, float searchRadius, int capacity, Filter include, Accept accept) {
+
+        m_stride = std::max(m_stride, size_t(std::max(capacity, 1)));
+        m_counts.resize(count);
+        m_domain = grid.domain();
+
+        while (true) {
+            m_indices.resize(count * m_stride);
+
+            ConcurrentUtils::ccLoop(count, [&] (size_t i) {
+                if (!include(i)) {
+                    m_counts[i] = 0;
+                    return;
+                }
+                uint32_t *indices = &m_indices[i * m_stride];
+                uint32_t n = 0;
+                grid.lookup(queries[i], searchRadius, [&] (size_t j) {
+                    if (accept(i, j)) {
+                        // keep counting on overflow to know the required stride
+                        if (n < m_stride) {
+                            indices[n] = uint32_t(j);
+                        }
+                        ++n;
+                    }
+                    return true;
+                });
+                m_counts[i] = n;
+            });
+
+            size_t maxCount = 0;
+            for (uint32_t n : m_counts) {
+                maxCount = std::max(maxCount, size_t(n));
+            }
+            if (maxCount <= m_stride) {
+                break;
+            }
+
+            // Overflow: grow the stride with some slack and rebuild.
+            m_stride = maxCount + maxCount / 4;
+        }
+    }
+
+    // Iterate over the listed neighbours of particle i that are closer
+    // than kRadius to p, calling func(j, r, r2) like Grid::query.
+    template<typename Positions, typename Func>
+    inline void query(size_t i, const float kRadius, const Positions &positions, const Vector3f &p, Func func) const {
+        const uint32_t *indices = neighbors(i);
+        const uint32_t n = m_counts[i];
+        const float squaredRadius = pow2(kRadius);
+        for (uint32_t k = 0; k < n; ++k) {
+            size_t j = indices[k];
+            Vector3f r = m_domain.minimumImage(p - positions[j]);
+            float r2 = r.squaredNorm();
+            if (r2 < squaredRadius) {
+                func(j, r, r2);
+            }
+        }
+    }
+
+    inline const uint32_t *neighbors(size_t i) const { return &m_indices[i * m_stride]; }
+    inline uint32_t count(size_t i) const { return m_counts[i]; }
+    size_t size() const { return m_counts.size(); }
+    size_t stride() const { return m_stride; }
+
+private:
+    size_t m_stride = 0;
+    PeriodicDomain m_domain;  // of the grid the lists were built from
+    std::vector<uint32_t> m_counts;
+    std::vector<uint32_t> m_indices;
+};
+
+} // namespace cs224
@@ -0,0 +1,30 @@
+// Structure-of-arrays store for the per-particle fluid state.
+//
+// The SPH class keeps its fluid attributes as PCI3Mf (arrays of
+// unaligned Eigen vectors). When the "soa" particle layout is
+// selected, the attributes read inside the neighbour sweeps are
+// additionally kept here as separate, 64 byte aligned x/y/z float
+// arrays. Only the positions are read by neighbours, the neighbour
+// loops gather them from this store. Everything else (velocities,
+// forces, integration, rendering) keeps working on the PCI3Mf arrays.
+
+#pragma once
+
+#include "utils/Def.h"
+#include "utils/SoA.h"
+
+namespace cs224 {
+
+struct FluidStore {
+    SoA3f positions;
+    SoA3f predictedPositions;
+
+    void resize(size_t n) {
+        positions.resize(n);
+        predictedPositions.resize(n);
+    }
+
+    size_t size() const { return positions.size(); }
+};
+
+} // namespace cs224
@@ -0,0 +1,78 @@
+// Per-particle mass and smoothing length of the fluid particles.
+//
+// UniformResolution is the default: every fluid particle has the mass of
+// particleParams and the kernel radius of kernelParams. All of its factors are
+// 1, so the neighbour loops compile to the plain sums.
+//
+// AdaptiveResolution ("adaptiveResolution") gives fluid particle i the mass
+// mu_i * m and the smoothing length s_i * h, s_i = cbrt(mu_i) <= 1, so a split
+// particle keeps the rest density at a finer spacing. A pair interacts with
+// the mean smoothing length h_ij = h * (s_i + s_j) / 2 (boundary particles have
+// s = 1), which keeps the pair terms symmetric. The kernel of h_ij is the base
+// kernel at the scaled distance k * r, k = h / h_ij >= 1:
+//   W_ij(r)            = k^3 * W(k^2 * r^2)
+//   gradW_ij(r) / r    = k^5 * gradW(k^2 * r^2) / (k * r)   (densityGrad, pressureGrad)
+//   laplaceW_ij(r)     = k^5 * laplaceW(k^2 * r^2)          (viscosityLaplace)
+//   cohesion_ij(r) / r = k^4 * cohesion(k^2 * r^2)
+// Since h_ij <= h, the neighbour lists and grids of the base kernel radius
+// cover every pair; Pair::inside drops the neighbours outside of h_ij.
+// Boundary particles keep their pseudo mass of the base kernel for all pairs.
+//
+// The phases take the policy as a template parameter next to the kernel:
+//   auto P = R.fluidPair(i, j);
+//   if (P.inside(r2)) density += P.w() * W.density(P.arg(r2)) * R.ratio(j);
+
+#pragma once
+
+#include "utils/Def.h"
+
+namespace cs224 {
+
+struct UniformResolution {
+    struct Pair {
+        inline bool inside(float r2) const { return true; }
+        inline float arg(float r2) const { return r2; }
+        inline float w() const { return 1.f; }
+        inline float grad() const { return 1.f; }
+        inline float laplace() const { return 1.f; }
+        inline float cohesion() const { return 1.f; }
+    };
+
+    inline float ratio(size_t i) const { return 1.f; }  // mass relative to particleParams.mass
+    inline float scale(size_t i) const { return 1.f; }  // smoothing length relative to the kernel radius
+
+    inline Pair fluidPair(size_t i, size_t j) const { return Pair(); }
+    inline Pair boundaryPair(size_t i) const { return Pair(); }  // boundary neighbours of fluid particle i
+};
+
+struct AdaptiveResolution {
+    struct Pair {
+        float k;
+        float k2;
+        float squaredRadius;
+
+        Pair(float k, float squaredRadius) : k(k), k2(k * k), squaredRadius(squaredRadius) {}
+
+        inline bool inside(float r2) const { return k2 * r2 < squaredRadius; }
+        inline float arg(float r2) const { return k2 * r2; }
+        inline float w() const { return k2 * k; }
+        inline float grad() const { return k2 * k2 * k; }
+        inline float laplace() const { return k2 * k2 * k; }
+        inline float cohesion() const { return k2 * k2; }
+    };
+
+    const float *ratios;
+    const float *scales;
+    float squaredRadius;  // squared kernel radius
+
+    AdaptiveResolution(const PCI1Mf &ratios, const PCI1Mf &scales, float squaredRadius) :
+        ratios(ratios.data()), scales(scales.data()), squaredRadius(squaredRadius) {}
+
+    inline float ratio(size_t i) const { return ratios[i]; }
+    inline float scale(size_t i) const { return scales[i]; }
+
+    inline Pair fluidPair(size_t i, size_t j) const { return Pair(2.f / (scales[i] + scales[j]), squaredRadius); }
+    inline Pair boundaryPair(size_t i) const { return Pair(2.f / (scales[i] + 1.f), squaredRadius); }
+};
+
+} // namespace cs224
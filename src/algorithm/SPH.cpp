@@ -1,5 +1,30 @@
 #include "SPH.h"
 
+// Runs call with W bound to the kernel of the scene, the table backend or the
+// selected kernel family, e.g. WITH_KERNEL(initDensities(W)).
+#define WITH_KERNEL(call)                                                                   \
+    if (tabulatedKernel) {                                                                  \
+        const TabulatedKernel &W = kernelTable; call;                                       \
+    } else {                                                                                \
+        switch (kernelFamily) {                                                             \
+        case Kernel::Muller: { const MullerKernel &W = mullerKernel; call; break; }         \
+        case Kernel::CubicSpline: { const CubicSplineKernel &W = cubicSplineKernel; call; break; } \
+        case Kernel::WendlandC2: { const WendlandC2Kernel &W = wendlandC2Kernel; call; break; } \
+        case Kernel::WendlandC4: { const WendlandC4Kernel &W = wendlandC4Kernel; call; break; } \
+        }                                                                                   \
+    }
+
+// Runs call with W bound as in WITH_KERNEL and R bound to the resolution policy
+// of the fluid particles (see Resolution.h), e.g. WITH_RESOLUTION(initDensities(W, R)).
+#define WITH_RESOLUTION(call)                                                               \
+    if (adaptiveResolution) {                                                               \
+        const AdaptiveResolution R(fluidMassRatios, fluidScales, kernelParams.squaredRadius); \
+        WITH_KERNEL(call);                                                                  \
+    } else {                                                                                \
+        const UniformResolution R;                                                          \
+        WITH_KERNEL(call);                                                                  \
+    }
+
 namespace cs224 {
 
 // @Func : Constructor of PCISPH class.
@@ -15,32 +40,231 @@ SPH::SPH(const Scene &scene) {
 
     // Load scene settings
     loadParams(scene.settings);
+    adaptiveCamera = scene.camera.position;
     buildScene(scene);
     initBoundary();
     allocMemory(currentFluidPosition.size(), boundaryPositions.size());
-    W.buildKernel(kernelParams.radius);
-    fluidGrid.init(boundaryBox, kernelParams.radius);
-    boundaryGrid.init(boundaryBox, kernelParams.radius);
+    switch (kernelFamily) {
+    case Kernel::Muller: buildKernel(mullerKernel); break;
+    case Kernel::CubicSpline: buildKernel(cubicSplineKernel); break;
+    case Kernel::WendlandC2: buildKernel(wendlandC2Kernel); break;
+    case Kernel::WendlandC4: buildKernel(wendlandC4Kernel); break;
+    }
+    initDensityVarianceScale();
+    solver = PressureSolver::create(scene.settings, *this);
+    if (partialSteps() && !solver->supportsPartialSteps()) {
+        std::cout << "Multi-rate time stepping and sleeping particles are not supported by " << solver->name() << ", disabled" << std::endl;
+        multiRateLevels = 0;
+        sleeping = false;
+    }
+    if (partialSteps() && !boundaryBodies.empty()) {
+        std::cout << "Multi-rate time stepping and sleeping particles are not supported with moving boundaries, disabled" << std::endl;
+        multiRateLevels = 0;
+        sleeping = false;
+    }
+    if (adaptiveResolution && !solver->supportsAdaptiveResolution()) {
+        std::cout << "Adaptive resolution is not supported by " << solver->name() << ", disabled" << std::endl;
+        adaptiveResolution = false;
+    }
+    buildEmitters(scene);
+    fluidGrid.init(boundaryBox, kernelParams.radius, gridOrdering, gridStorage, periodicDomain);
+    boundaryGrid.init(boundaryBox, kernelParams.radius, gridOrdering, gridStorage, periodicDomain);
     buildFluidGrids();
     buildBoundaryGrids();
+    buildNeighborLists();
     massifyBoundary();
+    if (volumeMaps) {
+        buildVolumeMap();
+    }
     basicSimSetup();
+
+    // Opened after the relaxation, so the dump only contains the steps of the actual simulation.
+    if (!profileOutputPath.empty()) {
+        profileOutput.reset(new std::ofstream(profileOutputPath));
+        if (!*profileOutput) {
+            std::cout << "Failed to open the profile output " << profileOutputPath << std::endl;
+            profileOutput.reset();
+        }
+    }
+}
+
+// @Func : Build the selected kernel family for the kernel radius, and the table backend from it.
+template<typename KernelType>
+void SPH::buildKernel(KernelType &W) {
+
+    W.build(kernelParams.radius);
+    if (tabulatedKernel) {
+        kernelTable.build(W, kernelTableResolution);
+    }
+    initKernelCorrections(W);
+}
+
+// @Func : Derive the fluid particle mass and the boundary mass correction from the kernel, with
+//         prototype neighbourhoods on the sampling lattice (spacing = particle diameter).
+//         1. A fluid particle inside the lattice has KERNEL_LATTICE_DENSITY times the rest density.
+//         2. A fluid particle of the lattice one diameter away from a wall (one lattice plane of
+//            boundary particles, the particles of a boundary box) has the rest density. The pseudo
+//            mass of the boundary particles makes the wall sum up to the rest density, it is divided
+//            by the correction so the wall adds what the half lattice of fluid misses.
+//         The Muller kernel at 4 radii gives the masses the simulation was tuned with (1 / 1.1 of the
+//         rest density of a lattice cell, correction 1.20 against the tuned 1.17), other families and
+//         supports get the same densities.
+template<typename KernelType>
+void SPH::initKernelCorrections(const KernelType &W) {
+
+    const float d = particleParams.diameter;
+    const int n = int(std::ceil(kernelParams.radius / d));
+    float latticeSum = 0.f;
+    float halfSum = 0.f;   // the layer of the particle and the layers away from the wall
+    float planeSum = 0.f;  // the wall seen from one of its particles
+    float wallSum = 0.f;   // the wall seen from one diameter away
+    for (int x = -n; x <= n; ++x) {
+        for (int y = -n; y <= n; ++y) {
+            for (int z = -n; z <= n; ++z) {
+                float r2 = pow2(d) * float(x * x + y * y + z * z);
+                if (r2 < kernelParams.squaredRadius) {
+                    latticeSum += W.density(r2);
+                    halfSum += z >= 0 ? W.density(r2) : 0.f;
+                }
+            }
+            float r2 = pow2(d) * float(x * x + y * y);
+            if (r2 < kernelParams.squaredRadius) {
+                planeSum += W.density(r2);
+            }
+            if (r2 + pow2(d) < kernelParams.squaredRadius) {
+                wallSum += W.density(r2 + pow2(d));
+            }
+        }
+    }
+
+    particleParams.setMass(KERNEL_LATTICE_DENSITY * simConstParams.restDensity / (W.densityC * latticeSum));
+    boundaryMassCorrection = (wallSum / planeSum) / (1.f - KERNEL_LATTICE_DENSITY * halfSum / latticeSum);
 }
 
 void SPH::initBoundary() {
     boundaryBox.reset();
+    if (!boundaryShell || volumeMaps) {
+        boundaryBox = worldBounds;
+    }
     for (const Vector3f &p : boundaryPositions) {
         boundaryBox.expandBy(p);
     }
+    if (volumeMaps) {
+        for (const Mesh &mesh : boundaryMeshes) {
+            boundaryBox.expandBy(mesh.bound());
+        }
+    }
+    for (const BoundaryBody &body : boundaryBodies) {
+        body.forEachCenter([&] (const Vector3f &center) {
+            boundaryBox.expandBy(Box3f(center - Vector3f(body.radius), center + Vector3f(body.radius)));
+        });
+    }
+
+    // The domain itself is always a collider. Periodic axes have no walls, the positions
+    // wrap around the tile before the collisions are resolved.
+    Box3f domainBox = boundaryBox;
+    for (int k = 0; k < 3; ++k) {
+        if (periodicAxes[k]) {
+            boundaryBox.min[k] = worldBounds.min[k];
+            boundaryBox.max[k] = worldBounds.max[k];
+            domainBox.min[k] = worldBounds.min[k] - worldBounds.extents()[k];
+            domainBox.max[k] = worldBounds.max[k] + worldBounds.extents()[k];
+        }
+    }
+    colliders.add(CollisionBox(domainBox));
 }
 
 void SPH::loadParams(const Settings &settings) {
     float _restDensity = settings.getFloat("restDensity", 1000.f);
     timeStep = settings.getFloat("timeStep", 0.001f);
+    soaLayout = settings.getString("particleLayout", "aos") == "soa";
+    useNeighborLists = settings.getBool("neighborLists", true);
+    relaxOnSetup = settings.getBool("relax", true);
+    boundaryShell = settings.getBool("boundaryShell", true);
+    std::string periodic = settings.getString("periodic", "");
+    for (int k = 0; k < 3; ++k) {
+        periodicAxes[k] = periodic.find(char('x' + k)) != std::string::npos;
+    }
+    if (periodic.find_first_not_of("xyz") != std::string::npos) {
+        std::cout << "Unknown periodic axes in " << periodic << ", using the axes x, y and z only" << std::endl;
+    }
+    restitution = settings.getFloat("restitution", 0.5f);
+    friction = std::max(0.f, settings.getFloat("friction", 0.f));
+    meshCollisions = settings.getBool("meshCollisions", true);
+    maxParticles = std::max(0, settings.getInteger("maxParticles", 0));
+    tabulatedKernel = settings.getString("kernelBackend", "analytic") == "table";
+    std::string kernel = settings.getString("kernel", "muller");
+    if (kernel == "cubicSpline") {
+        kernelFamily = Kernel::CubicSpline;
+    } else if (kernel == "wendlandC2") {
+        kernelFamily = Kernel::WendlandC2;
+    } else if (kernel == "wendlandC4") {
+        kernelFamily = Kernel::WendlandC4;
+    } else {
+        if (kernel != "muller") {
+            std::cout << "Unknown kernel " << kernel << ", using muller" << std::endl;
+        }
+        kernelFamily = Kernel::Muller;
+    }
+    kernelTableResolution = settings.getInteger("kernelTableSize", 4096);
+    particleDensityVarianceScale = settings.getString("densityVarianceScale", "prototype") == "particle";
+    activeSetLoop = settings.getBool("activeSet", false) && useNeighborLists;
+    minIterations = settings.getInteger("minIterations", MIN_ITERATION);
+    pressureRelaxation = settings.getFloat("pressureRelaxation", 1.f);
+    andersonAcceleration = settings.getBool("andersonAcceleration", false);
+    if (andersonAcceleration && activeSetLoop) {
+        std::cout << "Anderson acceleration is not supported with the active-set loop, disabled" << std::endl;
+        andersonAcceleration = false;
+    }
+    warmStart = settings.getBool("warmStart", false);
+    warmStartDecay = settings.getFloat("warmStartDecay", 0.1f);
+    warmStartExtrapolation = settings.getFloat("warmStartExtrapolation", 1.f);
+    multiRateLevels = std::max(0, settings.getInteger("multiRateLevels", 0));
+    multiRateTolerance = settings.getFloat("multiRateTolerance", 0.2f);
+    sleeping = settings.getBool("sleep", false);
+    sleepVelocity = settings.getFloat("sleepVelocity", 0.02f);
+    sleepDensityError = settings.getFloat("sleepDensityError", 0.01f);
+    sleepSteps = std::max(1, settings.getInteger("sleepSteps", 20));
+    wakeVelocity = settings.getFloat("wakeVelocity", 2.5f * sleepVelocity);
+    wakeDensityError = settings.getFloat("wakeDensityError", 2.f * sleepDensityError);
+    adaptiveResolution = settings.getBool("adaptiveResolution", false);
+    adaptiveMinMass = clamp(settings.getFloat("adaptiveMinMass", 0.125f), 0.f, 1.f);
+    adaptiveSurface = settings.getFloat("adaptiveSurface", ADAPTIVE_SURFACE);
+    adaptiveCameraDistance = settings.getFloat("adaptiveCameraDistance", 0.f);
+    adaptiveInterval = std::max(1, settings.getInteger("adaptiveInterval", 10));
+    if (adaptiveResolution) {
+        if (multiRateLevels > 0 || sleeping) {
+            std::cout << "Multi-rate time stepping and sleeping particles are not supported with adaptive resolution, disabled" << std::endl;
+            multiRateLevels = 0;
+            sleeping = false;
+        }
+        // The prototype neighbourhood only holds for particles of the base mass.
+        particleDensityVarianceScale = true;
+    }
+    std::string boundaryModel = settings.getString("boundaryModel", "particles");
+    volumeMaps = boundaryModel == "volumeMap";
+    if (!volumeMaps && boundaryModel != "particles") {
+        std::cout << "Unknown boundary model " << boundaryModel << ", using particles" << std::endl;
+    }
+    if (volumeMaps && (adaptiveResolution || periodicAxes[0] || periodicAxes[1] || periodicAxes[2])) {
+        std::cout << "Volume maps are not supported with adaptive resolution or periodic axes, using particles" << std::endl;
+        volumeMaps = false;
+    }
+    volumeMapResolution = std::max(1, settings.getInteger("volumeMapResolution", 4));
+    profileOutputPath = settings.getString("profileOutput", "");
+    profile = settings.getBool("profile", false) || !profileOutputPath.empty();
+    gridOrdering = settings.getString("gridOrdering", "linear") == "morton" ? Grid::Morton : Grid::Linear;
+    gridStorage = settings.getString("gridStorage", "dense") == "compact" ? Grid::Compact : Grid::Dense;
+    simdLevel = (soaLayout && useNeighborLists && kernelFamily == Kernel::Muller && !adaptiveResolution &&
+                 !periodicAxes[0] && !periodicAxes[1] && !periodicAxes[2]) ? KernelSIMD::select(settings.getString("simd", "auto")) : KernelSIMD::Scalar;
 
     // Compute derived constants
-    particleParams.init(settings.getFloat("particleRadius", 0.01f), _restDensity);
-    kernelParams.init(KERNEL_SCALE, particleParams.radius, particleParams.diameter);
+    particleParams.init(settings.getFloat("particleRadius", 0.01f));
+    kernelParams.init(settings.getFloat("kernelSupport", KERNEL_SCALE), particleParams.radius, particleParams.diameter);
+    neighborSkin = settings.getFloat("neighborSkin", 0.1f) * kernelParams.radius;
+    neighborListSkin = neighborSkin;
+    neighborListReach = 0.f;
+    maximumNeighborSkin = PCI_INFINITY;
     simConstParams.init(_restDensity,
                         settings.getFloat("surfaceTension", 1.f),
                         settings.getFloat("viscosity", 0.f),
@@ -51,56 +275,246 @@ void SPH::loadParams(const Settings &settings) {
 
     averageDensityVarianceTh = simConstParams.maxCompression * simConstParams.restDensity;
     maximumDensityVarianceTh = averageDensityVarianceTh * 10.f;
+    activeSetTolerance = settings.getFloat("activeSetTolerance", 0.001f) * simConstParams.restDensity;
 }
 
 void SPH::allocMemory(int fluidSize, int boundarySize) {
 
     currentFluidVelocity.resize(fluidSize);
-    newFluidPosition.resize(fluidSize);
-    newFluidVelocity.resize(fluidSize);
     fluidPositionBeforeShock.resize(fluidSize);
     fluidVelocityBeforeShock.resize(fluidSize);
+    if (adaptiveResolution) {
+        fluidMassRatios.assign(fluidSize, 1.f);
+        fluidScales.assign(fluidSize, 1.f);
+    }
+    resizeFluid(fluidSize);
+    if (simdLevel != KernelSIMD::Scalar) {
+        boundaryInverseSquaredDensities.resize(boundarySize);
+    }
+
+    boundaryDensities.resize(boundarySize);
+    boundaryStaticTerms.resize(boundarySize);
+    boundaryVelocities.resize(boundarySize);
+    boundaryMass.resize(boundarySize);
+    boundaryAlive.resize(boundarySize);
+    boundaryAliveOffsets.resize(boundarySize);
+}
+
+// @Func : Resize the per-step fluid arrays to the number of fluid particles, which
+//         changes with the adaptive resolution. The positions, velocities, mass ratios
+//         and the state kept for shocks are sized by their owners.
+void SPH::resizeFluid(size_t fluidSize) {
+
+    newFluidPosition.resize(fluidSize);
+    newFluidVelocity.resize(fluidSize);
     fluidNormals.resize(fluidSize);
     fluidForces.resize(fluidSize);
     fluidPressureForces.resize(fluidSize);
     fluidDensities.resize(fluidSize);
     fluidPressures.resize(fluidSize);
-
-    boundaryDensities.resize(boundarySize);
-    boundaryMass.resize(boundarySize);
-    boundaryAlive.resize(boundarySize);
+    if (particleDensityVarianceScale) {
+        fluidDensityVarianceScales.resize(fluidSize);
+    }
+    if (activeSetLoop) {
+        fluidDensityVariations.resize(fluidSize);
+    }
+    if (warmStart) {
+        fluidPreviousPressures.resize(fluidSize);
+    }
+    if (andersonAcceleration) {
+        fluidPressureResiduals.resize(fluidSize);
+        fluidPressureIterates.resize(fluidSize);
+    }
+    if (multiRateLevels > 0) {
+        fluidLevels.resize(fluidSize);
+    }
+    if (sleeping) {
+        fluidSleepSteps.resize(fluidSize);
+    }
+    if (soaLayout) {
+        fluidStore.resize(fluidSize);
+    }
+    if (simdLevel != KernelSIMD::Scalar) {
+        fluidPressureTerms.resize(fluidSize);
+    }
 }
 
 // @Func : Test the whether a boundary particle is alive.
 //         A boundary particle is considered alive iff
 //         it has at least one neighbour.
+//         Neighbours are searched within the radius of the current neighbour lists, so every boundary
+//         particle a fluid particle reaches during the step is alive. The alive particles are
+//         compacted into boundaryAliveIndices, in particle order.
 //  @Tested : true
 void SPH::testBoundary() {
 
-     ConcurrentUtils::ccLoop(boundaryPositions.size(), [this] (size_t i) {
-        boundaryAlive[i] = fluidGrid.isAlive(kernelParams.radius, currentFluidPosition, boundaryPositions[i]);
+    const size_t size = boundaryPositions.size();
+    const float radius = kernelParams.radius + neighborListSkin + neighborListReach;
+    ConcurrentUtils::ccLoop(size, [&] (size_t i) {
+        boundaryAlive[i] = fluidGrid.isAlive(radius, currentFluidPosition, boundaryPositions[i]);
     });
+
+    size_t alive = ConcurrentUtils::exclusiveScan<size_t>(size, [this] (size_t i) {
+        return size_t(boundaryAlive[i]);
+    }, boundaryAliveOffsets);
+    boundaryAliveIndices.resize(alive);
+    ConcurrentUtils::ccLoop(size, [this] (size_t i) {
+        if (boundaryAlive[i]) {
+            boundaryAliveIndices[boundaryAliveOffsets[i]] = uint32_t(i);
+        }
+    });
+    if (profile) {
+        stepStats.aliveBoundary = int(alive);
+    }
 }
 
 void SPH::buildBoundaryGrids() {
 
-    boundaryGrid.update(boundaryPositions, [this] (size_t i, size_t j) {
-        std::swap(boundaryPositions[i], boundaryPositions[j]);
-        std::swap(boundaryNormals[i], boundaryNormals[j]);
+    boundaryGrid.update(boundaryPositions, [this] (const std::vector<uint32_t> &permutation) {
+        Grid::permute(boundaryPositions, permutation);
+        Grid::permute(boundaryNormals, permutation);
+        Grid::permute(boundaryBodyIndices, permutation);
+        if (!boundaryBodies.empty()) {
+            Grid::permute(boundaryVelocities, permutation);
+            Grid::permute(boundaryRestPositions, permutation);
+            Grid::permute(boundaryRestNormals, permutation);
+            collectMovingBoundary(0, permutation.size());
+        }
     });
+
+    if (simdLevel != KernelSIMD::Scalar) {
+        boundaryStore.assign(boundaryPositions);
+    }
 }
 
 void SPH::massifyBoundary() {
 
-     ConcurrentUtils::ccLoop(boundaryPositions.size(), [this] (size_t i) {
+    WITH_KERNEL(massifyBoundary(W));
+}
+
+template<typename KernelType>
+void SPH::massifyBoundary(const KernelType &W) {
+
+     // The bodies only count their own particles, so neither term changes when they move.
+     ConcurrentUtils::ccLoop(boundaryPositions.size(), [&] (size_t i) {
         float weight = 0.f;
-        boundaryGrid.query(kernelParams.radius, boundaryPositions, boundaryPositions[i], [this, &weight] (size_t j, const Vector3f &r, float r2) {
-            weight += W.poly6(r2);
+        boundaryGrid.query(kernelParams.radius, boundaryPositions, boundaryPositions[i], [&] (size_t j, const Vector3f &r, float r2) {
+            if (boundaryBodyIndices[j] == boundaryBodyIndices[i]) {
+                weight += W.density(r2);
+            }
         });
-        boundaryMass[i] = simConstParams.restDensity / (W.poly6C * weight) / 1.17f;
+        boundaryMass[i] = simConstParams.restDensity / (W.densityC * weight) / boundaryMassCorrection;
+    });
+
+    // The boundary is static, its own contribution to the boundary densities never changes.
+    // Boundary particles without fluid neighbours keep the density of the boundary alone.
+    ConcurrentUtils::ccLoop(boundaryPositions.size(), [&] (size_t i) {
+        float boundaryTerm = 0.f;
+        boundaryGrid.query(kernelParams.radius, boundaryPositions, boundaryPositions[i], [&] (size_t j, const Vector3f &r, float r2) {
+            if (boundaryBodyIndices[j] == boundaryBodyIndices[i]) {
+                boundaryTerm += W.density(r2) * boundaryMass[j];
+            }
+        });
+        boundaryStaticTerms[i] = boundaryTerm;
+        boundaryDensities[i] = W.densityC * boundaryTerm;
+        if (simdLevel != KernelSIMD::Scalar) {
+            boundaryInverseSquaredDensities[i] = 1.f / pow2(boundaryDensities[i]);
+        }
     });
 }
 
+// @Func : Move the particles of the boundary bodies from their rest positions to the pose
+//         of the current time, and set their velocities to reach the pose at the end of
+//         the step. The colliders of the bodies take the pose at the end of the step,
+//         where the collisions are resolved.
+void SPH::poseBoundaries() {
+
+    for (BoundaryBody &body : boundaryBodies) {
+        body.update(currentTime, timeStep);
+        if (body.collider >= 0) {
+            colliders.setFrame(size_t(body.collider), body.nextRotation, body.nextTranslation);
+        }
+    }
+
+    const float inverseTimeStep = 1.f / timeStep;
+    ConcurrentUtils::ccLoop(movingBoundaryIndices.size(), [&] (size_t k) {
+        const size_t i = movingBoundaryIndices[k];
+        const BoundaryBody &body = boundaryBodies[boundaryBodyIndices[i]];
+        const Vector3f &rest = boundaryRestPositions[i];
+        boundaryPositions[i] = body.rotation * rest + body.translation;
+        boundaryNormals[i] = body.rotation * boundaryRestNormals[i];
+        boundaryVelocities[i] = (body.nextRotation * rest + body.nextTranslation - boundaryPositions[i]) * inverseTimeStep;
+    });
+}
+
+// @Func : Move the boundary bodies, see poseBoundaries, and re-bin their particles. Only the
+//         cells between the old and new cells of the particles that left their cell are
+//         sorted again, the rest of the boundary keeps its order and state.
+void SPH::moveBoundaries() {
+
+    poseBoundaries();
+
+    boundaryGrid.updateMoved(boundaryPositions, movingBoundaryIndices, [this] (const std::vector<uint32_t> &permutation, size_t begin, size_t end) {
+        Grid::permute(boundaryPositions, permutation, begin, end, boundaryScratch);
+        Grid::permute(boundaryNormals, permutation, begin, end, boundaryScratch);
+        Grid::permute(boundaryVelocities, permutation, begin, end, boundaryScratch);
+        Grid::permute(boundaryRestPositions, permutation, begin, end, boundaryScratch);
+        Grid::permute(boundaryRestNormals, permutation, begin, end, boundaryScratch);
+        Grid::permute(boundaryBodyIndices, permutation, begin, end, boundaryIndexScratch);
+        Grid::permute(boundaryMass, permutation, begin, end, boundaryFloatScratch);
+        Grid::permute(boundaryDensities, permutation, begin, end, boundaryFloatScratch);
+        Grid::permute(boundaryStaticTerms, permutation, begin, end, boundaryFloatScratch);
+        if (simdLevel != KernelSIMD::Scalar) {
+            Grid::permute(boundaryInverseSquaredDensities, permutation, begin, end, boundaryFloatScratch);
+            ConcurrentUtils::ccLoop(end - begin, [&] (size_t k) {
+                boundaryStore.set(begin + k, boundaryPositions[begin + k]);
+            });
+        }
+        collectMovingBoundary(begin, end);
+    });
+
+    if (simdLevel != KernelSIMD::Scalar) {
+        ConcurrentUtils::ccLoop(movingBoundaryIndices.size(), [&] (size_t k) {
+            boundaryStore.set(movingBoundaryIndices[k], boundaryPositions[movingBoundaryIndices[k]]);
+        });
+    }
+}
+
+// @Func : Update the indices of the particles of the bodies within the boundary particles
+//         [begin, end), after they were sorted again.
+void SPH::collectMovingBoundary(size_t begin, size_t end) {
+
+    auto first = std::lower_bound(movingBoundaryIndices.begin(), movingBoundaryIndices.end(), uint32_t(begin));
+    auto last = std::lower_bound(first, movingBoundaryIndices.end(), uint32_t(end));
+    first = movingBoundaryIndices.erase(first, last);
+    std::vector<uint32_t> moving;
+    for (size_t i = begin; i < end; ++i) {
+        if (boundaryBodyIndices[i] >= 0) {
+            moving.push_back(uint32_t(i));
+        }
+    }
+    movingBoundaryIndices.insert(first, moving.begin(), moving.end());
+}
+
+Eigen::Matrix4f SPH::getBoundaryMeshTransform(size_t i) const {
+
+    Eigen::Matrix4f transform = Eigen::Matrix4f::Identity();
+    if (boundaryMeshBodies[i] >= 0) {
+        const BoundaryBody &body = boundaryBodies[boundaryMeshBodies[i]];
+        transform.block<3, 3>(0, 0) = body.rotation;
+        transform.block<3, 1>(0, 3) = body.translation;
+    }
+    return transform;
+}
+
+// @Func : Build the volume maps of the boundary meshes and the world shell, on a grid
+//         covering the domain and the kernel support around it.
+void SPH::buildVolumeMap() {
+
+    float cellSize = kernelParams.radius / volumeMapResolution;
+    WITH_KERNEL(volumeMap.build(W, kernelParams.radius, boundaryMeshes, boundaryShell ? &worldBounds : nullptr,
+                                boundaryBox.expanded(kernelParams.radius), cellSize, VOLUME_MAP_OFFSET * particleParams.radius));
+}
 
 // @Func : This function is used for initializing the fluid & boundary particle densities.
 //         This function will be called once per frame, before goes into correction loop.
@@ -108,48 +522,71 @@ void SPH::massifyBoundary() {
 //         surronding fluid particle neighbours by taking the volume of surronding boundary particles
 //         into account.
 //         The volume of a boundary particle is defined as the weighted kernel sum of surrounding boundary particles.
-void SPH::initDensities() {
-
-    // Calcuate the boundary particle densities
-    ConcurrentUtils::ccLoop(boundaryPositions.size(),
-    [this] (int i) {
-        float fluidTerm = 0.f;
-        float boundaryTerm = 0.f;
+void SPH::initDensities(const ActiveSet *set) {
 
-        // Query the surrounding fluid particles.
-        fluidGrid.query(kernelParams.radius, currentFluidPosition, boundaryPositions[i],
-        [this, &fluidTerm] (int j, Vector3f &r, float squaredR){
-             fluidTerm += W.poly6(squaredR) * particleParams.mass;
-        });
+    WITH_RESOLUTION(initDensities(W, R, set));
+}
 
-        // Query the surrounding boundary particles.
-        boundaryGrid.query(kernelParams.radius, boundaryPositions, boundaryPositions[i],
-        [this, &boundaryTerm] (int j, Vector3f &r, float squaredR){
-            boundaryTerm += W.poly6(squaredR) * boundaryMass[j];
-        });
+template<typename KernelType, typename Resolution>
+void SPH::initDensities(const KernelType &W, const Resolution &R, const ActiveSet *set) {
 
-        boundaryDensities[i] = W.poly6C * (fluidTerm + boundaryTerm);
-    });
+    initBoundaryDensities(W, R);
 
     // Calculate the fluid particle densities
-    ConcurrentUtils::ccLoop(currentFluidPosition.size(),
-    [this] (int i) {
+    forEachFluid(set,
+    [&] (int i) {
          float fluidTerm = 0.f;
          float boundaryTerm = 0.f;
 
          // Query the surrounding fluid particles.
-        fluidGrid.query(kernelParams.radius, currentFluidPosition, currentFluidPosition[i],
-        [this, &fluidTerm] (int j, Vector3f &r, float squaredR){
-             fluidTerm += W.poly6(squaredR) * particleParams.mass;
+        queryFluid(i,
+        [&] (int j, Vector3f &r, float squaredR){
+             auto P = R.fluidPair(i, j);
+             if (P.inside(squaredR)) {
+                 fluidTerm += P.w() * W.density(P.arg(squaredR)) * (R.ratio(j) * particleParams.mass);
+             }
         });
 
-        // Query the surrounding boundary particles.
-        boundaryGrid.query(kernelParams.radius, boundaryPositions, currentFluidPosition[i],
-        [this, &boundaryTerm] (int j, Vector3f &r, float squaredR){
-            boundaryTerm += W.poly6(squaredR) * boundaryMass[j];
+        // Query the surrounding boundary particles, or the volume map.
+        if (volumeMaps) {
+            fluidDensities[i] = W.densityC * fluidTerm + simConstParams.restDensity * volumeMap.volume(currentFluidPosition[i]);
+            return;
+        }
+        auto B = R.boundaryPair(i);
+        queryBoundary(i, currentFluidPosition[i],
+        [&] (int j, Vector3f &r, float squaredR){
+            if (B.inside(squaredR)) {
+                boundaryTerm += B.w() * W.density(B.arg(squaredR)) * boundaryMass[j];
+            }
         });
 
-        fluidDensities[i] = W.poly6C * (fluidTerm + boundaryTerm);
+        fluidDensities[i] = W.densityC * (fluidTerm + boundaryTerm);
+    });
+}
+
+// @Func : Calcuate the densities of the alive boundary particles at the current fluid positions,
+//         the others have no fluid neighbours.
+template<typename KernelType, typename Resolution>
+void SPH::initBoundaryDensities(const KernelType &W, const Resolution &R) {
+
+    const uint32_t *aliveBoundary = boundaryAliveIndices.data();
+    ConcurrentUtils::ccLoop(boundaryAliveIndices.size(),
+    [&] (size_t k) {
+        const size_t i = aliveBoundary[k];
+        float fluidTerm = 0.f;
+
+        // Query the surrounding fluid particles.
+        // Boundary particles keep the base kernel.
+        fluidGrid.query(kernelParams.radius, currentFluidPosition, boundaryPositions[i],
+        [&] (int j, Vector3f &r, float squaredR){
+             fluidTerm += W.density(squaredR) * (R.ratio(j) * particleParams.mass);
+        });
+
+        // The surrounding boundary particles are cached by massifyBoundary.
+        boundaryDensities[i] = W.densityC * (fluidTerm + boundaryStaticTerms[i]);
+        if (simdLevel != KernelSIMD::Scalar) {
+            boundaryInverseSquaredDensities[i] = 1.f / pow2(boundaryDensities[i]);
+        }
     });
 }
 
@@ -158,76 +595,253 @@ void SPH::initDensities() {
 //         for inner fluid particles and big at the surface area where the curvature
 //         is significant. The normal information will be used in computing force
 //         which can counteract the surface curvature.
-void SPH::initNormals() {
+void SPH::initNormals(const ActiveSet *set) {
+
+    WITH_RESOLUTION(initNormals(W, R, set));
+}
+
+template<typename KernelType, typename Resolution>
+void SPH::initNormals(const KernelType &W, const Resolution &R, const ActiveSet *set) {
 
-     ConcurrentUtils::ccLoop(currentFluidPosition.size(), [this] (size_t i) {
+     forEachFluid(set, [&] (size_t i) {
         Vector3f normal;
-        fluidGrid.query(kernelParams.radius, currentFluidPosition, currentFluidPosition[i], [&] (size_t j, const Vector3f &r, float r2) {
-            normal += W.poly6Grad(r, r2) / fluidDensities[j];
+        queryFluid(i, [&] (size_t j, const Vector3f &r, float r2) {
+            auto P = R.fluidPair(i, j);
+            if (P.inside(r2)) {
+                normal += r * (P.grad() * R.ratio(j) * W.densityGrad(P.arg(r2)) / fluidDensities[j]);
+            }
         });
-        normal *= kernelParams.radius * particleParams.mass * W.poly6Grad1;
+        normal *= kernelParams.radius * R.scale(i) * particleParams.mass * W.densityGradC;
         fluidNormals[i] = normal;
     });
 }
 
-// @Func : The collision is based on the spatial relationship between a fluid particle and the bounding box
-//         If the algorithm detects that the particle exceeds the bounding box, it will adjust
-//         the particle's position and velocity based on how far it exceeds the bounding box.
-void SPH::handleCollisions(std::function<void(size_t i, const Vector3f &n, float d)> collisionFunc) {
+// @Func : This function handles the situation when a particle collides with a
+//         boundary or fluid particle. The collision is based on the spatial relationship
+//         between a fluid particle and the colliders (the bounding box of the domain and
+//         the colliders of the scene). If a particle exceeds a collider, its position and
+//         velocity are adjusted based on how far it exceeds it.
+void SPH::adjustParticles() {
+
+    if (periodicDomain.enabled) {
+        ConcurrentUtils::ccLoop(currentFluidPosition.size(), [&] (size_t i) {
+            currentFluidPosition[i] = periodicDomain.wrap(currentFluidPosition[i]);
+        });
+    }
 
+    // Clamp the particle back onto the constraint plane and reflect its velocity into the
+    // collider, without branching on whether the particle penetrated (d <= 0 leaves it untouched).
+    // Friction takes at most mu times the normal velocity change off the tangential velocity.
+    const float reflection = 1.f + restitution;
+    if (friction > 0.f) {
+        handleCollisions([&] (size_t i, const Vector3f &n, float d) {
+            float hit = d > 0.f ? 1.f : 0.f;
+            Vector3f v = currentFluidVelocity[i];
+            float normalVelocity = std::min(0.f, v.dot(n));
+            Vector3f tangentVelocity = v - v.dot(n) * n;
+            float slowdown = std::min(1.f, friction * reflection * std::abs(normalVelocity) / std::max(tangentVelocity.norm(), EPSILON));
+            currentFluidPosition[i] += n * (hit * d);
+            currentFluidVelocity[i] -= hit * ((reflection * normalVelocity) * n + slowdown * tangentVelocity);
+        });
+    } else {
+        handleCollisions([&] (size_t i, const Vector3f &n, float d) {
+            float hit = d > 0.f ? 1.f : 0.f;
+            currentFluidPosition[i] += n * (hit * d);
+            currentFluidVelocity[i] -= (hit * reflection * std::min(0.f, currentFluidVelocity[i].dot(n))) * n;
+        });
+    }
+}
+
+
+// @Func : Update the particle information
+void SPH::buildFluidGrids() {
 
-    // Make sure not to use the same variable here because the multi-thread will cause
-    // the program to crash if we use the pre-declare variable here.
-    for (size_t i = 0; i < currentFluidPosition.size(); ++i) {
-        const auto &p = currentFluidPosition[i];
-        if (p.x() < boundaryBox.min.x()) {
-            collisionFunc(i, Vector3f(1.f, 0.f, 0.f), boundaryBox.min.x() - p.x());
+    // The predicted buffers are overwritten during the step, use them as scratch space.
+    fluidGrid.update(currentFluidPosition, [this] (const std::vector<uint32_t> &permutation) {
+        Grid::permute(currentFluidPosition, permutation, newFluidPosition);
+        Grid::permute(currentFluidVelocity, permutation, newFluidVelocity);
+
+        if (warmStart || partialSteps()) {
+            Grid::permute(fluidPressures, permutation, fluidScratch);
         }
-        if (p.x() > boundaryBox.max.x()) {
-            collisionFunc(i, Vector3f(-1.f, 0.f, 0.f), p.x() - boundaryBox.max.x());
+        if (adaptiveResolution) {
+            Grid::permute(fluidMassRatios, permutation, fluidScratch);
+            Grid::permute(fluidScales, permutation, fluidScratch);
         }
-        if (p.y() < boundaryBox.min.y()) {
-            collisionFunc(i, Vector3f(0.f, 1.f, 0.f), boundaryBox.min.y() - p.y());
+        if (warmStart) {
+            Grid::permute(fluidPreviousPressures, permutation, fluidScratch);
         }
-        if (p.y() > boundaryBox.max.y()) {
-            collisionFunc(i, Vector3f(0.f, -1.f, 0.f), p.y() - boundaryBox.max.y());
+
+        // Particles that are not updated in the next step keep their state of the last update.
+        if (multiRateLevels > 0) {
+            Grid::permute(fluidLevels, permutation, fluidLevelScratch);
         }
-        if (p.z() < boundaryBox.min.z()) {
-            collisionFunc(i, Vector3f(0.f, 0.f, 1.f), boundaryBox.min.z() - p.z());
+        if (sleeping) {
+            Grid::permute(fluidSleepSteps, permutation, fluidLevelScratch);
         }
-        if (p.z() > boundaryBox.max.z()) {
-            collisionFunc(i, Vector3f(0.f, 0.f, -1.f), p.z() - boundaryBox.max.z());
+        if (partialSteps()) {
+            Grid::permute(fluidDensities, permutation, fluidScratch);
+            Grid::permute(fluidNormals, permutation, newFluidPosition);
+            Grid::permute(fluidForces, permutation, newFluidPosition);
+            Grid::permute(fluidPressureForces, permutation, newFluidPosition);
+            if (simdLevel != KernelSIMD::Scalar) {
+                Grid::permute(fluidPressureTerms, permutation, fluidScratch);
+            }
         }
+    });
+
+    // The sweeps of this step read the sorted state from the SoA store.
+    if (soaLayout) {
+        fluidStore.positions.assign(currentFluidPosition);
     }
 }
 
-// @Func : This function handles the situation when a particle collides with a
-//         boundary or fluid particle.
-void SPH::adjustParticles() {
+// @Func : Build the fluid->fluid and fluid->boundary neighbour lists for the current step.
+//         Must be called after the grids are sorted, since the lists store indices
+//         into the sorted particle arrays. The neighbour search radius is widened
+//         by the skin distance so the lists stay valid for the predicted positions.
+//         Volume maps need no boundary lists.
+void SPH::buildNeighborLists() {
 
-    handleCollisions([&] (size_t i, const Vector3f &n, float d) {
-        currentFluidPosition[i] += n * d;
-        currentFluidVelocity[i] -= 1.5 * currentFluidVelocity[i].dot(n) * n;
+    if (!useNeighborLists) {
+        return;
+    }
+
+    // The multi-rate extrapolations with the accelerations of the last updates are covered up front.
+    neighborListSkin = neighborSkin;
+    if (multiRateLevels > 0 && stepSet) {
+        neighborListSkin = std::max(neighborSkin, std::min(NEIGHBOR_SKIN_SLACK * 2.f * largestExtrapolation(stepSet), maximumNeighborSkin));
+    }
+    float radius = kernelParams.radius + neighborListSkin;
+    int capacity = int(std::ceil(kernelParams.capacity * pow3(radius / kernelParams.radius)));
+    if (stepSet) {
+        // Only the particles updated in this step query their neighbours.
+        // Sleeping particles next to awake ones also update their densities.
+        const ActiveSet *listed = sleeping ? &sleepDensityParticles : stepSet;
+        auto include = [listed] (size_t i) { return listed->contains(i); };
+        fluidNeighbors.build(fluidGrid, currentFluidPosition, currentFluidPosition, currentFluidPosition.size(), radius, capacity, include);
+        if (!volumeMaps) {
+            boundaryNeighbors.build(boundaryGrid, boundaryPositions, currentFluidPosition, currentFluidPosition.size(), radius, capacity, include);
+        }
+    } else {
+        fluidNeighbors.build(fluidGrid, currentFluidPosition, currentFluidPosition, currentFluidPosition.size(), radius, capacity);
+        if (!volumeMaps) {
+            boundaryNeighbors.build(boundaryGrid, boundaryPositions, currentFluidPosition, currentFluidPosition.size(), radius, capacity);
+        }
+    }
+    neighborListPositions = currentFluidPosition;
+    neighborListReach = 0.f;
+}
+
+// @Func : Rebuild the neighbour lists for positions, after the particles moved away from the
+//         sorted positions of the grid. With keepSorted the lists also keep the neighbours at
+//         the sorted positions, which the density, normal and force sweeps of the step query.
+//         The grid is searched within the skin plus the distance the particles moved.
+void SPH::rebuildNeighborLists(const PCI3Mf &positions, const PCI3Mf &sorted, bool keepSorted) {
+
+    const float reach = largestDisplacement(positions, sorted);
+    const float radius = kernelParams.radius + neighborListSkin;
+    const float squaredRadius = pow2(radius);
+    int capacity = int(std::ceil(kernelParams.capacity * pow3(radius / kernelParams.radius)));
+    auto include = [this] (size_t i) { return !stepSet || stepSet->contains(i); };
+    auto close = [&] (const Vector3f &p, const Vector3f &q) {
+        return periodicDomain.minimumImage(p - q).squaredNorm() < squaredRadius;
+    };
+    fluidNeighbors.collect(fluidGrid, sorted, sorted.size(), radius + 2.f * reach, capacity, include, [&] (size_t i, size_t j) {
+        return (keepSorted && close(sorted[i], sorted[j])) || close(positions[i], positions[j]);
     });
+    if (!volumeMaps) {
+        boundaryNeighbors.collect(boundaryGrid, sorted, sorted.size(), radius + reach, capacity, include, [&] (size_t i, size_t j) {
+            return (keepSorted && close(sorted[i], boundaryPositions[j])) || close(positions[i], boundaryPositions[j]);
+        });
+    }
+    neighborListPositions = positions;
+    neighborListReach = reach;
 }
 
+// @Func : Make sure the neighbour lists hold every pair closer than the kernel radius at the
+//         predicted positions of the correction loop. A pair is listed as long as both particles
+//         moved by at most half the skin from the positions the lists were last built for.
+//         1. Once a predicted position moves further, the lists are rebuilt for the predicted
+//            positions, keeping the neighbours at the sorted positions.
+//         2. With multi-rate time stepping the neighbours of a particle on level L are extrapolated
+//            to the end of its 2^L time steps. Neighbours differ by at most one level, so a particle
+//            on level L is extrapolated over at most n = 2^min(L + 1, highest level of the set) steps
+//            and moves by at most n * dt * |v| + 0.5 * n * (n + 1) * dt^2 * |a|. Once that exceeds
+//            half the skin, the lists are rebuilt at the sorted positions with a skin of twice the
+//            largest distance.
+//         The alive boundary particles and their densities are updated with the lists.
+void SPH::validateNeighborLists(const ActiveSet *set) {
+
+    if (!useNeighborLists) {
+        return;
+    }
 
-// @Func : Update the particle information
-void SPH::buildFluidGrids() {
+    if (multiRateLevels > 0) {
+        float displacement = largestExtrapolation(set);
+        if (2.f * displacement <= neighborListSkin || neighborListSkin >= maximumNeighborSkin) {
+            return;
+        }
+        neighborListSkin = std::min(NEIGHBOR_SKIN_SLACK * 2.f * displacement, maximumNeighborSkin);
+        rebuildNeighborLists(currentFluidPosition, currentFluidPosition, true);
+    } else {
+        if (2.f * largestDisplacement(newFluidPosition, neighborListPositions) <= neighborListSkin) {
+            return;
+        }
+        rebuildNeighborLists(newFluidPosition, currentFluidPosition, true);
+    }
+
+    testBoundary();
+    if (!volumeMaps) {
+        WITH_RESOLUTION(initBoundaryDensities(W, R));
+    }
+    if (profile) {
+        ++stepStats.neighborRebuilds;
+    }
+}
+
+// @Func : The largest distance a fluid particle moves in the multi-rate extrapolations of the
+//         particles of set, see validateNeighborLists.
+float SPH::largestExtrapolation(const ActiveSet *set) {
 
-    fluidGrid.update(currentFluidPosition, [&] (size_t i, size_t j) {
-        std::swap(currentFluidPosition[i], currentFluidPosition[j]);
-        std::swap(currentFluidVelocity[i], currentFluidVelocity[j]);
+    Thread_int maxLevel(0);
+    forEachFluid(set, [&] (size_t i) {
+        maxLevel.local() = std::max(maxLevel.local(), fluidLevels[i]);
+    });
+    int setLevel = std::accumulate(maxLevel.begin(), maxLevel.end(), 0, [] (int a, int b) { return std::max(a, b); });
+    Thread_float maxDisplacement(0.f);
+    ConcurrentUtils::ccLoop(currentFluidPosition.size(), [&] (size_t i) {
+        float n = float(1 << std::min(fluidLevels[i] + 1, setLevel));
+        Vector3f a = particleParams.inverseMass * (fluidForces[i] + fluidPressureForces[i]);
+        float displacement = n * timeStep * currentFluidVelocity[i].norm() + 0.5f * n * (n + 1.f) * pow2(timeStep) * a.norm();
+        maxDisplacement.local() = std::max(maxDisplacement.local(), displacement);
     });
+    return std::accumulate(maxDisplacement.begin(), maxDisplacement.end(), 0.f, [] (float a, float b) { return std::max(a, b); });
 }
 
-// @Func : This function calculates the density scaling factor that is applied to every
-//         particle in the current iteration, scaling factor is essential for dealing
-//         with the particles that have insufficient neighbours, which, otherwise would
-//         produce falsified results. The density vairance scale factor is generally based
-//         on all neighbour particles within the same kernel.
-//         The density variance scale factor will be updated in each iteration.
-void SPH::updateDensityVarianceScale() {
+// @Func : The largest distance of a fluid particle between two arrays of positions.
+float SPH::largestDisplacement(const PCI3Mf &positions, const PCI3Mf &reference) {
+
+    Thread_float maxDisplacement(0.f);
+    ConcurrentUtils::ccLoop(positions.size(), [&] (size_t i) {
+        maxDisplacement.local() = std::max(maxDisplacement.local(), periodicDomain.minimumImage(positions[i] - reference[i]).squaredNorm());
+    });
+    return std::sqrt(std::accumulate(maxDisplacement.begin(), maxDisplacement.end(), 0.f, [] (float a, float b) { return std::max(a, b); }));
+}
+
+// @Func : This function calculates the gradient terms of the density scaling factor that is applied
+//         to every particle, scaling factor is essential for dealing with the particles that have
+//         insufficient neighbours, which, otherwise would produce falsified results. The density
+//         vairance scale factor is generally based on all neighbour particles within the same kernel,
+//         using a prototype particle with a filled neighbourhood.
+//         The terms only depend on the kernel and are computed once.
+void SPH::initDensityVarianceScale() {
+
+    WITH_KERNEL(initDensityVarianceScale(W));
+}
+
+template<typename KernelType>
+void SPH::initDensityVarianceScale(const KernelType &W) {
 
    Vector3f gradientSum = Vector3f(0.f,0.f,0.f);
     float sumSquaredGradient = 0.f; // Sum(W*W)
@@ -237,7 +851,7 @@ void SPH::updateDensityVarianceScale() {
                 Vector3f r = Vector3f(x, y, z);
                 float squaredR = r.squaredNorm();
                 if (squaredR < kernelParams.squaredRadius) {
-                    Vector3f gradient = W.poly6Grad1 * W.poly6Grad(r, squaredR);
+                    Vector3f gradient = (W.densityGradC * W.densityGrad(squaredR)) * r;
                     gradientSum += gradient;
                     sumSquaredGradient += gradient.dot(gradient);
                 }
@@ -246,8 +860,70 @@ void SPH::updateDensityVarianceScale() {
     }
 
     float squaredSumGradient = gradientSum.dot(gradientSum);  // Sum(W) * Sum(W)
+    prototypeGradientTerm = -squaredSumGradient - sumSquaredGradient;
+    densityVarianceScaleTimeStep = 0.f;
+}
+
+// @Func : Update the density variance scale for the current time step. The scale is proportional to
+//         1 / timeStep^2, so it is only recomputed when adjustTimeStep or handleShock changed the time step.
+void SPH::updateDensityVarianceScale() {
+
+    if (timeStep == densityVarianceScaleTimeStep) {
+        return;
+    }
+    densityVarianceScaleTimeStep = timeStep;
+
     float beta = 2.f * pow2((particleParams.mass * timeStep) / simConstParams.restDensity);
-    densityVarianceScale = -1.f / (beta * (-squaredSumGradient - sumSquaredGradient));
+    densityVarianceScale = -1.f / (beta * prototypeGradientTerm);
+}
+
+// @Func : Compute a density variance scale per fluid particle from its actual neighbourhood
+//         (fluid and mass weighted boundary neighbours) instead of the prototype particle.
+//         Particles at the free surface or next to the boundary have fewer neighbours than
+//         the prototype, so the prototype scale under-corrects them. The gradient term is
+//         bounded below by a fraction of the prototype term, which keeps the scale finite
+//         for (nearly) isolated particles.
+void SPH::updateParticleDensityVarianceScales(const ActiveSet *set) {
+
+    WITH_RESOLUTION(updateParticleDensityVarianceScales(W, R, set));
+}
+
+template<typename KernelType, typename Resolution>
+void SPH::updateParticleDensityVarianceScales(const KernelType &W, const Resolution &R, const ActiveSet *set) {
+
+    float beta = 2.f * pow2((particleParams.mass * timeStep) / simConstParams.restDensity);
+    float minGradientTerm = -MIN_SCALE_NEIGHBOURHOOD * prototypeGradientTerm;
+
+    forEachFluid(set, [&] (size_t i) {
+        Vector3f gradientSum;
+        float sumSquaredGradient = 0.f;
+        // Neighbours of other masses weigh with their mass ratio, the pressure of i moves
+        // the neighbours by m_i / m_j as much as itself.
+        queryFluid(i, [&] (size_t j, const Vector3f &r, float r2) {
+            auto P = R.fluidPair(i, j);
+            if (P.inside(r2)) {
+                Vector3f gradient = (P.grad() * W.densityGradC * W.densityGrad(P.arg(r2))) * r;
+                gradientSum += R.ratio(j) * gradient;
+                sumSquaredGradient += R.ratio(i) * R.ratio(j) * gradient.dot(gradient);
+            }
+        });
+        if (volumeMaps) {
+            // The solid is a continuum, it adds to the gradient sum only.
+            gradientSum += (simConstParams.restDensity * particleParams.inverseMass) * volumeMap.densityGradient(currentFluidPosition[i]);
+        } else {
+            auto B = R.boundaryPair(i);
+            queryBoundary(i, currentFluidPosition[i], [&] (size_t j, const Vector3f &r, float r2) {
+                if (B.inside(r2)) {
+                    Vector3f gradient = (boundaryMass[j] * particleParams.inverseMass * B.grad() * W.densityGradC * W.densityGrad(B.arg(r2))) * r;
+                    gradientSum += gradient;
+                    sumSquaredGradient += gradient.dot(gradient);
+                }
+            });
+        }
+
+        float gradientTerm = std::max(gradientSum.dot(gradientSum) + sumSquaredGradient, minGradientTerm);
+        fluidDensityVarianceScales[i] = 1.f / (beta * gradientTerm);
+    });
 }
 
 // In this implementation the initial force is mainly based on three components
@@ -255,10 +931,19 @@ void SPH::updateDensityVarianceScale() {
 // 2. Surface tension : Cohesive term + Curvature term
 // 3. Gravity : F = mg
 // After calculating the intial force, set pressure and pressure force to 0
-// according to the PCISPH algorithm.
-void SPH::initForces() {
+// according to the PCISPH algorithm. With warm starting, compressed particles start
+// from decay * (p(n) + e * (p(n) - p(n-1))) of the last two steps instead. The
+// correction only ever raises pressures, so particles that are not compressed at the
+// start of the step get no warm start. The solver computes the initial pressure force.
+void SPH::initForces(const ActiveSet *set) {
 
-    ConcurrentUtils::ccLoop(currentFluidPosition.size(), [&] (size_t i) {
+    WITH_RESOLUTION(initForces(W, R, set));
+}
+
+template<typename KernelType, typename Resolution>
+void SPH::initForces(const KernelType &W, const Resolution &R, const ActiveSet *set) {
+
+    forEachFluid(set, [&] (size_t i) {
 
         // Terms for computing F(v,g,ext) in the paper algorithm.
         Vector3f viscocity;
@@ -268,33 +953,41 @@ void SPH::initForces() {
         // First of all, we have to iterate through the grid to fetch all
         // adjacent particles that within the range of the kernel, which
         // local at the center of the current particle.
-        fluidGrid.query(kernelParams.radius, currentFluidPosition, currentFluidPosition[i], [&] (size_t j, const Vector3f &r, float r2) {
+        queryFluid(i, [&] (size_t j, const Vector3f &r, float r2) {
 
-            if (r2 < EPSILON) {
+            auto P = R.fluidPair(i, j);
+            if (r2 < EPSILON || !P.inside(r2)) {
                 return;
             }
-            float absxij = std::sqrt(r2);
 
-            viscocity -= (currentFluidVelocity[i] - currentFluidVelocity[j]) * (W.viscosityLaplace(absxij) / fluidDensities[j]);
+            viscocity -= (currentFluidVelocity[i] - currentFluidVelocity[j]) * (P.laplace() * R.ratio(j) * W.viscosityLaplace(P.arg(r2)) / fluidDensities[j]);
 
             // K(i,j) is the surface tension constant
             // Basically F(sf) = K(i,j)*(F(cohesion)+F(curvature))
             float Kij = 2.f * simConstParams.restDensity / (fluidDensities[i] + fluidDensities[j]);
-            cohesion += Kij * (r / absxij) * W.surfaceTension(absxij);
+            cohesion += (Kij * P.cohesion() * R.ratio(j) * W.cohesion(P.arg(r2))) * r;
             curvature += Kij * (fluidNormals[i] - fluidNormals[j]);
         });
 
-        viscocity *=  simConstParams.viscosity * particleParams.squaredMass * W.viscosityGrad2 / fluidDensities[i];
-        cohesion  *= -simConstParams.surfaceTension * particleParams.squaredMass * W.surfaceTensionConstant;
-        curvature *= -simConstParams.surfaceTension * particleParams.mass;
+        const float ratio = R.ratio(i);
+        viscocity *=  simConstParams.viscosity * (ratio * particleParams.squaredMass) * W.viscosityGrad2 / fluidDensities[i];
+        cohesion  *= -simConstParams.surfaceTension * (ratio * particleParams.squaredMass) * W.surfaceTensionConstant;
+        curvature *= -simConstParams.surfaceTension * (ratio * particleParams.mass);
 
         // The overall force F(p,i)
         Vector3f force;
         force += cohesion + curvature + viscocity;
-        force += particleParams.mass * simConstParams.gravity;
+        force += (ratio * particleParams.mass) * simConstParams.gravity;
 
         fluidForces[i] = force;
-        fluidPressures[i] = 0.f;
+        if (warmStart) {
+            float pressure = fluidPressures[i];
+            float warmPressure = warmStartDecay * (pressure + warmStartExtrapolation * (pressure - fluidPreviousPressures[i]));
+            fluidPressures[i] = fluidDensities[i] > simConstParams.restDensity ? std::max(0.f, warmPressure) : 0.f;
+            fluidPreviousPressures[i] = pressure;
+        } else {
+            fluidPressures[i] = 0.f;
+        }
         fluidPressureForces[i] = Vector3f(0.f);
     });
 }
@@ -305,12 +998,17 @@ void SPH::initForces() {
 //                    F(net) = surface tension + gravity + pressure force + viscosity.
 //                    v(new) = v(old) + a * dt
 //                    x(new) = x(old) + v * dt
-void SPH::predictVelocityAndPosition() {
+//         With multi-rate time stepping the position is predicted for the end of the
+//         2^L time steps the particle keeps its forces, see extrapolatedPosition.
+void SPH::predictVelocityAndPosition(const ActiveSet *set) {
 
-     ConcurrentUtils::ccLoop(currentFluidPosition.size(), [&] (size_t i) {
-        Vector3f a = particleParams.inverseMass * (fluidForces[i] + fluidPressureForces[i]);
+     forEachFluid(set, [&] (size_t i) {
+        Vector3f a = inverseMass(i) * (fluidForces[i] + fluidPressureForces[i]);
         newFluidVelocity[i] = currentFluidVelocity[i] + a * timeStep;
-        newFluidPosition[i] = currentFluidPosition[i] + newFluidVelocity[i] * timeStep;
+        newFluidPosition[i] = multiRateLevels > 0 ? extrapolatedPosition(i, fluidLevels[i]) : currentFluidPosition[i] + newFluidVelocity[i] * timeStep;
+        if (soaLayout) {
+            fluidStore.predictedPositions.set(i, newFluidPosition[i]);
+        }
     });
 }
 
@@ -319,33 +1017,129 @@ void SPH::predictVelocityAndPosition() {
 //         on its surronding particles: both fluid particles and boundary particles. The reason why
 //         we take the boundary particles into account is that it enables us to deal with the fluid
 //         particles with insufficient neighbouring fluid particles.
-void SPH::updatePressures() {
+//         In the active-set loop only particles with a density variation above the tolerance
+//         accumulate pressure and join the pressureSet, the maximum and average variance
+//         are taken over the latest variations of all particles.
+//         With multi-rate time stepping the density is predicted for the end of the particle's
+//         2^L time steps, with the neighbours extrapolated to the same time. The position
+//         responds to the force n(n+1)/2 times as strongly as in a single step (n = 2^L),
+//         the pressure update is scaled down by that factor.
+//         With Anderson acceleration (depth 1) the update p + f is mixed with the update of
+//         the previous iteration, p' = G - gamma * (G - G_prev) with G = p + f, where the
+//         global gamma minimizes |f - gamma * (f - f_prev)| over the updated particles.
+void SPH::updatePressures(const ActiveSet *set) {
+
+    WITH_RESOLUTION(updatePressures(W, R, set));
+}
+
+template<typename KernelType, typename Resolution>
+void SPH::updatePressures(const KernelType &W, const Resolution &R, const ActiveSet *set) {
 
     Thread_float maxDensityVariation(-PCI_INFINITY); //Later will be used in adjust timestep and shock detection.
     Thread_float accDensityVariation(0.f);
+    Thread_float residualProduct(0.f);       // <f, f - f_prev>
+    Thread_float residualChangeProduct(0.f); // |f - f_prev|^2
+    const KernelSIMD::Functions &simd = KernelSIMD::functions(simdLevel);
 
-     ConcurrentUtils::ccLoop(currentFluidPosition.size(), [&] (size_t i) {
-        float fluidDensity = 0.f;
-        fluidGrid.queryPair(kernelParams.radius,newFluidPosition, currentFluidPosition[i], newFluidPosition[i], [&] (size_t j, const Vector3f &r, float r2) {
-            fluidDensity += W.poly6(r2);
-        });
-        float density = W.poly6C * particleParams.mass * fluidDensity;
+    if (activeSetLoop) {
+        pressureSet.clear();
+    }
 
+     forEachFluid(set, [&] (size_t i) {
+        float fluidDensity = 0.f;
         float boundaryDensity = 0.f;
-        boundaryGrid.query(kernelParams.radius,boundaryPositions, newFluidPosition[i], [&] (size_t j, const Vector3f &r, float r2) {
-            boundaryDensity += W.poly6(r2) * boundaryMass[j];
-        });
-        density += W.poly6C * boundaryDensity;
+
+        float scale = pressureRelaxation * (particleDensityVarianceScale ? fluidDensityVarianceScales[i] : densityVarianceScale);
+
+        if (multiRateLevels > 0) {
+            int level = fluidLevels[i];
+            queryFluid(i, ExtrapolatedPositions(*this, level), newFluidPosition[i], [&] (size_t j, const Vector3f &r, float r2) {
+                fluidDensity += W.density(r2);
+            });
+            if (!volumeMaps) {
+                queryBoundary(i, newFluidPosition[i], [&] (size_t j, const Vector3f &r, float r2) {
+                    boundaryDensity += W.density(r2) * boundaryMass[j];
+                });
+            }
+            float n = float(1 << level);
+            scale /= 0.5f * n * (n + 1.f);
+        } else if (simdLevel != KernelSIMD::Scalar) {
+            const SoA3f &fluid = fluidStore.predictedPositions;
+            fluidDensity = simd.poly6Sum(fluidNeighbors.neighbors(i), fluidNeighbors.count(i),
+                                         fluid.x(), fluid.y(), fluid.z(), newFluidPosition[i], mullerKernel.squaredSmoothLength, nullptr);
+            if (!volumeMaps) {
+                boundaryDensity = simd.poly6Sum(boundaryNeighbors.neighbors(i), boundaryNeighbors.count(i),
+                                                boundaryStore.x(), boundaryStore.y(), boundaryStore.z(), newFluidPosition[i], mullerKernel.squaredSmoothLength, boundaryMass.data());
+            }
+        } else {
+            queryPredictedFluid(i, [&] (size_t j, const Vector3f &r, float r2) {
+                auto P = R.fluidPair(i, j);
+                if (P.inside(r2)) {
+                    fluidDensity += P.w() * W.density(P.arg(r2)) * R.ratio(j);
+                }
+            });
+            if (!volumeMaps) {
+                auto B = R.boundaryPair(i);
+                queryBoundary(i, newFluidPosition[i], [&] (size_t j, const Vector3f &r, float r2) {
+                    if (B.inside(r2)) {
+                        boundaryDensity += B.w() * W.density(B.arg(r2)) * boundaryMass[j];
+                    }
+                });
+            }
+        }
+
+        float density = W.densityC * particleParams.mass * fluidDensity;
+        if (volumeMaps) {
+            density += simConstParams.restDensity * volumeMap.volume(newFluidPosition[i]);
+        } else {
+            density += W.densityC * boundaryDensity;
+        }
 
         float densityVariation = std::max(0.f, density - simConstParams.restDensity);
-        maxDensityVariation.local() = std::max(maxDensityVariation.local(), densityVariation);
-        accDensityVariation.local() += densityVariation;
+        if (activeSetLoop) {
+            fluidDensityVariations[i] = densityVariation;
+            if (densityVariation <= activeSetTolerance) {
+                return;
+            }
+            pressureSet.add(i);
+        } else {
+            maxDensityVariation.local() = std::max(maxDensityVariation.local(), densityVariation);
+            accDensityVariation.local() += densityVariation;
+        }
 
-        fluidPressures[i] += densityVarianceScale * densityVariation;
+        if (andersonAcceleration) {
+            float residual = scale * densityVariation;
+            float residualChange = residual - fluidPressureResiduals[i];
+            residualProduct.local() += residual * residualChange;
+            residualChangeProduct.local() += pow2(residualChange);
+            fluidPressureResiduals[i] = residual;
+            return;
+        }
+        fluidPressures[i] += scale * densityVariation;
     });
 
+    if (andersonAcceleration) {
+        float changeNorm = std::accumulate(residualChangeProduct.begin(), residualChangeProduct.end(), 0.f);
+        float gamma = pressureHistory && changeNorm > EPSILON ? std::accumulate(residualProduct.begin(), residualProduct.end(), 0.f) / changeNorm : 0.f;
+        forEachFluid(set, [&] (size_t i) {
+            float iterate = fluidPressures[i] + fluidPressureResiduals[i];
+            fluidPressures[i] = std::max(0.f, iterate - gamma * (iterate - fluidPressureIterates[i]));
+            fluidPressureIterates[i] = iterate;
+        });
+        pressureHistory = true;
+    }
+
+    if (activeSetLoop) {
+        pressureSet.compact();
+        forEachFluid(stepSet, [&] (size_t i) {
+            maxDensityVariation.local() = std::max(maxDensityVariation.local(), fluidDensityVariations[i]);
+            accDensityVariation.local() += fluidDensityVariations[i];
+        });
+    }
+
+    size_t count = stepSet ? stepSet->size() : currentFluidPosition.size();
     maximumDensityVariance = std::accumulate(maxDensityVariation.begin(), maxDensityVariation.end(), 0.f, [] (float a, float b) { return std::max(a, b); });
-    averageDensityVariance = std::accumulate(accDensityVariation.begin(), accDensityVariation.end(), 0.f) / currentFluidPosition.size();
+    averageDensityVariance = count > 0 ? std::accumulate(accDensityVariation.begin(), accDensityVariation.end(), 0.f) / count : 0.f;
 
 }
 
@@ -353,39 +1147,90 @@ void SPH::updatePressures() {
 // @Func : Update the pressure force based on the equation
 //         provided in paper. Again, the pressure force is given by both surronding fluid particles
 //         and boundary particles.
-void SPH::updatePressureForces() {
+void SPH::updatePressureForces(const ActiveSet *set) {
 
-     ConcurrentUtils::ccLoop(currentFluidPosition.size(), [&] (size_t i) {
+    if (simdLevel != KernelSIMD::Scalar) {
+        updatePressureForcesSIMD(set);
+    } else {
+        WITH_RESOLUTION(updatePressureForces(W, R, set));
+    }
+}
+
+template<typename KernelType, typename Resolution>
+void SPH::updatePressureForces(const KernelType &W, const Resolution &R, const ActiveSet *set) {
+
+     forEachFluid(set, [&] (size_t i) {
         Vector3f pressureForce;
 
-        fluidGrid.query(kernelParams.radius, currentFluidPosition, currentFluidPosition[i], [&] (size_t j, const Vector3f &r, float r2) {
-            if (r2 < 1e-5f) {
+        const float mass_i = R.ratio(i) * particleParams.mass;
+
+        queryFluid(i, [&] (size_t j, const Vector3f &r, float r2) {
+            auto P = R.fluidPair(i, j);
+            if (r2 < 1e-5f || !P.inside(r2)) {
                 return;
             }
 
-            float rn = std::sqrt(r2);
             const float &density_i = fluidDensities[i];
             const float &density_j = fluidDensities[j];
             const float &pressure_i = fluidPressures[i];
             const float &pressure_j = fluidPressures[j];
 
-            pressureForce -= particleParams.squaredMass * (pressure_i / pow2(density_i) + pressure_j / pow2(density_j)) * W.spikyGrad1 * W.spikyGrad(r, rn);
+            pressureForce -= (mass_i * (R.ratio(j) * particleParams.mass)) * (pressure_i / pow2(density_i) + pressure_j / pow2(density_j)) * W.pressureGradC * (P.grad() * W.pressureGrad(P.arg(r2))) * r;
         });
 
-        boundaryGrid.query(kernelParams.radius, boundaryPositions, currentFluidPosition[i], [&] (size_t j, const Vector3f &r, float r2) {
-            if (r2 < 1e-5f) {
-                return;
-            }
+        if (volumeMaps) {
+            pressureForce += boundaryPressureForce(i, mass_i);
+        } else {
+            auto B = R.boundaryPair(i);
+            queryBoundary(i, currentFluidPosition[i], [&] (size_t j, const Vector3f &r, float r2) {
+                if (r2 < 1e-5f || !B.inside(r2)) {
+                    return;
+                }
 
-            float rn = std::sqrt(r2);
+                const float &density_i = fluidDensities[i];
+                const float &density_j = boundaryDensities[j];
+                const float &pressure_i = fluidPressures[i];
+                const float &pressure_j = fluidPressures[i];
+                pressureForce -= mass_i * boundaryMass[j] * (pressure_i / pow2(density_i) + pressure_j / pow2(density_j)) * W.pressureGradC * (B.grad() * W.pressureGrad(B.arg(r2))) * r;
+            });
+        }
 
-            const float &density_i = fluidDensities[i];
-            const float &density_j = boundaryDensities[j];
-            const float &pressure_i = fluidPressures[i];
-            const float &pressure_j = fluidPressures[i];
-            pressureForce -= particleParams.mass * boundaryMass[j] * (pressure_i / pow2(density_i) + pressure_j / pow2(density_j)) * W.spikyGrad1 * W.spikyGrad(r, rn);
-        });
+        fluidPressureForces[i] = pressureForce;
+    });
+}
+
+
+// @Func : Vectorized variant of updatePressureForces. The pressure term of the fluid
+//         neighbours is precomputed per particle, so the neighbour sums only gather
+//         flat arrays: the fluid sum is (p_i/rho_i^2 + p_j/rho_j^2) and the boundary sum
+//         m_j * (p_i/rho_i^2 + p_i/rho_j^2), both times the spiky gradient.
+//         The pressure terms of a set are up to date as long as the set contains every
+//         particle whose pressure changed.
+void SPH::updatePressureForcesSIMD(const ActiveSet *set) {
+
+    forEachFluid(set, [&] (size_t i) {
+        fluidPressureTerms[i] = fluidPressures[i] / pow2(fluidDensities[i]);
+    });
+
+    const KernelSIMD::Functions &simd = KernelSIMD::functions(simdLevel);
+    const SoA3f &fluid = fluidStore.positions;
+
+    forEachFluid(set, [&] (size_t i) {
+        const Vector3f &p = currentFluidPosition[i];
+        const float pressureTerm = fluidPressureTerms[i];
 
+        Vector3f fluidSum = simd.spikyGradSum(fluidNeighbors.neighbors(i), fluidNeighbors.count(i),
+                                              fluid.x(), fluid.y(), fluid.z(), p, mullerKernel.smoothLength, mullerKernel.squaredSmoothLength,
+                                              nullptr, pressureTerm, 1.f, fluidPressureTerms.data());
+        Vector3f pressureForce;
+        if (volumeMaps) {
+            pressureForce = -mullerKernel.pressureGradC * (particleParams.squaredMass * fluidSum) + boundaryPressureForce(i, particleParams.mass);
+        } else {
+            Vector3f boundarySum = simd.spikyGradSum(boundaryNeighbors.neighbors(i), boundaryNeighbors.count(i),
+                                                     boundaryStore.x(), boundaryStore.y(), boundaryStore.z(), p, mullerKernel.smoothLength, mullerKernel.squaredSmoothLength,
+                                                     boundaryMass.data(), pressureTerm, fluidPressures[i], boundaryInverseSquaredDensities.data());
+            pressureForce = -mullerKernel.pressureGradC * (particleParams.squaredMass * fluidSum + particleParams.mass * boundarySum);
+        }
         fluidPressureForces[i] = pressureForce;
     });
 }
@@ -404,10 +1249,12 @@ void SPH::setVelocityAndPosition() {
 
     // Again, F = ma == >  a = F/m == > V(new) = V(old) + t * F / m
     //                     X(new) = X(old) + v * t
+    // The forces of lighter particles are compared at the base mass.
     ConcurrentUtils::ccLoop(currentFluidPosition.size(), [&] (size_t i) {
         Vector3f force = fluidForces[i] + fluidPressureForces[i];
-        maxForce.local() = std::max(maxForce.local(), force.squaredNorm());
-        newFluidVelocity[i] = currentFluidVelocity[i] + particleParams.inverseMass * force * timeStep;
+        float forceScale = adaptiveResolution ? 1.f / fluidMassRatios[i] : 1.f;
+        maxForce.local() = std::max(maxForce.local(), pow2(forceScale) * force.squaredNorm());
+        newFluidVelocity[i] = currentFluidVelocity[i] + inverseMass(i) * force * timeStep;
         newFluidPosition[i] = currentFluidPosition[i] + newFluidVelocity[i] * timeStep;
         maxVelocity.local() = std::max(maxVelocity.local(), currentFluidVelocity[i].squaredNorm());
     });
@@ -433,12 +1280,15 @@ void SPH::relax() {
     }
     currentTime= 0.f;
     timeBeforeShock = 0.f;
+    for (auto &emitter : emitters) {
+        emitter.distance = 0.f;
+    }
 }
 
 // @Func : Setup the simulation
 //       1. Initialize particle densities.
 //       2. Initialize position and velocity buffers for shocks.
-//       3. Relax the particle distributions.
+//       3. Relax the particle distributions (unless the "relax" setting is false).
 //       4. Reset clocks.
 // @Tested : true
 void SPH::basicSimSetup() {
@@ -446,7 +1296,11 @@ void SPH::basicSimSetup() {
     initDensities();
     fluidPositionBeforeShock = currentFluidPosition;
     fluidVelocityBeforeShock = currentFluidVelocity;
-    relax();
+    fluidMassRatiosBeforeShock = fluidMassRatios;
+    emitterDistancesBeforeShock.assign(emitters.size(), 0.f);
+    if (relaxOnSetup) {
+        relax();
+    }
 }
 
 
@@ -465,23 +1319,654 @@ void SPH::adjustTimeStep() {
     maximumForce = std::max(1e-8f, maximumForce);
 
     // Increase the timestep by 0.2% if the current loop is smooth.
-    if ((0.19f * std::sqrt(kernelParams.radius / maximumForce) > timeStep) &&
+    if ((0.19f * std::sqrt(finestKernelRadius() / maximumForce) > timeStep) &&
         (maximumDensityVariance < 4.5f * averageDensityVarianceTh) &&
         (averageDensityVariance < 0.9f * averageDensityVarianceTh) &&
-        (0.39f * kernelParams.radius / maximumVelocity > timeStep)) {
+        (0.39f * finestKernelRadius() / maximumVelocity > timeStep)) {
         timeStep *= 1.002f;
     }
 
 
     // Decrease the timestep by 0.2% if the current loop is fierce.
-    if ((0.2f * std::sqrt(kernelParams.radius / maximumForce) < timeStep) ||
+    if ((0.2f * std::sqrt(finestKernelRadius() / maximumForce) < timeStep) ||
         (maximumDensityVariance > 5.5f * averageDensityVarianceTh) ||
         (averageDensityVariance >= averageDensityVarianceTh) ||
-        (0.4f * kernelParams.radius / maximumVelocity <= timeStep)) {
+        (0.4f * finestKernelRadius() / maximumVelocity <= timeStep)) {
         timeStep *= 0.998f;
     }
 }
 
+// @Func : Select the particles updated in this step, the awake particles whose level is
+//         due: a particle on level L is updated in every 2^L-th step.
+//         The density of a sleeping particle only changes once an awake particle comes
+//         within the kernel radius, those sleeping particles join the density update.
+void SPH::selectStepSet() {
+
+    size_t size = currentFluidPosition.size();
+    stepParticles.reset(size, false);
+    if (sleeping) {
+        buildSleepCells();
+        sleepDensityParticles.reset(size, false);
+    }
+    ConcurrentUtils::ccLoop(size, [&] (size_t i) {
+        bool due = multiRateLevels == 0 || stepCount % (1u << fluidLevels[i]) == 0;
+        if (!isSleeping(i)) {
+            if (due) {
+                stepParticles.add(i);
+                if (sleeping) {
+                    sleepDensityParticles.add(i);
+                }
+            }
+            return;
+        }
+        bool nextToAwake = false;
+        fluidGrid.lookupCells(currentFluidPosition[i], kernelParams.radius, [&] (size_t first, size_t last) {
+            nextToAwake = sleepCellAwake[sleepCellOffsets[first]] != 0;
+            return !nextToAwake;
+        });
+        if (nextToAwake) {
+            sleepDensityParticles.add(i);
+        }
+    });
+    stepParticles.compact();
+    stepSet = &stepParticles;
+    if (sleeping) {
+        sleepDensityParticles.compact();
+    }
+}
+
+// @Func : Assign the levels of the particles updated in this step, the particle keeps the
+//         forces of this step for the next 2^L time steps.
+//         1. The level is the longest interval T = 2^L time steps in which
+//            a. the particle moves by at most multiRateTolerance particle diameters relative to
+//               any neighbour, with the velocities and the accelerations of the last updates:
+//               |v_i - v_j| * T + 0.5 * |a_i - a_j| * T^2,
+//            b. its density, drifting with the rate of the continuity equation
+//               D rho_i / Dt = Sum(m_j (v_i - v_j) . gradW_ij) and its change with the relative
+//               accelerations, stays within the average compression the solver accepts. The
+//               density error of a particle between its updates is bounded by maxCompression,
+//               as long as the accelerations of the last updates hold,
+//            c. its extrapolation over the interval of the next level, which the neighbours
+//               of a particle up to one level above use, stays within half the neighbour list
+//               skin, so the lists need not be widened for quiet particles.
+//            Compressed particles are on level 0.
+//         2. The level rises by at most one per update and is limited to one above the level
+//            of every neighbour. The step must be a multiple of 2^L.
+//         3. Neighbours that are not updated in this step and are more than one level above
+//            are woken up, they are updated in the next step.
+//         Sleeping neighbours are at rest and do not limit the levels.
+void SPH::updateMultiRateLevels() {
+
+    WITH_KERNEL(updateMultiRateLevels(W));
+}
+
+template<typename KernelType>
+void SPH::updateMultiRateLevels(const KernelType &W) {
+
+    size_t size = currentFluidPosition.size();
+    fluidLevelScratch.resize(size);
+
+    const float maxDisplacement = multiRateTolerance * particleParams.diameter;
+    const float maxListDisplacement = 0.5f * neighborSkin;
+    stepSet->forEach([&] (size_t i) {
+        int level = 0;
+        const float densityVariation = fluidDensities[i] - simConstParams.restDensity;
+        if (densityVariation < averageDensityVarianceTh) {
+            const Vector3f v = currentFluidVelocity[i];
+            const Vector3f f = fluidForces[i] + fluidPressureForces[i];
+            float relativeVelocity = 0.f;
+            float relativeForce = 0.f;
+            float densityRate = 0.f;
+            float densityRateChange = 0.f;
+            queryFluid(i, [&] (size_t j, const Vector3f &r, float r2) {
+                const Vector3f fj = fluidForces[j] + fluidPressureForces[j];
+                relativeVelocity = std::max(relativeVelocity, (v - currentFluidVelocity[j]).squaredNorm());
+                relativeForce = std::max(relativeForce, (f - fj).squaredNorm());
+                if (r2 > 1e-5f) {
+                    Vector3f gradient = (W.pressureGradC * W.pressureGrad(r2)) * r;
+                    densityRate += (v - currentFluidVelocity[j]).dot(gradient);
+                    densityRateChange += (f - fj).dot(gradient);
+                }
+            });
+            relativeVelocity = std::sqrt(relativeVelocity);
+            float relativeAcceleration = particleParams.inverseMass * std::sqrt(relativeForce);
+            densityRate = particleParams.mass * std::abs(densityRate);
+            densityRateChange = std::abs(densityRateChange);
+            const float speed = v.norm();
+            const float acceleration = particleParams.inverseMass * f.norm();
+            const float densityMargin = averageDensityVarianceTh - std::max(0.f, densityVariation);
+
+            int maxLevel = std::min(multiRateLevels, fluidLevels[i] + 1);
+            while (level < maxLevel) {
+                float T = timeStep * float(2 << level);
+                if (relativeVelocity * T + 0.5f * relativeAcceleration * T * T > maxDisplacement ||
+                    densityRate * T + 0.5f * densityRateChange * T * T > densityMargin) {
+                    break;
+                }
+                float n = float(1 << std::min(level + 2, multiRateLevels));
+                if (n * timeStep * speed + 0.5f * n * (n + 1.f) * pow2(timeStep) * acceleration > maxListDisplacement) {
+                    break;
+                }
+                ++level;
+            }
+        }
+        fluidLevelScratch[i] = level;
+    });
+
+    stepSet->forEach([&] (size_t i) {
+        int level = fluidLevelScratch[i];
+        queryFluid(i, [&] (size_t j, const Vector3f &r, float r2) {
+            if (!isSleeping(j)) {
+                level = std::min(level, (stepSet->contains(j) ? fluidLevelScratch[j] : fluidLevels[j]) + 1);
+            }
+        });
+        while (stepCount % (1u << level) != 0) {
+            --level;
+        }
+        fluidLevels[i] = level;
+    });
+
+    wakeSet.reset(size, false);
+    stepSet->forEach([&] (size_t i) {
+        queryFluid(i, [&] (size_t j, const Vector3f &r, float r2) {
+            if (!stepSet->contains(j) && !isSleeping(j) && fluidLevels[j] > fluidLevels[i] + 1) {
+                wakeSet.add(j);
+            }
+        });
+    });
+    wakeSet.compact();
+    wakeSet.forEach([&] (size_t j) {
+        fluidLevels[j] = 0;
+    });
+}
+
+// @Func : Find the occupied fluid grid cells, the particles are sorted by cell, every
+//         occupied cell is a range of particles. A cell is awake if any of its particles is.
+void SPH::buildSleepCells() {
+
+    size_t size = currentFluidPosition.size();
+
+    auto cellStart = [this] (size_t i) {
+        return i == 0 || fluidGrid.cellKey(currentFluidPosition[i]) != fluidGrid.cellKey(currentFluidPosition[i - 1]);
+    };
+    sleepCellOffsets.resize(size);
+    size_t cellCount = ConcurrentUtils::exclusiveScan<size_t>(size, [&] (size_t i) {
+        return size_t(cellStart(i) ? 1 : 0);
+    }, sleepCellOffsets);
+    sleepCellBegin.resize(cellCount + 1);
+    sleepCellActivity.resize(cellCount);
+    sleepCellBegin.back() = uint32_t(size);
+    ConcurrentUtils::ccLoop(size, [&] (size_t i) {
+        if (cellStart(i)) {
+            sleepCellBegin[sleepCellOffsets[i]] = uint32_t(i);
+        }
+    });
+
+    sleepCellAwake.resize(cellCount);
+    ConcurrentUtils::ccLoop(cellCount, [&] (size_t c) {
+        int awake = 0;
+        for (size_t i = sleepCellBegin[c]; i < sleepCellBegin[c + 1] && !awake; ++i) {
+            awake = isSleeping(i) ? 0 : 1;
+        }
+        sleepCellAwake[c] = awake;
+    });
+}
+
+// @Func : Put quiet grid cells to sleep and wake the cells next to active ones, on the cells
+//         found by selectStepSet.
+//         1. The activity of an occupied fluid grid cell is the speed of its mean velocity.
+//         2. A cell is quiet if its activity is below sleepVelocity, its mean compression is
+//            below sleepDensityError and no neighbouring cell is more active than wakeVelocity.
+//            After sleepSteps quiet steps in a row it falls asleep, its particles come to rest
+//            and leave the step set. A cell that is not quiet wakes up, its particles are
+//            updated from the next step on. The count of a cell is the lowest count of its
+//            particles, so particles moving in from an awake cell wake a sleeping one.
+//         3. A sleeping cell stays quiet up to a mean compression of wakeDensityError. Its
+//            particles next to awake ones have their densities updated, the densities of the
+//            others are those of their sleeping neighbourhood.
+//         4. The predicted positions of the particles outside the step set (sleeping or just
+//            woken up, at rest) stay at their positions, so the prediction-correction loop
+//            sees their density.
+void SPH::updateSleeping() {
+
+    size_t size = currentFluidPosition.size();
+    size_t cellCount = sleepCellActivity.size();
+
+    ConcurrentUtils::ccLoop(cellCount, [&] (size_t c) {
+        Vector3f velocity;
+        for (size_t i = sleepCellBegin[c]; i < sleepCellBegin[c + 1]; ++i) {
+            velocity += currentFluidVelocity[i];
+        }
+        sleepCellActivity[c] = velocity.norm() / (sleepCellBegin[c + 1] - sleepCellBegin[c]);
+    });
+
+    ConcurrentUtils::ccLoop(cellCount, [&] (size_t c) {
+        size_t begin = sleepCellBegin[c];
+        size_t end = sleepCellBegin[c + 1];
+        float compression = 0.f;
+        int steps = sleepSteps;
+        for (size_t i = begin; i < end; ++i) {
+            compression += std::max(0.f, fluidDensities[i] - simConstParams.restDensity);
+            steps = std::min(steps, fluidSleepSteps[i]);
+        }
+        bool asleep = steps >= sleepSteps;
+
+        float densityError = asleep ? wakeDensityError : sleepDensityError;
+        bool quiet = sleepCellActivity[c] < sleepVelocity && compression < densityError * simConstParams.restDensity * (end - begin);
+        fluidGrid.lookupCells(currentFluidPosition[begin], kernelParams.radius, [&] (size_t first, size_t last) {
+            quiet = quiet && sleepCellActivity[sleepCellOffsets[first]] <= wakeVelocity;
+            return quiet;
+        });
+        steps = quiet ? std::min(steps + 1, sleepSteps) : 0;
+
+        for (size_t i = begin; i < end; ++i) {
+            fluidSleepSteps[i] = steps;
+            if (steps == sleepSteps && !asleep) {
+                currentFluidVelocity[i] = Vector3f(0.f);
+                fluidForces[i] = Vector3f(0.f);
+                fluidPressureForces[i] = Vector3f(0.f);
+                stepParticles.remove(i);
+            } else if (steps < sleepSteps && asleep && multiRateLevels > 0) {
+                fluidLevels[i] = 0;
+            }
+        }
+    });
+    stepParticles.compact();
+
+    ConcurrentUtils::ccLoop(size, [&] (size_t i) {
+        if (!stepParticles.contains(i)) {
+            newFluidPosition[i] = currentFluidPosition[i];
+            if (soaLayout) {
+                fluidStore.predictedPositions.set(i, currentFluidPosition[i]);
+            }
+        }
+    });
+}
+
+// @Func : Mark the particles refined by the adaptive resolution, fluidRefinement is 0 for them and
+//         levels for the others. Refined particles are closer than adaptiveCameraDistance to the
+//         camera or at the free surface: their colour field gradient is longer than adaptiveSurface
+//         kernel radii. Unlike the normals of the surface tension, the gradient includes the solid
+//         (boundary particles or volume map), so particles along the walls are not refined.
+template<typename KernelType, typename Resolution>
+void SPH::markSurface(const KernelType &W, const Resolution &R, int levels) {
+
+    const float surface = pow2(adaptiveSurface);
+    const float cameraDistance = pow2(adaptiveCameraDistance);
+    const float boundaryVolume = 1.f / simConstParams.restDensity;
+    ConcurrentUtils::ccLoop(currentFluidPosition.size(), [&] (size_t i) {
+        const Vector3f &x = currentFluidPosition[i];
+        if ((x - adaptiveCamera).squaredNorm() < cameraDistance) {
+            fluidRefinement[i] = 0;
+            return;
+        }
+        Vector3f gradient;
+        queryFluid(i, currentFluidPosition, x, [&] (size_t j, const Vector3f &r, float r2) {
+            auto P = R.fluidPair(i, j);
+            if (P.inside(r2)) {
+                gradient += r * (P.grad() * R.ratio(j) * particleParams.mass * W.densityGrad(P.arg(r2)) / fluidDensities[j]);
+            }
+        });
+        gradient *= W.densityGradC;
+        if (volumeMaps) {
+            gradient += volumeMap.densityGradient(x);
+        } else {
+            Vector3f solid;
+            auto B = R.boundaryPair(i);
+            queryBoundary(i, x, [&] (size_t j, const Vector3f &r, float r2) {
+                if (B.inside(r2)) {
+                    solid += r * (B.grad() * W.densityGrad(B.arg(r2)) * boundaryMass[j] * boundaryVolume);
+                }
+            });
+            gradient += W.densityGradC * solid;
+        }
+        gradient *= kernelParams.radius * R.scale(i);
+        fluidRefinement[i] = gradient.squaredNorm() > surface ? 0 : levels;
+    });
+}
+
+// @Func : Split and merge fluid particles for the adaptive resolution, at the end of every
+//         adaptiveInterval-th step. Uses the densities and neighbours of the step, the particles
+//         are still sorted by cell.
+//         1. Refined particles are at the free surface or close to the camera, see markSurface.
+//            fluidRefinement counts the neighbour rings to the closest refined particle, the
+//            target mass of a particle is adaptiveMinMass doubled per ring, up to the base mass.
+//            Neighbours differ by at most one ring, so the masses of neighbours differ by a
+//            factor of two at most.
+//         2. Particles at least twice as heavy as their target split into two halves with its
+//            velocity and pressure, placed on both sides of the particle at the rest spacing of the
+//            halves and relaxed against their neighbours. The time step shrinks with the finest
+//            kernel radius.
+//         3. Particles lighter than their target pair up with their closest neighbour if both
+//            choose each other and the pair is not heavier than either target. The pair merges
+//            into its centre of mass, with its momentum. Split halves are never light enough to
+//            merge again at the same target.
+//         4. The particle arrays are compacted in order, the halves of a split particle are
+//            next to each other.
+void SPH::adaptResolution() {
+
+    const size_t size = currentFluidPosition.size();
+    fluidRefinement.resize(size);
+    fluidRefinementScratch.resize(size);
+    fluidRefinementOffsets.resize(size);
+
+    int levels = 0;
+    while (levels < 30 && (adaptiveMinMass * float(1 << levels)) < 1.f) {
+        ++levels;
+    }
+    // The neighbour lists of the step are rebuilt around the integrated positions if they moved
+    // too far, newFluidPosition holds the sorted positions of the step.
+    if (useNeighborLists && 2.f * largestDisplacement(currentFluidPosition, neighborListPositions) > neighborListSkin) {
+        rebuildNeighborLists(currentFluidPosition, newFluidPosition, false);
+    }
+    WITH_RESOLUTION(markSurface(W, R, levels));
+    for (int ring = 1; ring < levels; ++ring) {
+        ConcurrentUtils::ccLoop(size, [&] (size_t i) {
+            int rings = fluidRefinement[i];
+            queryFluid(i, currentFluidPosition, currentFluidPosition[i], [&] (size_t j, const Vector3f &, float) {
+                rings = std::min(rings, fluidRefinement[j] + 1);
+            });
+            fluidRefinementScratch[i] = rings;
+        });
+        std::swap(fluidRefinement, fluidRefinementScratch);
+    }
+    auto target = [&] (size_t i) {
+        return std::min(1.f, adaptiveMinMass * float(1 << fluidRefinement[i]));
+    };
+
+    // Merge partners.
+    ConcurrentUtils::ccLoop(size, [&] (size_t i) {
+        int partner = -1;
+        const float mass = fluidMassRatios[i];
+        const float targetMass = target(i);
+        if (mass < targetMass) {
+            float closest = PCI_INFINITY;
+            queryFluid(i, currentFluidPosition, currentFluidPosition[i], [&] (size_t j, const Vector3f &, float r2) {
+                float pairMass = mass + fluidMassRatios[j];
+                if (j != i && pairMass <= targetMass && pairMass <= target(j) && r2 < closest) {
+                    closest = r2;
+                    partner = int(j);
+                }
+            });
+        }
+        fluidRefinementScratch[i] = partner;
+    });
+
+    auto splits = [&] (size_t i) {
+        return fluidMassRatios[i] >= 2.f * target(i);
+    };
+    auto partner = [&] (size_t i) {
+        int j = fluidRefinementScratch[i];
+        return j >= 0 && fluidRefinementScratch[j] == int(i) ? j : -1;
+    };
+    auto outputs = [&] (size_t i) -> size_t {
+        int j = partner(i);
+        return j >= 0 ? (j > int(i) ? 1 : 0) : (splits(i) ? 2 : 1);
+    };
+    const size_t newSize = ConcurrentUtils::exclusiveScan<size_t>(size, outputs, fluidRefinementOffsets);
+
+    if (profile) {
+        int splitCount = 0;
+        for (size_t i = 0; i < size; ++i) {
+            splitCount += splits(i) ? 1 : 0;
+        }
+        stepStats.splits = splitCount;
+        stepStats.merges = int(size) + splitCount - int(newSize);
+    }
+
+    // Per-particle values, the pressures are averaged and the mass ratios add up.
+    auto gather = [&] (PCI1Mf &values, bool additive) {
+        fluidScratch.resize(newSize);
+        ConcurrentUtils::ccLoop(size, [&] (size_t i) {
+            if (outputs(i) == 0) {
+                return;
+            }
+            size_t k = fluidRefinementOffsets[i];
+            float value = values[i];
+            int j = partner(i);
+            if (j >= 0) {
+                float mi = fluidMassRatios[i];
+                float mj = fluidMassRatios[j];
+                value = additive ? value + values[j] : (mi * value + mj * values[j]) / (mi + mj);
+            } else if (splits(i)) {
+                value = additive ? 0.5f * value : value;
+                fluidScratch[k + 1] = value;
+            }
+            fluidScratch[k] = value;
+        });
+        std::swap(values, fluidScratch);
+    };
+    if (warmStart) {
+        gather(fluidPressures, false);
+        gather(fluidPreviousPressures, false);
+    }
+
+    // The halves of a split particle are one rest spacing of the halves apart, along the coordinate
+    // axis with the fewest close neighbours, so repeated splits do not pile the particles up along
+    // one axis. Then the halves of all split particles spread out in a few Jacobi iterations, every
+    // half moves away from the halves and particles closer than their rest spacing.
+    const float halfScale = std::cbrt(0.5f);
+    auto halfRadius = [&] (size_t i) {
+        return particleParams.radius * fluidScales[i] * (splits(i) ? halfScale : 1.f);
+    };
+    fluidSplitHalves.resize(2 * size);
+    fluidSplitHalvesScratch.resize(2 * size);
+    ConcurrentUtils::ccLoop(size, [&] (size_t i) {
+        if (!splits(i)) {
+            return;
+        }
+        const Vector3f &x = currentFluidPosition[i];
+        const float squaredRadius = pow2(fluidScales[i]) * kernelParams.squaredRadius;
+        Vector3f spread;
+        queryFluid(i, currentFluidPosition, x, [&] (size_t, const Vector3f &r, float r2) {
+            if (r2 > EPSILON && r2 < squaredRadius) {
+                spread += (pow2(1.f - r2 / squaredRadius) / r2) * r.cwiseProduct(r);
+            }
+        });
+        int axis;
+        spread.minCoeff(&axis);
+        Vector3f offset(0.f);
+        offset[axis] = (getenv("OFS") ? float(atof(getenv("OFS"))) : ADAPTIVE_SPLIT_OFFSET) * halfRadius(i);
+        fluidSplitHalves[2 * i] = x - offset;
+        fluidSplitHalves[2 * i + 1] = x + offset;
+    });
+    for (int iteration = 0; iteration < (getenv("RLX") ? atoi(getenv("RLX")) : ADAPTIVE_SPLIT_RELAXATION); ++iteration) {
+        ConcurrentUtils::ccLoop(2 * size, [&] (size_t h) {
+            const size_t i = h / 2;
+            if (!splits(i)) {
+                return;
+            }
+            const Vector3f &y = fluidSplitHalves[h];
+            const float radius = halfRadius(i);
+            Vector3f push;
+            auto repel = [&] (const Vector3f &q, float spacing) {
+                Vector3f e = periodicDomain.minimumImage(y - q);
+                float r2 = e.squaredNorm();
+                if (r2 > EPSILON && r2 < pow2(spacing)) {
+                    float r = std::sqrt(r2);
+                    push += ((spacing - r) / r) * e;
+                }
+            };
+            repel(fluidSplitHalves[h ^ 1], 2.f * radius);
+            queryFluid(i, currentFluidPosition, currentFluidPosition[i], [&] (size_t j, const Vector3f &, float) {
+                if (j == i) {
+                    return;
+                }
+                float spacing = radius + halfRadius(j);
+                if (splits(j)) {
+                    repel(fluidSplitHalves[2 * j], spacing);
+                    repel(fluidSplitHalves[2 * j + 1], spacing);
+                } else {
+                    repel(currentFluidPosition[j], spacing);
+                }
+            });
+            fluidSplitHalvesScratch[h] = y + (getenv("RW") ? float(atof(getenv("RW"))) : 0.25f) * push;
+        });
+        std::swap(fluidSplitHalves, fluidSplitHalvesScratch);
+    }
+
+    newFluidPosition.resize(newSize);
+    newFluidVelocity.resize(newSize);
+    ConcurrentUtils::ccLoop(size, [&] (size_t i) {
+        if (outputs(i) == 0) {
+            return;
+        }
+        size_t k = fluidRefinementOffsets[i];
+        const Vector3f &x = currentFluidPosition[i];
+        const Vector3f &v = currentFluidVelocity[i];
+        int j = partner(i);
+        if (j >= 0) {
+            float mi = fluidMassRatios[i];
+            float mj = fluidMassRatios[j];
+            float inverseMass = 1.f / (mi + mj);
+            newFluidPosition[k] = periodicDomain.wrap(x + (mj * inverseMass) * periodicDomain.minimumImage(currentFluidPosition[j] - x));
+            newFluidVelocity[k] = (mi * inverseMass) * v + (mj * inverseMass) * currentFluidVelocity[j];
+        } else if (splits(i)) {
+            newFluidPosition[k] = periodicDomain.wrap(fluidSplitHalves[2 * i]);
+            newFluidPosition[k + 1] = periodicDomain.wrap(fluidSplitHalves[2 * i + 1]);
+            newFluidVelocity[k] = v;
+            newFluidVelocity[k + 1] = v;
+        } else {
+            newFluidPosition[k] = x;
+            newFluidVelocity[k] = v;
+        }
+    });
+    std::swap(currentFluidPosition, newFluidPosition);
+    std::swap(currentFluidVelocity, newFluidVelocity);
+
+    gather(fluidMassRatios, true);
+    fluidScales.resize(newSize);
+    Thread_float minMass(1.f);
+    ConcurrentUtils::ccLoop(newSize, [&] (size_t i) {
+        fluidScales[i] = std::cbrt(fluidMassRatios[i]);
+        minMass.local() = std::min(minMass.local(), fluidMassRatios[i]);
+    });
+    const float previousScale = finestScale;
+    finestScale = std::cbrt(std::accumulate(minMass.begin(), minMass.end(), 1.f, [] (float a, float b) { return std::min(a, b); }));
+
+    // The time step follows the finest kernel right away, adjustTimeStep would only shrink it
+    // by 0.2% per step and the first steps of the halves would run with the coarse step.
+    if (finestScale < previousScale) {
+        timeStep = std::min(timeStep * finestScale / previousScale, 0.39f * finestKernelRadius() / maximumVelocity);
+    }
+
+    resizeFluid(newSize);
+}
+
+// @Func : Remove the fluid particles inside of sinks and add the layers the emitters released
+//         during the coming step, at the start of the step before the particles are sorted.
+//         1. Emitted particles take the slots of removed particles first, in particle order.
+//         2. Emitted particles without a free slot are appended.
+//         3. Free slots that are left are compacted in order, the remaining particles keep the
+//            cell order of the last sort.
+//         New particles start with the emitter velocity, no pressure and the finest multi-rate
+//         level.
+void SPH::updatePool() {
+
+    const size_t size = currentFluidPosition.size();
+
+    emittedPositions.clear();
+    emittedVelocities.clear();
+    for (auto &emitter : emitters) {
+        emitter.emit(currentTime + timeStep, timeStep, [&] (const Vector3f &p, const Vector3f &v) {
+            emittedPositions.emplace_back(periodicDomain.wrap(p));
+            emittedVelocities.emplace_back(v);
+        });
+    }
+
+    size_t removed = 0;
+    if (!sinks.empty()) {
+        fluidRemoved.resize(size);
+        poolOffsets.resize(size);
+        ConcurrentUtils::ccLoop(size, [&] (size_t i) {
+            fluidRemoved[i] = sinks.contains(currentFluidPosition[i]) ? 1 : 0;
+        });
+        removed = ConcurrentUtils::exclusiveScan<size_t>(size, [&] (size_t i) {
+            return size_t(fluidRemoved[i]);
+        }, poolOffsets);
+    }
+
+    size_t emitted = emittedPositions.size();
+    if (maxParticles > 0) {
+        emitted = std::min(emitted, size_t(maxParticles) - std::min(size_t(maxParticles), size - removed));
+    }
+    if (profile) {
+        stepStats.emitted = int(emitted);
+        stepStats.removed = int(removed);
+    }
+    if (removed == 0 && emitted == 0) {
+        return;
+    }
+
+    poolSize = size - removed + emitted;
+    poolSlots.resize(emitted);
+    if (removed <= emitted) {
+        // Every free slot is taken, the other particles keep their index.
+        poolPermutation.clear();
+        ConcurrentUtils::ccLoop(removed > 0 ? size : 0, [&] (size_t i) {
+            if (fluidRemoved[i]) {
+                poolSlots[poolOffsets[i]] = i;
+            }
+        });
+        for (size_t k = removed; k < emitted; ++k) {
+            poolSlots[k] = size + k - removed;
+        }
+    } else {
+        auto kept = [&] (size_t i) {
+            return !fluidRemoved[i] || poolOffsets[i] < emitted;
+        };
+        poolKeptOffsets.resize(size);
+        ConcurrentUtils::exclusiveScan<size_t>(size, [&] (size_t i) {
+            return size_t(kept(i));
+        }, poolKeptOffsets);
+        poolPermutation.resize(poolSize);
+        ConcurrentUtils::ccLoop(size, [&] (size_t i) {
+            if (kept(i)) {
+                poolPermutation[poolKeptOffsets[i]] = uint32_t(i);
+                if (fluidRemoved[i]) {
+                    poolSlots[poolOffsets[i]] = poolKeptOffsets[i];
+                }
+            }
+        });
+    }
+
+    // The predicted buffers are overwritten during the step, use them as scratch space.
+    repool(currentFluidPosition, newFluidPosition, [&] (size_t k) { return emittedPositions[k]; });
+    repool(currentFluidVelocity, newFluidVelocity, [&] (size_t k) { return emittedVelocities[k]; });
+    auto zero = [] (size_t k) { return 0.f; };
+    if (warmStart || partialSteps()) {
+        repool(fluidPressures, fluidScratch, zero);
+    }
+    if (warmStart) {
+        repool(fluidPreviousPressures, fluidScratch, zero);
+    }
+    if (adaptiveResolution) {
+        const float scale = std::cbrt(emittedMassRatio);
+        repool(fluidMassRatios, fluidScratch, [&] (size_t k) { return emittedMassRatio; });
+        repool(fluidScales, fluidScratch, [&] (size_t k) { return scale; });
+        if (emitted > 0) {
+            finestScale = std::min(finestScale, scale);
+        }
+    }
+    if (multiRateLevels > 0) {
+        repool(fluidLevels, fluidLevelScratch, [] (size_t k) { return 0; });
+    }
+    if (sleeping) {
+        repool(fluidSleepSteps, fluidLevelScratch, [] (size_t k) { return 0; });
+    }
+    if (partialSteps()) {
+        auto zeroVector = [] (size_t k) { return Vector3f(0.f); };
+        repool(fluidDensities, fluidScratch, [&] (size_t k) { return simConstParams.restDensity; });
+        repool(fluidNormals, newFluidPosition, zeroVector);
+        repool(fluidForces, newFluidPosition, zeroVector);
+        repool(fluidPressureForces, newFluidPosition, zeroVector);
+        if (simdLevel != KernelSIMD::Scalar) {
+            repool(fluidPressureTerms, fluidScratch, zero);
+        }
+    }
+    resizeFluid(poolSize);
+}
+
 //  @Func : This function detects whether there is a shock.
 //          Return true if a shock is detected.
 bool SPH::isShock() {
@@ -499,7 +1984,7 @@ bool SPH::isShock() {
     }
 
     // Shock condition 3 :
-    if (0.45f * kernelParams.radius / maximumVelocity < timeStep) {
+    if (0.45f * finestKernelRadius() / maximumVelocity < timeStep) {
         return true;
     }
 
@@ -512,19 +1997,50 @@ bool SPH::isShock() {
 //         to make the PC-loop to converge. If a shock is detected by the algorithm,
 //         it will automatically rollback the simulation by 2 frames and assign a
 //         new timestep to it based on the physical condition of that shock.
-void SPH::handleShock() {
-
+//         Returns true if the simulation was rolled back.
+bool SPH::handleShock() {
 
-    if (isShock()) {
+    bool shock = isShock();
+    if (shock) {
 
         // Assign a new timestep based on the CURRENT physical condition.
-        timeStep = std::min(0.2f * std::sqrt(kernelParams.radius / maximumForce), 0.25f * kernelParams.radius / maximumVelocity);
+        timeStep = std::min(0.2f * std::sqrt(finestKernelRadius() / maximumForce), 0.25f * finestKernelRadius() / maximumVelocity);
 
         // Rollback 2 frames
         currentTime = timeBeforeShock;
         currentFluidPosition = fluidPositionBeforeShock;
         currentFluidVelocity = fluidVelocityBeforeShock;
 
+        // The particles may have been split or merged since, restore their masses as well.
+        if (adaptiveResolution) {
+            std::swap(fluidMassRatios, fluidMassRatiosBeforeShock);
+            fluidScales.resize(fluidMassRatios.size());
+            ConcurrentUtils::ccLoop(fluidMassRatios.size(), [&] (size_t i) {
+                fluidScales[i] = std::cbrt(fluidMassRatios[i]);
+            });
+            finestScale = std::cbrt(*std::min_element(fluidMassRatios.begin(), fluidMassRatios.end()));
+        }
+
+        // The emitters go back to the restored particles.
+        for (size_t i = 0; i < emitters.size(); ++i) {
+            emitters[i].distance = emitterDistancesBeforeShock[i];
+        }
+
+        // The pressures of the rolled back steps are neither valid nor in the order of the restored particles.
+        if (warmStart) {
+            std::fill(fluidPressures.begin(), fluidPressures.end(), 0.f);
+            std::fill(fluidPreviousPressures.begin(), fluidPreviousPressures.end(), 0.f);
+        }
+
+        // The same holds for the state kept by the multi-rate levels and sleeping particles,
+        // update all particles in the next step.
+        if (multiRateLevels > 0) {
+            std::fill(fluidLevels.begin(), fluidLevels.end(), 0);
+        }
+        if (sleeping) {
+            std::fill(fluidSleepSteps.begin(), fluidSleepSteps.end(), 0);
+        }
+
     } else {
         previousMaxDensityVariance = maximumDensityVariance;
     }
@@ -534,35 +2050,90 @@ void SPH::handleShock() {
     timeBeforeShock = currentTime;
     std::swap(newFluidPosition, fluidPositionBeforeShock);
     std::swap(newFluidVelocity, fluidVelocityBeforeShock);
+    if (adaptiveResolution && !shock) {
+        fluidMassRatiosBeforeShock = fluidMassRatios;
+    }
+    if (shock) {
+        resizeFluid(currentFluidPosition.size());
+    } else {
+        emitterDistancesBeforeShock.resize(emitters.size());
+        for (size_t i = 0; i < emitters.size(); ++i) {
+            emitterDistancesBeforeShock[i] = emitters[i].distance;
+        }
+    }
+    return shock;
 }
 
-// This function implements the pci-sph algorithm mentioned in
-// Alogrithm 2 in the paper.
+// This function implements one simulation step. The pressure solver of the scene
+// (PCISPH implements the pci-sph algorithm mentioned in Alogrithm 2 in the paper)
+// runs after the densities and non-pressure forces are computed.
 void SPH::simulate(int maxIterations) {
 
+    PhaseTimer timer(profile);
+    if (profile) {
+        stepStats.reset();
+        stepStats.time = currentTime;
+    }
+
+    if (!emitters.empty() || !sinks.empty()) {
+        updatePool();
+        timer.lap(stepStats.pool);
+    }
+    if (!boundaryBodies.empty()) {
+        moveBoundaries();
+        timer.lap(stepStats.boundaryMotion);
+    }
     buildFluidGrids();
+    if (partialSteps()) {
+        selectStepSet();
+    }
+    timer.lap(stepStats.gridBuild);
+    buildNeighborLists();
+    timer.lap(stepStats.neighborLists);
     testBoundary();
-    initDensities();
-    initNormals();
-    initForces();
-
-    int iterations = 0;
-    while (iterations < maxIterations) {
-        predictVelocityAndPosition();
-        updateDensityVarianceScale();
-        updatePressures();
-        updatePressureForces();
-        if (++iterations >= MIN_ITERATION && maximumDensityVariance < maximumDensityVarianceTh) {
-            break;
-        }
+    timer.lap(stepStats.boundaryTest);
+    initDensities(sleeping ? &sleepDensityParticles : stepSet);
+    timer.lap(stepStats.densities);
+    if (sleeping) {
+        updateSleeping();
+        timer.lap(stepStats.sleep);
     }
-
-    setVelocityAndPosition();
+    if (multiRateLevels > 0) {
+        updateMultiRateLevels();
+        timer.lap(stepStats.levels);
+    }
+    stepStats.updatedParticles = int(stepSet ? stepSet->size() : currentFluidPosition.size());
+    if (profile && sleeping) {
+        size_t sleepingParticles = std::count_if(fluidSleepSteps.begin(), fluidSleepSteps.end(), [this] (int steps) { return steps >= sleepSteps; });
+        stepStats.activeFraction = 1.f - float(sleepingParticles) / currentFluidPosition.size();
+    }
+    initNormals(stepSet);
+    timer.lap(stepStats.normals);
+    initForces(stepSet);
+    solver->prepare(*this);
+    stepStats.timeStep = timeStep;
+    timer.lap(stepStats.forces);
+
+    solver->solve(*this, timer, maxIterations);
     adjustParticles();
+    timer.lap(stepStats.collisions);
 
-    adjustTimeStep();
-    handleShock();
+    bool shock = solver->adjustTimeStep(*this, timer);
     currentTime += timeStep;
+    ++stepCount;
+    if (adaptiveResolution && !shock && stepCount % adaptiveInterval == 0) {
+        adaptResolution();
+        timer.lap(stepStats.adapt);
+    }
+    stepStats.particles = int(currentFluidPosition.size());
+
+    if (profile) {
+        timer.total(stepStats.total);
+        stepStats.shock = shock;
+        if (profileOutput) {
+            *profileOutput << stepStats.toJson().dump() << std::endl;
+        }
+    }
 }
 
 
@@ -571,16 +2142,69 @@ void SPH::simulate(int maxIterations) {
 // @Tested : false
 void SPH::buildScene(const Scene &scene) {
 
+    // Boundaries with keyframes are moving bodies.
+    const bool periodic = periodicAxes[0] || periodicAxes[1] || periodicAxes[2];
+    bool moving = false;
+    for (const auto &sceneBox : scene.boxes) {
+        moving = moving || (sceneBox.type == Scene::Boundary && !sceneBox.keyframes.empty());
+    }
+    for (const auto &sceneMesh : scene.meshes) {
+        moving = moving || (sceneMesh.type == Scene::Boundary && !sceneMesh.keyframes.empty());
+    }
+    if (moving && periodic) {
+        std::cout << "Moving boundaries are not supported with periodic axes, the boundaries are static" << std::endl;
+    } else if (moving && volumeMaps) {
+        std::cout << "Moving boundaries are not supported with volume maps, using particles" << std::endl;
+        volumeMaps = false;
+    }
+    auto addBody = [&] (const Scene::Shape &shape, const Box3f &bounds) {
+        if (shape.keyframes.empty() || periodic) {
+            boundaryMeshBodies.push_back(-1);
+        } else {
+            boundaryMeshBodies.push_back(int(boundaryBodies.size()));
+            boundaryBodies.emplace_back(BoundaryBody(shape.keyframes, bounds, int(boundaryMeshes.size())));
+        }
+        return boundaryMeshBodies.back();
+    };
+    auto addCollider = [&] (int body, VoxelGrid<float> sdf) {
+        if (body >= 0) {
+            boundaryBodies[body].collider = int(colliders.sdfCount());
+        }
+        colliders.add(CollisionSDF(std::move(sdf), MESH_COLLISION_MARGIN * particleParams.radius));
+    };
+
+    // Volume maps and mesh colliders need the inside of every boundary mesh.
+    std::vector<Mesh> meshes;
+    std::vector<bool> closed;
+    for (const auto &sceneMesh : scene.meshes) {
+        meshes.emplace_back(ObjLoader::load(sceneMesh.filename));
+        closed.push_back(sceneMesh.type != Scene::Boundary || !(volumeMaps || meshCollisions) || VolumeMap::isClosed(meshes.back()));
+        if (!closed.back() && volumeMaps) {
+            std::cout << "Boundary mesh " << sceneMesh.filename << " is not closed, using particles" << std::endl;
+            volumeMaps = false;
+        }
+        if (!closed.back() && meshCollisions) {
+            std::cout << "Boundary mesh " << sceneMesh.filename << " is not closed, no collider" << std::endl;
+        }
+    }
+
     for (const auto &sceneBox : scene.boxes) {
         switch (sceneBox.type) {
         case Scene::Fluid:
             generateFluidParticles(ParticleGenerator::generateFromVolumeBox(sceneBox.bounds, particleParams.radius));
             break;
-        case Scene::Boundary:
-            generateBoundaryParticles(ParticleGenerator::generateFromBoundaryBox(sceneBox.bounds, particleParams.radius));
+        case Scene::Boundary: {
+            int body = addBody(sceneBox, sceneBox.bounds);
+            if (!volumeMaps) {
+                generateBoundaryParticles(ParticleGenerator::generateFromBoundaryBox(sceneBox.bounds, particleParams.radius), body);
+            }
             boundaryMeshes.emplace_back(Mesh::createBox(sceneBox.bounds));
+            if (meshCollisions) {
+                addCollider(body, ParticleGenerator::generateSDF(boundaryMeshes.back()));
+            }
             break;
         }
+        }
     }
 
     for (const auto &sceneSphere : scene.spheres) {
@@ -591,20 +2215,111 @@ void SPH::buildScene(const Scene &scene) {
         }
     }
 
-    for (const auto &sceneMesh : scene.meshes) {
-        Mesh mesh = ObjLoader::load(sceneMesh.filename);
-        switch (sceneMesh.type) {
+    for (size_t i = 0; i < scene.meshes.size(); ++i) {
+        const Mesh &mesh = meshes[i];
+        switch (scene.meshes[i].type) {
         case Scene::Fluid:
             generateFluidParticles(ParticleGenerator::generateFromVolumeMesh(mesh, particleParams.radius));
             break;
-        case Scene::Boundary:
-            generateBoundaryParticles(ParticleGenerator::generateFromBoundaryMesh(mesh, particleParams.radius));
+        case Scene::Boundary: {
+            // The particles of a mesh come with its distance field, reuse it for the collider.
+            int body = addBody(scene.meshes[i], mesh.bound());
+            ParticleGenerator::Boundary boundary;
+            if (!volumeMaps) {
+                boundary = ParticleGenerator::generateFromBoundaryMesh(mesh, particleParams.radius);
+                generateBoundaryParticles(boundary, body);
+            }
             boundaryMeshes.emplace_back(mesh);
+            if (meshCollisions && closed[i]) {
+                addCollider(body, volumeMaps ? ParticleGenerator::generateSDF(mesh) : std::move(boundary.sdf));
+            }
             break;
         }
+        }
     }
 
-    generateBoundaryParticles(ParticleGenerator::generateFromBoundaryBox(scene.world.bounds, particleParams.radius, true));
+    for (const auto &sceneCollider : scene.colliders) {
+        switch (sceneCollider.kind) {
+        case Scene::Collider::Box:
+            colliders.add(CollisionBox(sceneCollider.bounds, sceneCollider.rotation));
+            break;
+        case Scene::Collider::Plane:
+            colliders.add(CollisionPlane(sceneCollider.point, sceneCollider.normal));
+            break;
+        }
+    }
+
+    for (const auto &sceneSink : scene.sinks) {
+        switch (sceneSink.kind) {
+        case Scene::Sink::Box:
+            sinks.add(CollisionBox(sceneSink.bounds));
+            break;
+        case Scene::Sink::Plane:
+            sinks.add(CollisionPlane(sceneSink.point, sceneSink.normal));
+            break;
+        }
+    }
+
+    // The world box is sampled with boundary particles unless the scene relies on
+    // the domain collider alone ("boundaryShell" : false). On periodic axes the shell
+    // is cut to the tile, the walls across the axis wrap around instead. Volume maps
+    // sample the shell and the boundary meshes themselves.
+    worldBounds = scene.world.bounds;
+    for (int k = 0; k < 3; ++k) {
+        // The minimum image is only unique for neighbours closer than half the period.
+        if (periodicAxes[k] && worldBounds.extents()[k] < 2.f * (kernelParams.radius + neighborSkin)) {
+            std::cout << "The world box is too small to be periodic along axis " << char('x' + k) << ", disabled" << std::endl;
+            periodicAxes[k] = false;
+        }
+    }
+    periodicDomain = PeriodicDomain(worldBounds, periodicAxes[0], periodicAxes[1], periodicAxes[2]);
+    for (int k = 0; k < 3; ++k) {
+        if (periodicAxes[k]) {
+            maximumNeighborSkin = std::min(maximumNeighborSkin, 0.5f * worldBounds.extents()[k] - kernelParams.radius);
+        }
+    }
+    if (boundaryShell && !volumeMaps) {
+        ParticleGenerator::Boundary shell = ParticleGenerator::generateFromBoundaryBox(scene.world.bounds, particleParams.radius, true);
+        if (periodicDomain.enabled) {
+            ParticleGenerator::Boundary tile;
+            for (size_t i = 0; i < shell.positions.size(); ++i) {
+                if (periodicDomain.wrap(shell.positions[i]) == shell.positions[i]) {
+                    tile.positions.emplace_back(shell.positions[i]);
+                    tile.normals.emplace_back(shell.normals[i]);
+                }
+            }
+            std::swap(shell, tile);
+        }
+        generateBoundaryParticles(shell);
+    }
+    if (periodicDomain.enabled) {
+        for (auto &p : currentFluidPosition) {
+            p = periodicDomain.wrap(p);
+        }
+    }
+
+    // The bodies start in their pose of the first step.
+    if (!boundaryBodies.empty()) {
+        boundaryRestPositions = boundaryPositions;
+        boundaryRestNormals = boundaryNormals;
+        boundaryVelocities.resize(boundaryPositions.size());
+        collectMovingBoundary(0, boundaryPositions.size());
+        poseBoundaries();
+    }
+}
+
+// @Func : Build the emitters of the scene. With the adaptive resolution the emitted particles
+//         start at the finest resolution, a jet is all surface and would be split right away.
+void SPH::buildEmitters(const Scene &scene) {
+
+    const float mass = adaptiveResolution ? adaptiveMinMass : 1.f;
+    emittedMassRatio = mass;
+    for (const auto &sceneEmitter : scene.emitters) {
+        float radius = sceneEmitter.kind == Scene::Emitter::Nozzle ? sceneEmitter.radius : 0.f;
+        emitters.emplace_back(Emitter(sceneEmitter.position, sceneEmitter.direction, sceneEmitter.up, sceneEmitter.speed,
+                                      radius, sceneEmitter.width, sceneEmitter.height, sceneEmitter.start, sceneEmitter.end,
+                                      particleParams.diameter * std::cbrt(mass)));
+    }
 }
 
 void SPH::generateFluidParticles(const ParticleGenerator::Volume &volume) {
@@ -612,10 +2327,11 @@ void SPH::generateFluidParticles(const ParticleGenerator::Volume &volume) {
     currentFluidPosition.insert(currentFluidPosition.end(), volume.positions.begin(), volume.positions.end());
 }
 
-void SPH::generateBoundaryParticles(const ParticleGenerator::Boundary &boundary) {
+void SPH::generateBoundaryParticles(const ParticleGenerator::Boundary &boundary, int body) {
 
     boundaryPositions.insert(boundaryPositions.end(), boundary.positions.begin(), boundary.positions.end());
     boundaryNormals.insert(boundaryNormals.end(), boundary.normals.begin(), boundary.normals.end());
+    boundaryBodyIndices.insert(boundaryBodyIndices.end(), boundary.positions.size(), body);
 }
 
 } // namespace cs224
@@ -1,6 +1,18 @@
 #pragma once
 
 #include "Kernel.h"
+#include "KernelSIMD.h"
+#include "KernelTable.h"
+#include "ParticleStore.h"
+#include "NeighborList.h"
+#include "ActiveSet.h"
+#include "Resolution.h"
+#include "StepStats.h"
+#include "Collision.h"
+#include "Emitter.h"
+#include "BoundaryBody.h"
+#include "VolumeMap.h"
+#include "solver/PressureSolver.h"
 
 #include "visualization/scene/Scene.h"
 #include "visualization/grid/Grid.h"
@@ -16,12 +28,21 @@
 
 #include <vector>
 #include <numeric>
+#include <fstream>
 
-#define KERNEL_SCALE 4.f
+#define KERNEL_SCALE 4.f // default kernel support radius in particle radii ("kernelSupport")
 #define RELAX_ITERATION 10000
 #define MIN_ITERATION 3
 #define EPSILON 1e-7f
 #define PCI_INFINITY std::numeric_limits<float>::infinity()
+#define MIN_SCALE_NEIGHBOURHOOD 0.1f // lower bound of a per-particle density variance scale term, relative to the prototype
+#define ADAPTIVE_SURFACE 0.5f // default colour field gradient (in units of the kernel radius, including the solid) above which a particle counts as free surface ("adaptiveSurface")
+#define ADAPTIVE_SPLIT_OFFSET 1.f // distance of the halves of a split particle from its centre, in radii of the halves
+#define ADAPTIVE_SPLIT_RELAXATION 4 // iterations spreading the halves of split particles to the rest spacing of their neighbours
+#define VOLUME_MAP_OFFSET 0.5f // distance the solid of the volume maps reaches beyond the boundary surfaces, in particle radii
+#define MESH_COLLISION_MARGIN 0.5f // distance the mesh colliders keep the fluid particles from the boundary surfaces, in particle radii
+#define KERNEL_LATTICE_DENSITY 0.918f // density of a particle inside the sampling lattice relative to the rest density (the tuned mass of the Muller kernel at 4 radii)
+#define NEIGHBOR_SKIN_SLACK 1.25f // the skin of neighbour lists rebuilt for multi-rate extrapolations exceeds twice their displacement by this factor
 
 namespace cs224 {
 
@@ -37,10 +58,14 @@ public:
        float squaredMass;
        float inverseMass;
 
-       void init(float r, float restDensity) {
+       void init(float r) {
            radius = r;
            diameter = 2.f * r;
-           mass = restDensity * pow3(diameter) / 1.1f;
+       }
+
+       // The mass depends on the kernel, see SPH::initKernelCorrections.
+       void setMass(float m) {
+           mass = m;
            squaredMass = pow2(mass);
            inverseMass = 1.f / mass;
        }
@@ -59,7 +84,7 @@ public:
             scale = s;
             radius = scale * r;
             squaredRadius = pow2(radius);
-            capacity = int(std::ceil(4.f / 3.f * PI * pow3(radius)) / pow3(d));
+            capacity = int(std::ceil(4.f / 3.f * PI * pow3(radius) / pow3(d)));
          }
      };
      KernelParameters kernelParams;
@@ -92,16 +117,18 @@ public:
      // Struct is not efficient here.
      // Values:
      float densityVarianceScale;
+     float densityVarianceScaleTimeStep;   // time step the cached densityVarianceScale was computed for
+     float prototypeGradientTerm;          // -(|Sum(gradW)|^2 + Sum(|gradW|^2)) of the prototype neighbourhood
      float maximumDensityVariance;
      float averageDensityVariance;
      float maximumDensityVarianceTh;
      float averageDensityVarianceTh;
-     float previousMaxDensityVariance;
+     float previousMaxDensityVariance = 0.f;
      float maximumVelocity;
      float maximumForce;
      float timeStep;
      float currentTime = 0.f;
-     float timeBeforeShock;
+     float timeBeforeShock = 0.f;
 
     SPH(const Scene &scene);
     void simulate(int maxIterations = 100);
@@ -117,38 +144,213 @@ public:
     const PCI3Mf 	 &getBoundaryNormals()   const { return boundaryNormals; }
     const PCIMeshM   &getBoundaryMeshes()    const { return boundaryMeshes; }
 
+    // Model matrix of boundary mesh i, the current pose of a moving mesh.
+    Eigen::Matrix4f getBoundaryMeshTransform(size_t i) const;
+
+    // Structure-of-arrays copy of the fluid state, only filled when
+    // the scene selects "particleLayout" : "soa".
+    bool usesSoALayout() const { return soaLayout; }
+    const FluidStore &getFluidStore() const { return fluidStore; }
+
+    // Instruction set of the vectorized neighbour sums, scalar unless the scene
+    // uses the SoA layout with neighbour lists.
+    KernelSIMD::Level getSIMDLevel() const { return simdLevel; }
+
+    // Pressure solver of the "method" setting.
+    const char *getMethod() const { return solver->name(); }
+
+    // Statistics of the last simulation step. The timings are only filled when the scene
+    // enables "profile", the solver iteration counts are always set.
+    bool isProfiling() const { return profile; }
+    const StepStats &getStepStats() const { return stepStats; }
+
 private:
+    // pcisph_bench times the individual phases below.
+    friend class SPHBenchmark;
+
+    // The pressure solvers share the particle state, grids and kernel.
+    friend class PressureSolver;
+    friend class PCISPHSolver;
+    template<typename KernelType> friend class DFSPHSolver;
 
     void basicSimSetup();
+    template<typename KernelType> void buildKernel(KernelType &W);
+    template<typename KernelType> void initKernelCorrections(const KernelType &W);
 
     // Shared update methods
     void testBoundary();
     void buildBoundaryGrids();
     void massifyBoundary();
-    void initDensities();
-    void initNormals();
+    template<typename KernelType> void massifyBoundary(const KernelType &W);
+    void poseBoundaries();
+    void moveBoundaries();
+    void collectMovingBoundary(size_t begin, size_t end);
+    void buildVolumeMap();
+    // The per-step fluid phases take the set of particles to update, null for all fluid particles.
+    void initDensities(const ActiveSet *set = nullptr);
+    template<typename KernelType, typename Resolution> void initDensities(const KernelType &W, const Resolution &R, const ActiveSet *set);
+    template<typename KernelType, typename Resolution> void initBoundaryDensities(const KernelType &W, const Resolution &R);
+    void initNormals(const ActiveSet *set = nullptr);
+    template<typename KernelType, typename Resolution> void initNormals(const KernelType &W, const Resolution &R, const ActiveSet *set);
     void initBoundary();
     void loadParams(const Settings &settings);
     void relax();
     void allocMemory(int fluidSize, int boundarySize);
+    void resizeFluid(size_t fluidSize);
 
     void buildFluidGrids();
+    void buildNeighborLists();
+    void rebuildNeighborLists(const PCI3Mf &positions, const PCI3Mf &sorted, bool keepSorted);
+    void validateNeighborLists(const ActiveSet *set);
+    float largestDisplacement(const PCI3Mf &positions, const PCI3Mf &reference);
+    float largestExtrapolation(const ActiveSet *set);
+    void initDensityVarianceScale();
+    template<typename KernelType> void initDensityVarianceScale(const KernelType &W);
     void updateDensityVarianceScale();
-    void initForces();
-    void predictVelocityAndPosition();
-    void updatePressures();
-    void updatePressureForces();
+    void updateParticleDensityVarianceScales(const ActiveSet *set = nullptr);
+    template<typename KernelType, typename Resolution> void updateParticleDensityVarianceScales(const KernelType &W, const Resolution &R, const ActiveSet *set);
+    void initForces(const ActiveSet *set = nullptr);
+    template<typename KernelType, typename Resolution> void initForces(const KernelType &W, const Resolution &R, const ActiveSet *set);
+    void predictVelocityAndPosition(const ActiveSet *set = nullptr);
+    void updatePressures(const ActiveSet *set = nullptr);
+    template<typename KernelType, typename Resolution> void updatePressures(const KernelType &W, const Resolution &R, const ActiveSet *set);
+    void updatePressureForces(const ActiveSet *set = nullptr);
+    template<typename KernelType, typename Resolution> void updatePressureForces(const KernelType &W, const Resolution &R, const ActiveSet *set);
+    void updatePressureForcesSIMD(const ActiveSet *set);
     void setVelocityAndPosition();
+    void selectStepSet();
+    void updateMultiRateLevels();
+    template<typename KernelType> void updateMultiRateLevels(const KernelType &W);
+    void buildSleepCells();
+    void updateSleeping();
+    void adaptResolution();
+    template<typename KernelType, typename Resolution> void markSurface(const KernelType &W, const Resolution &R, int levels);
+    void updatePool();
+    void buildEmitters(const Scene &scene);
+
+    // Parallel pass over the fluid particles, calling func(i, n, d) for every constraint
+    // plane of every collider (see Collision.h).
+    template<typename Func>
+    void handleCollisions(Func func) {
+        ConcurrentUtils::ccLoop(currentFluidPosition.size(), [&] (size_t i) {
+            colliders.collide(currentFluidPosition[i], [&] (const Vector3f &n, float d) {
+                func(i, n, d);
+            });
+        });
+    }
+    // Parallel loop over the fluid particles of set, or all fluid particles if set is null.
+    template<typename Func>
+    inline void forEachFluid(const ActiveSet *set, Func func) {
+        if (set) {
+            set->forEach(func);
+        } else {
+            ConcurrentUtils::ccLoop(currentFluidPosition.size(), func);
+        }
+    }
+
+    // Position of fluid particle i after 2^level time steps with its current velocity and
+    // acceleration: x + v * n * dt + a * dt^2 * n * (n + 1) / 2 for n = 2^level, the
+    // position the per-step integration reaches with a constant acceleration.
+    inline Vector3f extrapolatedPosition(size_t i, int level) const {
+        float n = float(1 << level);
+        Vector3f a = particleParams.inverseMass * (fluidForces[i] + fluidPressureForces[i]);
+        return currentFluidPosition[i] + (n * timeStep) * currentFluidVelocity[i] + (0.5f * n * (n + 1.f) * pow2(timeStep)) * a;
+    }
+
+    // Whether only the particles of stepSet are updated in a step.
+    inline bool partialSteps() const { return multiRateLevels > 0 || sleeping; }
+
+    inline bool isSleeping(size_t i) const { return sleeping && fluidSleepSteps[i] >= sleepSteps; }
+
+    // Apply the slot changes of updatePool to a per-particle array, scratch is a buffer of the
+    // same type. value(k) is the value of the k-th emitted particle.
+    template<typename Array, typename ValueFunc>
+    void repool(Array &values, Array &scratch, ValueFunc value) {
+        if (poolPermutation.empty()) {
+            values.resize(poolSize);
+        } else {
+            Grid::permute(values, poolPermutation, scratch);
+        }
+        ConcurrentUtils::ccLoop(poolSlots.size(), [&] (size_t k) {
+            values[poolSlots[k]] = value(k);
+        });
+    }
+
+    // Pressure force of the volume maps on fluid particle i of the given mass, at its current
+    // position. The boundary mirrors the pressure of the particle at the rest density.
+    inline Vector3f boundaryPressureForce(size_t i, float mass) const {
+        const float pressure = fluidPressures[i];
+        const float term = pressure / pow2(fluidDensities[i]) + pressure / pow2(simConstParams.restDensity);
+        return -(mass * simConstParams.restDensity * term) * volumeMap.gradient(currentFluidPosition[i]);
+    }
+
+    // Inverse mass of fluid particle i.
+    inline float inverseMass(size_t i) const {
+        return adaptiveResolution ? particleParams.inverseMass / fluidMassRatios[i] : particleParams.inverseMass;
+    }
+
+    // Kernel radius of the finest fluid particles, the time step criteria have to resolve it.
+    inline float finestKernelRadius() const { return kernelParams.radius * finestScale; }
+
+    // Extrapolated positions of all fluid particles for the same number of time steps,
+    // used as the neighbour positions of the multi-rate density prediction.
+    struct ExtrapolatedPositions {
+        const SPH &sph;
+        int level;
+        ExtrapolatedPositions(const SPH &sph, int level) : sph(sph), level(level) {}
+        inline Vector3f operator[](size_t j) const { return sph.extrapolatedPosition(j, level); }
+    };
 
-    void handleCollisions(std::function<void(size_t i, const Vector3f &n, float d)> handler);
     void adjustParticles();
     void adjustTimeStep();
     bool isShock();
-    void handleShock();
+    bool handleShock();
 
     void buildScene(const Scene &scene);
     void generateFluidParticles(const ParticleGenerator::Volume &volume);
-    void generateBoundaryParticles(const ParticleGenerator::Boundary &boundary);
+    void generateBoundaryParticles(const ParticleGenerator::Boundary &boundary, int body = -1);
+
+    // Iterate over the fluid neighbours of fluid particle i (current positions), calling func(j, r, r2).
+    // Uses the per-step neighbour lists when enabled, the fluid grid otherwise.
+    // Neighbour positions are read from the SoA store when it is enabled.
+    template<typename Func>
+    inline void queryFluid(size_t i, Func func) {
+        if (soaLayout) {
+            queryFluid(i, fluidStore.positions, currentFluidPosition[i], func);
+        } else {
+            queryFluid(i, currentFluidPosition, currentFluidPosition[i], func);
+        }
+    }
+
+    // Iterate over the fluid neighbours of fluid particle i using the predicted positions.
+    template<typename Func>
+    inline void queryPredictedFluid(size_t i, Func func) {
+        if (soaLayout) {
+            queryFluid(i, fluidStore.predictedPositions, newFluidPosition[i], func);
+        } else {
+            queryFluid(i, newFluidPosition, newFluidPosition[i], func);
+        }
+    }
+
+    template<typename Positions, typename Func>
+    inline void queryFluid(size_t i, const Positions &positions, const Vector3f &p, Func func) {
+        if (useNeighborLists) {
+            fluidNeighbors.query(i, kernelParams.radius, positions, p, func);
+        } else {
+            fluidGrid.queryPair(kernelParams.radius, positions, currentFluidPosition[i], p, func);
+        }
+    }
+
+    // Iterate over the boundary neighbours of fluid particle i around p, which is either
+    // the current or the predicted position of the particle.
+    template<typename Func>
+    inline void queryBoundary(size_t i, const Vector3f &p, Func func) {
+        if (useNeighborLists) {
+            boundaryNeighbors.query(i, kernelParams.radius, boundaryPositions, p, func);
+        } else {
+            boundaryGrid.query(kernelParams.radius, boundaryPositions, p, func);
+        }
+    }
 
      // N * M (row * column) vector array:
      // Fluid particles:
@@ -169,17 +371,229 @@ private:
 
      // Boundary particles:
      PCI1Mi boundaryAlive;
+     std::vector<size_t> boundaryAliveOffsets;
+     std::vector<uint32_t> boundaryAliveIndices;  // boundary particles with fluid neighbours, see testBoundary
      PCI1Mf boundaryMass;
+     float boundaryMassCorrection;                // divides the pseudo mass of the boundary particles, see initKernelCorrections
      PCI1Mf boundaryDensities;
+     PCI1Mf boundaryStaticTerms;                  // boundary-boundary density sum of the own body, without densityC
      PCI3Mf boundaryPositions;
      PCI3Mf boundaryNormals;
+     PCI3Mf boundaryVelocities;                   // zero for the static boundary
+     PCI1Mi boundaryBodyIndices;                  // body of every boundary particle, -1 for the static boundary
      PCIMeshM boundaryMeshes;
 
+     // Moving boundaries, the boundary boxes and meshes with keyframes (see BoundaryBody.h).
+     // Only the particles of the bodies are moved, from their rest positions, and re-binned
+     // in the boundary grid. A body interacts with the fluid only, its particles take
+     // their masses and static densities from the own body, which do not change with rigid
+     // motion. Not supported with volume maps, periodic axes, multi-rate time stepping and
+     // sleeping particles.
+     std::vector<BoundaryBody> boundaryBodies;
+     std::vector<uint32_t> movingBoundaryIndices;  // sorted indices of the particles of the bodies
+     PCI3Mf boundaryRestPositions;                 // only filled with moving boundaries
+     PCI3Mf boundaryRestNormals;
+     PCI1Mi boundaryMeshBodies;                    // body of every boundary mesh, -1 for the static ones
+     PCI3Mf boundaryScratch;
+     PCI1Mf boundaryFloatScratch;
+     PCI1Mi boundaryIndexScratch;
+
+     // Boundary model ("boundaryModel"), boundary particles ("particles") or volume maps
+     // ("volumeMap", see VolumeMap.h). Volume maps need no boundary particles, the fluid
+     // particles look up their boundary density and pressure gradient in the map. They are
+     // not supported with adaptive resolution and periodic axes.
+     bool volumeMaps;
+     int volumeMapResolution;      // voxels per kernel radius ("volumeMapResolution")
+     VolumeMap volumeMap;
+
+     // Collision primitives, the domain box plus the colliders of the scene. With
+     // "meshCollisions" the closed boundary boxes and meshes are colliders too, given by their
+     // signed distance fields, so fluid that outruns the boundary pressure is projected out.
+     CollisionSet colliders;
+     float restitution;
+     float friction;               // Coulomb friction coefficient of the collision response
+     bool meshCollisions;
+     bool boundaryShell;
+     Box3f worldBounds;
+
+     // Periodic axes of the world box ("periodic", e.g. "xz"). The world box is one tile of
+     // the domain: the boundary shell has no walls across the periodic axes, the fluid
+     // positions wrap around the tile and neighbours are found across the tile faces.
+     bool periodicAxes[3];
+     PeriodicDomain periodicDomain;
+
+     // Emitters and sinks of the scene. The fluid arrays are a pool: particles emitted at the
+     // start of a step take the slots of the particles removed by the sinks, the others are
+     // appended and free slots that are left are compacted in order. The vectors keep their
+     // capacity, so a steady flow does not allocate. "maxParticles" (0 : no limit) caps the
+     // emission.
+     std::vector<Emitter> emitters;
+     std::vector<float> emitterDistancesBeforeShock;
+     SinkSet sinks;
+     int maxParticles;
+     float emittedMassRatio = 1.f;           // mass of the emitted particles relative to particleParams.mass
+     PCI3Mf emittedPositions;
+     PCI3Mf emittedVelocities;
+     PCI1Mi fluidRemoved;
+     std::vector<size_t> poolOffsets;          // removed particles before every particle
+     std::vector<size_t> poolKeptOffsets;      // new index of every kept particle
+     std::vector<uint32_t> poolPermutation;    // previous index of every new index, empty if none moves
+     std::vector<size_t> poolSlots;            // new index of every emitted particle
+     size_t poolSize = 0;                      // fluid particles after the update
+
+     std::unique_ptr<PressureSolver> solver;
+
+     // Per-particle density variance scales ("densityVarianceScale" : "particle").
+     bool particleDensityVarianceScale;
+     PCI1Mf fluidDensityVarianceScales;
+
+     // Prediction-correction loop settings. The pressures of a step can start from the
+     // linearly extrapolated ("warmStartExtrapolation") pressures of the previous steps,
+     // scaled by warmStartDecay ("warmStart"). Every pressure update is scaled by
+     // pressureRelaxation and can be accelerated with Anderson mixing ("andersonAcceleration").
+     // The loop runs at least minIterations times.
+     int minIterations;
+     float pressureRelaxation;
+     bool andersonAcceleration;
+     bool pressureHistory;           // the residuals and iterates below belong to this step
+     PCI1Mf fluidPressureResiduals;  // pressure update of the previous iteration (f_prev)
+     PCI1Mf fluidPressureIterates;   // unmixed pressure of the previous iteration (G_prev)
+     bool warmStart;
+     float warmStartDecay;
+     float warmStartExtrapolation;
+     PCI1Mf fluidPreviousPressures;  // pressures of the step before the last one
+
+     // Multi-rate time stepping ("multiRateLevels" > 0, PCISPH only). Every step advances
+     // all particles by the time step, but the densities, forces and pressures of a particle
+     // on level L are only recomputed every 2^L steps, in between it keeps its last
+     // acceleration. The pressure of an updated particle corrects the density it reaches
+     // at the end of its interval, predicted with the extrapolated positions of its
+     // neighbours. The level is the longest interval in which the particle moves by at
+     // most multiRateTolerance diameters relative to its neighbours, and at most one above
+     // the level of any neighbour. A particle whose neighbour drops further below is woken
+     // up for the next step.
+     int multiRateLevels;
+     float multiRateTolerance;
+     unsigned int stepCount = 0;  // steps simulated so far
+     PCI1Mi fluidLevels;
+     PCI1Mi fluidLevelScratch;
+     ActiveSet wakeSet;
+
+     // Sleeping fluid grid cells ("sleep", PCISPH only). A cell whose mean velocity stays
+     // below sleepVelocity and whose mean compression stays below sleepDensityError for
+     // sleepSteps steps falls asleep, unless a neighbouring cell is moving faster than
+     // wakeVelocity, which also wakes a sleeping cell. The particles of sleeping cells are
+     // at rest and get no updates, but still contribute their density and pressure to
+     // their awake neighbours. The densities of sleeping particles next to awake ones are
+     // updated every step, a sleeping cell whose mean compression exceeds wakeDensityError
+     // wakes up.
+     bool sleeping;
+     float sleepVelocity;
+     float sleepDensityError;
+     int sleepSteps;
+     float wakeVelocity;
+     float wakeDensityError;
+     PCI1Mi fluidSleepSteps;                // quiet steps of the cell of every fluid particle
+     std::vector<size_t> sleepCellOffsets;  // cell index of the cell starts among the sorted particles
+     std::vector<uint32_t> sleepCellBegin;  // first particle of every occupied cell
+     PCI1Mf sleepCellActivity;              // speed of the mean velocity of every occupied cell
+     PCI1Mi sleepCellAwake;                 // whether an occupied cell holds awake particles
+     ActiveSet sleepDensityParticles;       // the step set and the sleeping particles next to awake ones
+
+     // Adaptive particle resolution ("adaptiveResolution", PCISPH only). Every adaptiveInterval
+     // steps, particles at the free surface (colour field gradient including the solid above
+     // adaptiveSurface) or closer than adaptiveCameraDistance to the camera split into two
+     // halves, down to adaptiveMinMass times the base mass. The target mass doubles with every
+     // neighbour ring away from them, pairs of particles lighter than their target merge, up to
+     // the base mass. Mass, momentum and centre of mass are conserved, see Resolution.h for the
+     // mixed smoothing lengths.
+     bool adaptiveResolution;
+     float adaptiveMinMass;
+     float adaptiveSurface;
+     float adaptiveCameraDistance;
+     int adaptiveInterval;
+     Vector3f adaptiveCamera;
+     float finestScale = 1.f;
+     PCI1Mf fluidMassRatios;             // mass relative to particleParams.mass
+     PCI1Mf fluidScales;                 // smoothing length relative to the kernel radius, cbrt of the mass ratio
+     PCI1Mf fluidMassRatiosBeforeShock;
+     PCI1Mi fluidRefinement;             // neighbour rings to the closest refined particle, the merge partner
+     PCI1Mi fluidRefinementScratch;
+     PCI3Mf fluidSplitHalves;            // positions of the two halves of every split particle
+     PCI3Mf fluidSplitHalvesScratch;
+     std::vector<size_t> fluidRefinementOffsets;
+
+     ActiveSet stepParticles;
+     const ActiveSet *stepSet = nullptr;  // particles updated in the current step, null for all
+     PCI1Mf fluidScratch;                 // scratch space of the per-particle permutations
+
+     // Active-set prediction-correction loop ("activeSet", needs the neighbour lists).
+     // After the first iteration, only particles with a density variation above
+     // activeSetTolerance get pressure updates (pressureSet), and only those and
+     // their neighbours get new pressure forces and predictions (updateSet). The
+     // densities are evaluated for the neighbours of updateSet (densitySet).
+     bool activeSetLoop;
+     float activeSetTolerance;
+     ActiveSet pressureSet;
+     ActiveSet updateSet;
+     ActiveSet densitySet;
+     PCI1Mf fluidDensityVariations;  // latest density variation of every fluid particle
+
+     // Relax the initial particle distribution in the constructor.
+     bool relaxOnSetup;
+
+     // Per-step instrumentation, optionally dumped as JSON lines.
+     bool profile;
+     StepStats stepStats;
+     std::string profileOutputPath;
+     std::unique_ptr<std::ofstream> profileOutput;
+
+     // Optional structure-of-arrays mirror of the fluid positions.
+     bool soaLayout;
+     FluidStore fluidStore;
+
+
+     // Per-step fluid->fluid and fluid->boundary neighbour lists, reused by all
+     // sweeps of a step. The lists are built with an extra skin distance so they
+     // still cover the predicted positions of the correction loop, and are rebuilt
+     // once a particle moves by more than half the skin from the positions the
+     // lists were last built for.
+     bool useNeighborLists;
+     float neighborSkin;
+     float maximumNeighborSkin;     // largest skin the periodic axes allow
+     float neighborListSkin;        // skin of the current lists, wider for multi-rate extrapolations
+     float neighborListReach;       // largest distance of neighborListPositions from the sorted positions
+     PCI3Mf neighborListPositions;  // fluid positions the current lists were last built for
+     NeighborList fluidNeighbors;
+     NeighborList boundaryNeighbors;
+
+     // Vectorized density and pressure force sums, only used with the SoA layout,
+     // neighbour lists and the Muller kernel family. The sums gather the per-neighbour terms from flat arrays.
+     KernelSIMD::Level simdLevel;
+     SoA3f boundaryStore;
+     PCI1Mf fluidPressureTerms;              // p / rho^2 of the fluid particles
+     PCI1Mf boundaryInverseSquaredDensities; // 1 / rho^2 of the boundary particles
+
+     // Memory layout and storage of the grid cells, shared by the fluid and boundary grid.
+     Grid::Ordering gridOrdering;
+     Grid::Storage gridStorage;
 
      // --------- Dependencies ---------
      Grid fluidGrid;
      Grid boundaryGrid;
-     Kernel W;
+
+     // Kernel family of the scene ("kernel" setting), only the selected one is built.
+     Kernel::Family kernelFamily;
+     MullerKernel mullerKernel;
+     CubicSplineKernel cubicSplineKernel;
+     WendlandC2Kernel wendlandC2Kernel;
+     WendlandC4Kernel wendlandC4Kernel;
+
+     // Optional tabulated backend of the kernel family ("kernelBackend" : "table").
+     bool tabulatedKernel;
+     int kernelTableResolution;
+     TabulatedKernel kernelTable;
+
      Box3f boundaryBox;  // Bounding box for the whole scene
 };
 }
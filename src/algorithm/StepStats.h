@@ -0,0 +1,137 @@
+// Per-step statistics of SPH::simulate.
+//
+// Filled only when the "profile" setting is enabled (or "profileOutput" names a
+// JSON-lines file to dump every step to). When disabled, the only cost left in
+// simulate is one untaken branch per phase.
+
+#pragma once
+
+#include "utils/Def.h"
+
+#include <json11.h>
+
+#include <chrono>
+#include <vector>
+
+namespace cs224 {
+
+struct StepStats {
+    // Wall times in seconds.
+    double pool;           // emitters and sinks
+    double boundaryMotion; // moving boundaries and their re-binning
+    double gridBuild;      // sorting the fluid particles into the grid
+    double neighborLists;
+    double boundaryTest;
+    double densities;
+    double normals;
+    double forces;
+    double divergence;     // divergence solve (DFSPH)
+    std::vector<double> iterations; // each prediction-correction (DFSPH: density solve) iteration
+    std::vector<int> activeParticles; // active set size after each prediction-correction iteration ("activeSet")
+    double integration;
+    double collisions;
+    double timeStepAdjust;
+    double shockHandling;
+    double sleep;          // sleeping particle update
+    double levels;         // multi-rate level update
+    double adapt;          // split and merge of the adaptive resolution
+    double total;
+
+    int pcIterations;
+    int divergenceIterations;
+    int updatedParticles;  // fluid particles whose forces were computed in the step
+    float activeFraction;  // fraction of the fluid particles that are awake ("sleep")
+    int particles;         // fluid particles at the end of the step
+    int splits;            // particles split at the end of the step ("adaptiveResolution")
+    int merges;            // pairs of particles merged at the end of the step
+    int emitted;           // particles emitted at the start of the step
+    int removed;           // particles removed by sinks at the start of the step
+    int aliveBoundary;     // boundary particles with fluid neighbours
+    int neighborRebuilds;  // neighbour list rebuilds within the step, after particles moved by more than half the skin
+    bool shock;            // the step was rolled back by handleShock
+    float time;            // simulated time at the start of the step
+    float timeStep;
+
+    void reset() {
+        pool = boundaryMotion = gridBuild = neighborLists = boundaryTest = densities = normals = forces = divergence = 0.0;
+        integration = collisions = timeStepAdjust = shockHandling = sleep = levels = adapt = total = 0.0;
+        iterations.clear();
+        activeParticles.clear();
+        pcIterations = divergenceIterations = updatedParticles = particles = splits = merges = emitted = removed = aliveBoundary = neighborRebuilds = 0;
+        shock = false;
+        time = timeStep = 0.f;
+        activeFraction = 1.f;
+    }
+
+    json11::Json toJson() const {
+        return json11::Json::object {
+            { "time", time },
+            { "timeStep", timeStep },
+            { "pool", pool },
+            { "boundaryMotion", boundaryMotion },
+            { "gridBuild", gridBuild },
+            { "neighborLists", neighborLists },
+            { "boundaryTest", boundaryTest },
+            { "densities", densities },
+            { "normals", normals },
+            { "forces", forces },
+            { "divergence", divergence },
+            { "iterations", iterations },
+            { "activeParticles", activeParticles },
+            { "integration", integration },
+            { "collisions", collisions },
+            { "timeStepAdjust", timeStepAdjust },
+            { "shockHandling", shockHandling },
+            { "sleep", sleep },
+            { "levels", levels },
+            { "adapt", adapt },
+            { "total", total },
+            { "pcIterations", pcIterations },
+            { "divergenceIterations", divergenceIterations },
+            { "updatedParticles", updatedParticles },
+            { "activeFraction", activeFraction },
+            { "particles", particles },
+            { "splits", splits },
+            { "merges", merges },
+            { "emitted", emitted },
+            { "removed", removed },
+            { "aliveBoundary", aliveBoundary },
+            { "neighborRebuilds", neighborRebuilds },
+            { "shock", shock }
+        };
+    }
+};
+
+// Measures consecutive phases: every lap stores the time since the previous lap.
+// Does nothing when disabled.
+class PhaseTimer {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    explicit PhaseTimer(bool enabled) : m_enabled(enabled) {
+        if (m_enabled) {
+            m_start = m_last = Clock::now();
+        }
+    }
+
+    inline void lap(double &seconds) {
+        if (m_enabled) {
+            Clock::time_point now = Clock::now();
+            seconds = std::chrono::duration<double>(now - m_last).count();
+            m_last = now;
+        }
+    }
+
+    inline void total(double &seconds) const {
+        if (m_enabled) {
+            seconds = std::chrono::duration<double>(Clock::now() - m_start).count();
+        }
+    }
+
+private:
+    bool m_enabled;
+    Clock::time_point m_start;
+    Clock::time_point m_last;
+};
+
+} // namespace cs224
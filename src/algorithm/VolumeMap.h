@@ -0,0 +1,206 @@
+// Boundary volume maps (Bender et al. 2019, "Volume maps: an implicit
+// boundary representation for SPH"), used instead of the boundary particles
+// when the scene selects "boundaryModel" : "volumeMap".
+//
+// The solid is the union of the boundary meshes, plus the outside of the world
+// box if the scene has a boundary shell, given by the signed distance field phi
+// of SDF::build (negative inside). Every voxel x of a grid over the domain
+// stores the kernel weighted volume of the solid around it and its gradient:
+//   V(x)     = Int gamma(y) W(|x - y|) dy
+//   gradV(x) = Int gamma(y) gradW(x - y) dy    (pressure gradient of the kernel family)
+// where gamma = clamp(1/2 - (phi - offset) / dx, 0, 1) is the solid fraction of
+// the voxel at y, the solid reaches offset beyond the surface. The integrals
+// are sums over the voxels of the kernel support, normalized so V = 1 inside
+// the solid. The solid counts as fluid at rest, a fluid particle at x gets the
+// boundary density rho_0 * V(x) and the boundary pressure force from
+// rho_0 * gradV(x), each with one trilinear lookup instead of a pass over its
+// boundary neighbours.
+
+#pragma once
+
+#include "visualization/geometry/SDF.h"
+#include "visualization/geometry/VoxelGrid.h"
+#include "visualization/mesh/Mesh.h"
+
+#include "utils/Def.h"
+#include "utils/ConcurrentUtils.h"
+
+#include <array>
+#include <limits>
+#include <map>
+#include <utility>
+#include <vector>
+
+namespace cs224 {
+
+class VolumeMap {
+public:
+    // Build the maps of the solid of the meshes, and of the outside of shell if it is given,
+    // on a grid of voxels with the given size covering bounds. W is the kernel of the radius,
+    // the solid reaches offset beyond the surfaces.
+    template<typename KernelType>
+    void build(const KernelType &W, float radius, const std::vector<Mesh> &meshes, const Box3f *shell,
+               const Box3f &bounds, float cellSize, float offset = 0.f) {
+
+        Vector3i size(
+            int(std::ceil(bounds.extents().x() / cellSize)),
+            int(std::ceil(bounds.extents().y() / cellSize)),
+            int(std::ceil(bounds.extents().z() / cellSize))
+        );
+        m_volume.resize(size);
+        m_volume.setOrigin(bounds.min);
+        m_volume.setCellSize(cellSize);
+        m_gradient.resize(size);
+        m_gradient.setOrigin(bounds.min);
+        m_gradient.setCellSize(cellSize);
+        m_maxVoxel = size.cast<float>() - Vector3f(0.5f);
+
+        // Only the distances within the kernel support of the surface matter, the SDF of a
+        // mesh is built on the voxels around its bounds. SDF::build samples the corners of
+        // the voxels, trilinear their centres. The shell is the outside of a box.
+        const float support = radius + cellSize;
+        VoxelGridf distance(size, std::numeric_limits<float>::max());
+        for (const Mesh &mesh : meshes) {
+            Box3f meshBounds = mesh.bound().expanded(support);
+            Vector3i lo, hi;
+            for (int k = 0; k < 3; ++k) {
+                lo[k] = clamp(int(std::floor((meshBounds.min[k] - bounds.min[k]) / cellSize)), 0, size[k]);
+                hi[k] = clamp(int(std::ceil((meshBounds.max[k] - bounds.min[k]) / cellSize)), 0, size[k]);
+            }
+            if ((hi - lo).minCoeff() <= 0) {
+                continue;
+            }
+            VoxelGridf meshDistance(hi - lo);
+            meshDistance.setOrigin(bounds.min + cellSize * (lo.cast<float>() + Vector3f(0.5f)));
+            meshDistance.setCellSize(cellSize);
+            SDF::build(mesh, meshDistance, int(std::ceil(support / cellSize)));
+            forEachVoxel([&] (int x, int y, int z) {
+                Vector3i v(x, y, z);
+                if ((v.array() >= lo.array()).all() && (v.array() < hi.array()).all()) {
+                    distance(v) = std::min(distance(v), meshDistance(v - lo));
+                }
+            });
+        }
+        if (shell) {
+            forEachVoxel([&] (int x, int y, int z) {
+                Vector3f p = m_volume.toWorldSpace(Vector3f(x + 0.5f, y + 0.5f, z + 0.5f));
+                Vector3f q = (shell->min - p).cwiseMax(p - shell->max);
+                float boxDistance = q.cwiseMax(Vector3f(0.f)).norm() + std::min(q.maxCoeff(), 0.f);
+                distance(x, y, z) = std::min(distance(x, y, z), -boxDistance);
+            });
+        }
+
+        // Quadrature of the kernel support, one sample per voxel.
+        struct Sample {
+            Vector3i offset;
+            float weight;
+            Vector3f gradient;
+        };
+        std::vector<Sample> samples;
+        const int reach = int(std::ceil(radius / cellSize));
+        const float voxelVolume = pow3(cellSize);
+        float totalWeight = 0.f;
+        for (int z = -reach; z <= reach; ++z) {
+            for (int y = -reach; y <= reach; ++y) {
+                for (int x = -reach; x <= reach; ++x) {
+                    Vector3f offset = cellSize * Vector3f(float(x), float(y), float(z));
+                    float r2 = offset.squaredNorm();
+                    if (r2 >= pow2(radius)) {
+                        continue;
+                    }
+                    // r = x - y points from the sample to the voxel.
+                    Vector3f gradient = r2 > 0.f ? Vector3f(-(voxelVolume * W.pressureGradC * W.pressureGrad(r2)) * offset) : Vector3f(0.f);
+                    samples.push_back({ Vector3i(x, y, z), voxelVolume * W.densityC * W.density(r2), gradient });
+                    totalWeight += samples.back().weight;
+                }
+            }
+        }
+        for (auto &sample : samples) {
+            sample.weight /= totalWeight;
+            sample.gradient /= totalWeight;
+        }
+
+        // Voxels further than the support from the surface are empty or full.
+        forEachVoxel([&] (int x, int y, int z) {
+            float phi = distance(x, y, z) - offset;
+            float volume = phi <= -support ? 1.f : 0.f;
+            Vector3f gradient(0.f);
+            if (std::abs(phi) < support) {
+                for (const auto &sample : samples) {
+                    Vector3i v = (Vector3i(x, y, z) + sample.offset).cwiseMax(Vector3i(0)).cwiseMin(size - Vector3i(1));
+                    float gamma = clamp(0.5f - (distance(v) - offset) / cellSize, 0.f, 1.f);
+                    volume += gamma * sample.weight;
+                    gradient += gamma * sample.gradient;
+                }
+            }
+            m_volume(x, y, z) = volume;
+            m_gradient(x, y, z) = gradient;
+        });
+    }
+
+    // Whether every edge of the mesh is shared by an even number of triangles, only the
+    // SDF of a closed mesh has the right signs. Vertices are matched by position.
+    static bool isClosed(const Mesh &mesh) {
+        std::map<std::array<float, 3>, uint32_t> positions;
+        std::vector<uint32_t> vertices(mesh.vertices().cols());
+        for (size_t i = 0; i < vertices.size(); ++i) {
+            std::array<float, 3> p = {{ mesh.vertices()(0, i), mesh.vertices()(1, i), mesh.vertices()(2, i) }};
+            vertices[i] = positions.emplace(p, uint32_t(positions.size())).first->second;
+        }
+        std::map<std::pair<uint32_t, uint32_t>, int> edges;
+        for (int t = 0; t < mesh.triangles().cols(); ++t) {
+            for (int k = 0; k < 3; ++k) {
+                uint32_t a = vertices[mesh.triangles()(k, t)];
+                uint32_t b = vertices[mesh.triangles()((k + 1) % 3, t)];
+                if (a != b) {
+                    ++edges[std::make_pair(std::min(a, b), std::max(a, b))];
+                }
+            }
+        }
+        for (const auto &edge : edges) {
+            if (edge.second % 2 != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // V(p), the kernel weighted volume of the solid around p.
+    inline float volume(const Vector3f &p) const {
+        return m_volume.trilinear(voxel(p));
+    }
+
+    // gradV(p) with the pressure gradient of the kernel.
+    inline Vector3f gradient(const Vector3f &p) const {
+        return m_gradient.trilinear(voxel(p));
+    }
+
+    // gradV(p) with the density gradient of the kernel, differentiates the volume map.
+    inline Vector3f densityGradient(const Vector3f &p) const {
+        return m_volume.gradient(voxel(p), 0.5f) * (1.f / m_volume.cellSize());
+    }
+
+private:
+    // Voxel space position of p, clamped to the voxel centres of the grid.
+    inline Vector3f voxel(const Vector3f &p) const {
+        return m_volume.toVoxelSpace(p).cwiseMax(Vector3f(0.5f)).cwiseMin(m_maxVoxel);
+    }
+
+    template<typename Func>
+    void forEachVoxel(Func func) const {
+        const Vector3i &size = m_volume.size();
+        ConcurrentUtils::ccLoop(size_t(size.z()), [&] (size_t z) {
+            for (int y = 0; y < size.y(); ++y) {
+                for (int x = 0; x < size.x(); ++x) {
+                    func(x, y, int(z));
+                }
+            }
+        });
+    }
+
+    VoxelGridf m_volume;
+    VoxelGrid<Vector3f> m_gradient;
+    Vector3f m_maxVoxel;
+};
+
+} // namespace cs224
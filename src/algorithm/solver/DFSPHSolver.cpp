@@ -0,0 +1,251 @@
+#include "DFSPHSolver.h"
+
+#include "algorithm/SPH.h"
+
+#define DFSPH_MIN_ITERATION 2
+#define DFSPH_TIME_STEP_GROWTH 1.1f // growth per step of the time step limit left by a shock
+
+namespace cs224 {
+
+template<typename KernelType>
+DFSPHSolver<KernelType>::DFSPHSolver(const KernelType &kernel, const Settings &settings) : W(kernel) {
+
+    cfl = settings.getFloat("cfl", 0.4f);
+    maxTimeStep = settings.getFloat("maxTimeStep", 0.005f);
+    densityError = settings.getFloat("densityError", 0.001f);
+    divergenceError = settings.getFloat("divergenceError", 0.001f);
+    timeStepLimit = maxTimeStep;
+}
+
+// @Func : Choose the time step of this step from the CFL condition. After a shock the time step
+//         is also limited by the one handleShock chose, the limit grows back by
+//         DFSPH_TIME_STEP_GROWTH per step.
+template<typename KernelType>
+void DFSPHSolver<KernelType>::prepare(SPH &sph) {
+
+    Thread_float maxVelocity(0.f);
+    ConcurrentUtils::ccLoop(sph.currentFluidPosition.size(), [&] (size_t i) {
+        maxVelocity.local() = std::max(maxVelocity.local(), sph.currentFluidVelocity[i].squaredNorm());
+    });
+    sph.maximumVelocity = std::sqrt(std::accumulate(maxVelocity.begin(), maxVelocity.end(), 0.f, [] (float a, float b) { return std::max(a, b); }));
+    timeStepLimit = std::min(maxTimeStep, timeStepLimit * DFSPH_TIME_STEP_GROWTH);
+    sph.timeStep = std::min(timeStepLimit, cfl * sph.particleParams.diameter / std::max(sph.maximumVelocity, 1e-8f));
+}
+
+// @Func : Divergence solve, density solve and integration of the positions.
+//         The state before the step is kept in the "new" buffers for the shock handling,
+//         like SPH::setVelocityAndPosition leaves it, and the maximum force is measured
+//         from the velocity change over the step.
+template<typename KernelType>
+void DFSPHSolver<KernelType>::solve(SPH &sph, PhaseTimer &timer, int maxIterations) {
+
+    size_t size = sph.currentFluidPosition.size();
+    factors.resize(size);
+    kappas.resize(size);
+    sph.newFluidPosition = sph.currentFluidPosition;
+    sph.newFluidVelocity = sph.currentFluidVelocity;
+
+    computeFactors(sph);
+    int divergenceIterations = solveDivergence(sph, maxIterations);
+    timer.lap(sph.stepStats.divergence);
+    sph.stepStats.divergenceIterations = divergenceIterations;
+
+    sph.stepStats.pcIterations = solveDensity(sph, timer, maxIterations);
+
+    Thread_float maxVelocity(0.f);
+    Thread_float maxVelocityChange(0.f);
+    ConcurrentUtils::ccLoop(size, [&] (size_t i) {
+        sph.currentFluidPosition[i] += sph.timeStep * sph.currentFluidVelocity[i];
+        maxVelocity.local() = std::max(maxVelocity.local(), sph.currentFluidVelocity[i].squaredNorm());
+        maxVelocityChange.local() = std::max(maxVelocityChange.local(), (sph.currentFluidVelocity[i] - sph.newFluidVelocity[i]).squaredNorm());
+    });
+    sph.maximumVelocity = std::sqrt(std::accumulate(maxVelocity.begin(), maxVelocity.end(), 0.f, [] (float a, float b) { return std::max(a, b); }));
+    float maximumVelocityChange = std::sqrt(std::accumulate(maxVelocityChange.begin(), maxVelocityChange.end(), 0.f, [] (float a, float b) { return std::max(a, b); }));
+    sph.maximumForce = sph.particleParams.mass * maximumVelocityChange / sph.timeStep;
+    timer.lap(sph.stepStats.integration);
+}
+
+// @Func : The time step is chosen in prepare. A step whose density solve did not converge, or
+//         whose velocities outran the kernel, is rolled back like a PCISPH step (SPH::handleShock),
+//         and the time step chosen there limits the next steps.
+template<typename KernelType>
+bool DFSPHSolver<KernelType>::adjustTimeStep(SPH &sph, PhaseTimer &timer) {
+
+    sph.maximumVelocity = std::max(1e-8f, sph.maximumVelocity);
+    sph.maximumForce = std::max(1e-8f, sph.maximumForce);
+    timer.lap(sph.stepStats.timeStepAdjust);
+    bool shock = sph.handleShock();
+    if (shock) {
+        timeStepLimit = sph.timeStep;
+    }
+    timer.lap(sph.stepStats.shockHandling);
+    return shock;
+}
+
+// @Func : Compute alpha_i / rho_i of every fluid particle at the current positions.
+//         Boundary neighbours contribute to the gradient sum with their pseudo mass,
+//         volume maps with the density of the solid.
+template<typename KernelType>
+void DFSPHSolver<KernelType>::computeFactors(SPH &sph) {
+
+    ConcurrentUtils::ccLoop(sph.currentFluidPosition.size(), [&] (size_t i) {
+        Vector3f gradientSum;
+        float sumSquaredGradient = 0.f;
+        sph.queryFluid(i, [&] (size_t, const Vector3f &r, float r2) {
+            if (r2 < 1e-5f) {
+                return;
+            }
+            Vector3f g = sph.particleParams.mass * gradient(r, r2);
+            gradientSum += g;
+            sumSquaredGradient += g.squaredNorm();
+        });
+        if (sph.volumeMaps) {
+            gradientSum += sph.simConstParams.restDensity * sph.volumeMap.gradient(sph.currentFluidPosition[i]);
+        } else {
+            sph.queryBoundary(i, sph.currentFluidPosition[i], [&] (size_t j, const Vector3f &r, float r2) {
+                if (r2 < 1e-5f) {
+                    return;
+                }
+                gradientSum += sph.boundaryMass[j] * gradient(r, r2);
+            });
+        }
+
+        float denominator = gradientSum.squaredNorm() + sumSquaredGradient;
+        factors[i] = denominator > EPSILON ? 1.f / denominator : 0.f;
+    });
+}
+
+// @Func : D rho_i / Dt of the current velocities, relative to the velocities of the boundary
+//         particles (zero unless the boundary moves).
+template<typename KernelType>
+float DFSPHSolver<KernelType>::computeDensityChange(SPH &sph, size_t i) {
+
+    const Vector3f &v = sph.currentFluidVelocity[i];
+    float fluidTerm = 0.f;
+    float boundaryTerm = 0.f;
+    sph.queryFluid(i, [&] (size_t j, const Vector3f &r, float r2) {
+        if (r2 < 1e-5f) {
+            return;
+        }
+        fluidTerm += (v - sph.currentFluidVelocity[j]).dot(gradient(r, r2));
+    });
+    if (sph.volumeMaps) {
+        boundaryTerm = sph.simConstParams.restDensity * v.dot(sph.volumeMap.gradient(sph.currentFluidPosition[i]));
+    } else {
+        sph.queryBoundary(i, sph.currentFluidPosition[i], [&] (size_t j, const Vector3f &r, float r2) {
+            if (r2 < 1e-5f) {
+                return;
+            }
+            boundaryTerm += sph.boundaryMass[j] * (v - sph.boundaryVelocities[j]).dot(gradient(r, r2));
+        });
+    }
+    return sph.particleParams.mass * fluidTerm + boundaryTerm;
+}
+
+// @Func : Change the velocities by the pressure accelerations of the current kappas:
+//         dv_i = -dt * (Sum(m_j (kappa_i / rho_i + kappa_j / rho_j) gradW_ij) + Sum(m_b kappa_i / rho_i gradW_ib)).
+//         Only the kappas are read from the neighbours, so the velocities are updated in place.
+template<typename KernelType>
+void DFSPHSolver<KernelType>::applyPressure(SPH &sph) {
+
+    ConcurrentUtils::ccLoop(sph.currentFluidPosition.size(), [&] (size_t i) {
+        const float kappa = kappas[i];
+        Vector3f fluidSum;
+        Vector3f boundarySum;
+        sph.queryFluid(i, [&] (size_t j, const Vector3f &r, float r2) {
+            if (r2 < 1e-5f) {
+                return;
+            }
+            fluidSum += (kappa + kappas[j]) * gradient(r, r2);
+        });
+        if (sph.volumeMaps) {
+            boundarySum = (sph.simConstParams.restDensity * kappa) * sph.volumeMap.gradient(sph.currentFluidPosition[i]);
+        } else {
+            sph.queryBoundary(i, sph.currentFluidPosition[i], [&] (size_t j, const Vector3f &r, float r2) {
+                if (r2 < 1e-5f) {
+                    return;
+                }
+                boundarySum += (sph.boundaryMass[j] * kappa) * gradient(r, r2);
+            });
+        }
+        sph.currentFluidVelocity[i] -= sph.timeStep * (sph.particleParams.mass * fluidSum + boundarySum);
+    });
+}
+
+// @Func : Correct the velocities until the average density change over one time step
+//         is below the divergence error. Only compression is corrected.
+template<typename KernelType>
+int DFSPHSolver<KernelType>::solveDivergence(SPH &sph, int maxIterations) {
+
+    size_t size = sph.currentFluidPosition.size();
+    float timeStep = sph.timeStep;
+
+    int iterations = 0;
+    while (iterations < maxIterations) {
+        Thread_float accError(0.f);
+        ConcurrentUtils::ccLoop(size, [&] (size_t i) {
+            float densityChange = std::max(0.f, computeDensityChange(sph, i));
+            kappas[i] = densityChange * factors[i] / timeStep;
+            accError.local() += densityChange * timeStep;
+        });
+
+        float averageError = std::accumulate(accError.begin(), accError.end(), 0.f) / size;
+        if (averageError < divergenceError * sph.simConstParams.restDensity) {
+            break;
+        }
+        applyPressure(sph);
+        ++iterations;
+    }
+    return iterations;
+}
+
+// @Func : Integrate the non-pressure forces, then correct the velocities until the density
+//         predicted for the end of the step has an average variance below the density error
+//         and a maximum variance below the threshold the PCISPH loop uses.
+template<typename KernelType>
+int DFSPHSolver<KernelType>::solveDensity(SPH &sph, PhaseTimer &timer, int maxIterations) {
+
+    size_t size = sph.currentFluidPosition.size();
+    float timeStep = sph.timeStep;
+
+    ConcurrentUtils::ccLoop(size, [&] (size_t i) {
+        sph.currentFluidVelocity[i] += sph.particleParams.inverseMass * timeStep * sph.fluidForces[i];
+    });
+
+    int iterations = 0;
+    while (iterations < maxIterations) {
+        Thread_float maxDensityVariation(0.f);
+        Thread_float accDensityVariation(0.f);
+        ConcurrentUtils::ccLoop(size, [&] (size_t i) {
+            float predictedDensity = sph.fluidDensities[i] + timeStep * computeDensityChange(sph, i);
+            float densityVariation = std::max(0.f, predictedDensity - sph.simConstParams.restDensity);
+            kappas[i] = densityVariation * factors[i] / pow2(timeStep);
+            maxDensityVariation.local() = std::max(maxDensityVariation.local(), densityVariation);
+            accDensityVariation.local() += densityVariation;
+        });
+
+        sph.maximumDensityVariance = std::accumulate(maxDensityVariation.begin(), maxDensityVariation.end(), 0.f, [] (float a, float b) { return std::max(a, b); });
+        sph.averageDensityVariance = std::accumulate(accDensityVariation.begin(), accDensityVariation.end(), 0.f) / size;
+        if (iterations >= DFSPH_MIN_ITERATION &&
+            sph.averageDensityVariance < densityError * sph.simConstParams.restDensity &&
+            sph.maximumDensityVariance < sph.maximumDensityVarianceTh) {
+            break;
+        }
+        applyPressure(sph);
+        ++iterations;
+        if (sph.profile) {
+            double seconds;
+            timer.lap(seconds);
+            sph.stepStats.iterations.emplace_back(seconds);
+        }
+    }
+    return iterations;
+}
+
+template class DFSPHSolver<MullerKernel>;
+template class DFSPHSolver<CubicSplineKernel>;
+template class DFSPHSolver<WendlandC2Kernel>;
+template class DFSPHSolver<WendlandC4Kernel>;
+template class DFSPHSolver<TabulatedKernel>;
+
+} // namespace cs224
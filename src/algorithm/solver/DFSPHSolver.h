@@ -0,0 +1,68 @@
+// Divergence-free SPH (Bender and Koschier 2015).
+//
+// Every step first corrects the velocities until the average density change
+// over the step is below "divergenceError" (relative to the rest density,
+// divergence solve), then integrates the non-pressure forces and corrects the
+// predicted velocities until the average predicted density variance is below
+// "densityError" (density solve, also bounded by the maximum variance the
+// PCISPH loop accepts). Both solvers use the
+// precomputed per particle factor
+//   alpha_i / rho_i = 1 / (|Sum(m_j gradW_ij)|^2 + Sum(|m_j gradW_ij|^2))
+// and apply the pressure as a velocity change, so positions are integrated
+// once per step. Boundary particles contribute with their pseudo mass and
+// the pressure of the fluid particle (mirrored pressure), volume maps with the
+// volume gradient of the solid.
+//
+// DFSPH keeps the fluid stable at much larger time steps than PCISPH, the
+// time step follows the CFL condition: "cfl" * diameter / maximum velocity,
+// clamped to "maxTimeStep". The CFL step only looks at the velocities before
+// the step, so a step that fails to converge is rolled back with the shock
+// handling of PCISPH, and the time step it picks bounds the following steps
+// until it has grown back.
+//
+// The solver is instantiated for every kernel family and the tabulated
+// backend, so the neighbour loops inline the kernel.
+
+#pragma once
+
+#include "PressureSolver.h"
+
+#include "utils/Def.h"
+
+namespace cs224 {
+
+template<typename KernelType>
+class DFSPHSolver : public PressureSolver {
+public:
+    DFSPHSolver(const KernelType &kernel, const Settings &settings);
+
+    const char *name() const override { return "dfsph"; }
+
+    void prepare(SPH &sph) override;
+    void solve(SPH &sph, PhaseTimer &timer, int maxIterations) override;
+    bool adjustTimeStep(SPH &sph, PhaseTimer &timer) override;
+
+private:
+    void computeFactors(SPH &sph);
+    float computeDensityChange(SPH &sph, size_t i);
+    void applyPressure(SPH &sph);
+    int solveDivergence(SPH &sph, int maxIterations);
+    int solveDensity(SPH &sph, PhaseTimer &timer, int maxIterations);
+
+    inline Vector3f gradient(const Vector3f &r, float r2) const {
+        return (W.pressureGradC * W.pressureGrad(r2)) * r;
+    }
+
+    const KernelType &W;
+
+    float cfl;
+    float maxTimeStep;
+    float densityError;
+    float divergenceError;
+    float timeStepLimit;  // time step bound left by the last shock
+
+    PCI1Mf factors;  // alpha_i / rho_i
+    PCI1Mf kappas;   // kappa_i / rho_i of the current density or divergence iteration
+};
+
+} // namespace cs224
@@ -0,0 +1,89 @@
+#include "PCISPHSolver.h"
+
+#include "algorithm/SPH.h"
+
+namespace cs224 {
+
+// @Func : Update the density variance scale for the time step of this step.
+void PCISPHSolver::prepare(SPH &sph) {
+
+    sph.updateDensityVarianceScale();
+    if (sph.particleDensityVarianceScale) {
+        sph.updateParticleDensityVarianceScales(sph.stepSet);
+    }
+}
+
+// @Func : Predict, correct the pressures until the maximum density variance drops
+//         below the threshold (at least minIterations times), then integrate.
+//         Warm-started pressures act from the first prediction on.
+//         With the active-set loop, the first iteration covers all particles and every
+//         later one only predicts and applies forces to the particles whose pressure changed
+//         in the previous iteration and their neighbours (updateSet). The densities are
+//         evaluated one ring further out (densitySet), for every particle with a moved
+//         neighbour, so the convergence test sees no stale variations. The loop also ends
+//         once no pressure changes.
+//         With multi-rate time stepping only the particles of the step are corrected.
+//         The neighbour lists are rebuilt once a prediction moves a particle further than
+//         half their skin.
+void PCISPHSolver::solve(SPH &sph, PhaseTimer &timer, int maxIterations) {
+
+    const ActiveSet *set = sph.stepSet;
+    const ActiveSet *densitySet = sph.stepSet;
+    if (sph.activeSetLoop) {
+        sph.pressureSet.reset(sph.currentFluidPosition.size(), false);
+        sph.updateSet.reset(sph.currentFluidPosition.size(), false);
+        sph.densitySet.reset(sph.currentFluidPosition.size(), false);
+    }
+
+    if (sph.warmStart) {
+        sph.updatePressureForces(set);
+    }
+    sph.pressureHistory = false;
+
+    int iterations = 0;
+    while (iterations < maxIterations) {
+        sph.predictVelocityAndPosition(set);
+        sph.validateNeighborLists(set);
+        sph.updatePressures(densitySet);
+        if (sph.activeSetLoop) {
+            sph.updateSet.clear();
+            sph.updateSet.addNeighbors(sph.pressureSet, sph.fluidNeighbors, sph.stepSet);
+            sph.updateSet.compact();
+            sph.densitySet.clear();
+            sph.densitySet.addNeighbors(sph.updateSet, sph.fluidNeighbors, sph.stepSet);
+            sph.densitySet.compact();
+            set = &sph.updateSet;
+            densitySet = &sph.densitySet;
+        }
+        sph.updatePressureForces(set);
+        if (sph.profile) {
+            double seconds;
+            timer.lap(seconds);
+            sph.stepStats.iterations.emplace_back(seconds);
+            if (sph.activeSetLoop) {
+                sph.stepStats.activeParticles.emplace_back(int(sph.updateSet.size()));
+            }
+        }
+        if (++iterations >= sph.minIterations && sph.maximumDensityVariance < sph.maximumDensityVarianceTh) {
+            break;
+        }
+        if (sph.activeSetLoop && sph.pressureSet.empty()) {
+            break;
+        }
+    }
+    sph.stepStats.pcIterations = iterations;
+
+    sph.setVelocityAndPosition();
+    timer.lap(sph.stepStats.integration);
+}
+
+bool PCISPHSolver::adjustTimeStep(SPH &sph, PhaseTimer &timer) {
+
+    sph.adjustTimeStep();
+    timer.lap(sph.stepStats.timeStepAdjust);
+    bool shock = sph.handleShock();
+    timer.lap(sph.stepStats.shockHandling);
+    return shock;
+}
+
+} // namespace cs224
@@ -0,0 +1,22 @@
+// Predictive-corrective incompressible SPH (Solenthaler and Pajarola 2009),
+// the prediction-correction loop of Algorithm 2 in the paper. The phases are
+// the SPH members shared with pcisph_bench, the solver only drives them.
+
+#pragma once
+
+#include "PressureSolver.h"
+
+namespace cs224 {
+
+class PCISPHSolver : public PressureSolver {
+public:
+    const char *name() const override { return "pcisph"; }
+    bool supportsPartialSteps() const override { return true; }
+    bool supportsAdaptiveResolution() const override { return true; }
+
+    void prepare(SPH &sph) override;
+    void solve(SPH &sph, PhaseTimer &timer, int maxIterations) override;
+    bool adjustTimeStep(SPH &sph, PhaseTimer &timer) override;
+};
+
+} // namespace cs224
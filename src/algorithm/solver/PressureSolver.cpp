@@ -0,0 +1,30 @@
+#include "PressureSolver.h"
+#include "PCISPHSolver.h"
+#include "DFSPHSolver.h"
+
+#include "algorithm/SPH.h"
+
+namespace cs224 {
+
+std::unique_ptr<PressureSolver> PressureSolver::create(const Settings &settings, const SPH &sph) {
+
+    std::string method = settings.getString("method", "pcisph");
+    if (method == "dfsph") {
+        if (sph.tabulatedKernel) {
+            return std::unique_ptr<PressureSolver>(new DFSPHSolver<TabulatedKernel>(sph.kernelTable, settings));
+        }
+        switch (sph.kernelFamily) {
+        case Kernel::Muller: return std::unique_ptr<PressureSolver>(new DFSPHSolver<MullerKernel>(sph.mullerKernel, settings));
+        case Kernel::CubicSpline: return std::unique_ptr<PressureSolver>(new DFSPHSolver<CubicSplineKernel>(sph.cubicSplineKernel, settings));
+        case Kernel::WendlandC2: return std::unique_ptr<PressureSolver>(new DFSPHSolver<WendlandC2Kernel>(sph.wendlandC2Kernel, settings));
+        case Kernel::WendlandC4: return std::unique_ptr<PressureSolver>(new DFSPHSolver<WendlandC4Kernel>(sph.wendlandC4Kernel, settings));
+        }
+    }
+
+    if (method != "pcisph") {
+        std::cout << "Unknown method " << method << ", using pcisph" << std::endl;
+    }
+    return std::unique_ptr<PressureSolver>(new PCISPHSolver());
+}
+
+} // namespace cs224
@@ -0,0 +1,51 @@
+// Pressure solvers, selected by the "method" setting of the scene.
+//
+// SPH::simulate sorts the particles, builds the neighbour lists and computes
+// the densities, normals and non-pressure forces (fluidForces) of the current
+// positions. The solver then enforces incompressibility, integrates the
+// velocities and positions, and picks the next time step. Solvers work
+// directly on the particle state, grids and kernel of SPH (they are friends
+// of SPH), so they add no copies of the fluid.
+
+#pragma once
+
+#include "algorithm/StepStats.h"
+#include "utils/Settings.h"
+
+#include <memory>
+#include <string>
+
+namespace cs224 {
+
+class SPH;
+
+class PressureSolver {
+public:
+    virtual ~PressureSolver() {}
+
+    virtual const char *name() const = 0;
+
+    // Whether the solver only updates the particles of SPH::stepSet ("multiRateLevels", "sleep").
+    virtual bool supportsPartialSteps() const { return false; }
+
+    // Whether the solver handles per-particle masses and smoothing lengths ("adaptiveResolution").
+    virtual bool supportsAdaptiveResolution() const { return false; }
+
+    // Called after the non-pressure forces of a step are computed, before the timed solve.
+    virtual void prepare(SPH &) {}
+
+    // Solve for the pressure and integrate the fluid particles with the current time step.
+    // Laps the iterations and the integration on the timer.
+    virtual void solve(SPH &sph, PhaseTimer &timer, int maxIterations) = 0;
+
+    // Called after the collisions are resolved, chooses the time step of the next step.
+    // Laps the time step adjustment and shock handling on the timer.
+    // Returns true if the step was rolled back.
+    virtual bool adjustTimeStep(SPH &sph, PhaseTimer &timer) = 0;
+
+    // Creates the solver of the "method" setting, "pcisph" (default) or "dfsph".
+    // The solver uses the kernel family and backend of sph.
+    static std::unique_ptr<PressureSolver> create(const Settings &settings, const SPH &sph);
+};
+
+} // namespace cs224
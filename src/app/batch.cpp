@@ -0,0 +1,100 @@
+// Headless batch simulation. Runs without a window or GL context, e.g. on
+// render nodes without a display.
+//
+// Usage: pcisph_batch [--steps N | --time T] [--threads N] scene.json
+//
+// Loads the scene, simulates N steps (default 1000) or until the simulated
+// time reaches T seconds as fast as possible and reports the throughput as
+// a JSON object: steps per second, particle updates (particles * steps)
+// per second and the average number of pressure solver iterations per step. All cores are used unless --threads limits the TBB workers.
+
+#include "algorithm/SPH.h"
+
+#include <json11.h>
+#include <tbb/task_scheduler_init.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+using namespace cs224;
+
+static void usage() {
+    std::cerr << "Usage: pcisph_batch [--steps N | --time T] [--threads N] scene.json" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+
+    int steps = 1000;
+    float duration = 0.f;
+    int threads = tbb::task_scheduler_init::automatic;
+    std::string path;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg == "--steps" && i + 1 < argc) {
+            steps = std::atoi(argv[++i]);
+        } else if (arg == "--time" && i + 1 < argc) {
+            duration = float(std::atof(argv[++i]));
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = std::atoi(argv[++i]);
+        } else if (path.empty() && arg[0] != '-') {
+            path = arg;
+        } else {
+            usage();
+            return -1;
+        }
+    }
+    if (path.empty()) {
+        usage();
+        return -1;
+    }
+
+    // Must be alive before the first parallel loop, i.e. before the simulation is built.
+    tbb::task_scheduler_init scheduler(threads);
+
+    try {
+        auto start = std::chrono::steady_clock::now();
+        Scene scene = Scene::load(path);
+        SPH sph(scene);
+        double setupSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        size_t particles = sph.getFluidPositions().size();
+        int simulatedSteps = 0;
+        long iterations = 0;
+        start = std::chrono::steady_clock::now();
+        if (duration > 0.f) {
+            while (sph.getCurrentTime() < duration) {
+                sph.simulate();
+                iterations += sph.getStepStats().pcIterations;
+                ++simulatedSteps;
+            }
+        } else {
+            for (; simulatedSteps < steps; ++simulatedSteps) {
+                sph.simulate();
+                iterations += sph.getStepStats().pcIterations;
+            }
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        json11::Json::object result {
+            { "scene", path },
+            { "method", sph.getMethod() },
+            { "threads", threads == tbb::task_scheduler_init::automatic ? tbb::task_scheduler_init::default_num_threads() : threads },
+            { "particles", int(particles) },
+            { "steps", simulatedSteps },
+            { "simulatedTime", sph.getCurrentTime() },
+            { "setupSeconds", setupSeconds },
+            { "seconds", seconds },
+            { "stepsPerSecond", simulatedSteps / seconds },
+            { "averageIterations", simulatedSteps > 0 ? double(iterations) / simulatedSteps : 0.0 },
+            { "particleUpdatesPerSecond", double(particles) * simulatedSteps / seconds }
+        };
+        std::cout << json11::Json(result).dump() << std::endl;
+    } catch (const std::exception &e) {
+        std::cerr << "Runtime error: " << e.what() << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
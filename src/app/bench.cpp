@@ -0,0 +1,508 @@
+// Benchmarks for the simulation code. Runs without opening a window.
+//
+// Usage: pcisph_bench [--suite phases|ordering|kernels|all] [--particles N[,N...]]
+//                     [--threads N] [--warmup N] [--reps N] [--steps N]
+//                     [--table-sizes N[,N...]] [--set key=value ...] [--no-lists]
+//                     [scene.json ...]
+//
+// Phases (default suite): builds a synthetic block of fluid particles for
+// every requested size (default 10000 and 100000, cube of particles at rest
+// spacing inside a boundary box, no relaxation) and times Grid::update,
+// Grid::query and each SPH phase in isolation. Every phase runs --warmup
+// untimed and --reps timed repetitions, the median and 95th percentile of
+// the repetitions are reported in seconds. Every repetition starts from the
+// same snapshot of the particle state, so the phases that integrate or
+// accumulate do not drift the state between repetitions. --set overrides a scene setting
+// (the value is parsed as JSON, plain strings are accepted), e.g.
+// --set particleLayout=soa.
+//
+// Grid ordering: simulates every scene (default: scenes/test.json and
+// scenes/test3.json) with the linear and the morton cell ordering and
+// reports the wall time and the cache misses of --steps simulation steps.
+// Cache misses are read from the Linux perf counters and reported as -1
+// when they are not available.
+//
+// Kernels: compares the tabulated kernel backend (for every --table-sizes
+// resolution, default 256,1024,4096,16384) against the analytic evaluation of
+// every kernel family on random pairs with r^2 in [1e-5, h^2). Reports the
+// maximum error of every kernel term relative to the largest analytic value of
+// that term, and the median time per pair evaluation (all five terms) of both
+// backends.
+//
+// Every result is printed as one JSON object per line. --threads limits the
+// number of TBB worker threads, all cores are used by default.
+
+#include "algorithm/SPH.h"
+#include "utils/PerfCounters.h"
+#include "Config.h"
+
+#include <json11.h>
+#include <tbb/task_scheduler_init.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace cs224 {
+
+// Runs the private phases of the simulation, see the friend declaration in SPH.
+class SPHBenchmark {
+public:
+    struct Options {
+        int threads;
+        int warmup = 3;
+        int reps = 20;
+        json11::Json::object settings;
+    };
+
+    static void run(SPH &sph, const Options &options) {
+
+        // One regular step, so that every buffer holds the state of a running simulation.
+        // The grid update sorts the particles integrated by the step.
+        sph.simulate();
+        Snapshot snapshot;
+        snapshot.save(sph);
+
+        PCI3Mf &positions = sph.currentFluidPosition;
+        float radius = sph.kernelParams.radius;
+        std::vector<int> counts(positions.size());
+
+        time(sph, snapshot, options, "gridUpdate", [&] () {
+            sph.fluidGrid.update(positions, [&] (const std::vector<uint32_t> &permutation) {
+                Grid::permute(positions, permutation);
+            });
+        });
+
+        // The other phases start from the state of the first prediction-correction iteration
+        // of the next step, with the particles sorted and all per-step buffers filled.
+        snapshot.restore(sph);
+        sph.buildFluidGrids();
+        sph.buildNeighborLists();
+        sph.testBoundary();
+        sph.initDensities();
+        sph.initNormals();
+        sph.initForces();
+        sph.solver->prepare(sph);
+        sph.predictVelocityAndPosition();
+        sph.updatePressures();
+        sph.updatePressureForces();
+        snapshot.save(sph);
+
+        time(sph, snapshot, options, "gridQuery", [&] () {
+            ConcurrentUtils::ccLoop(positions.size(), [&] (size_t i) {
+                int n = 0;
+                sph.fluidGrid.query(radius, positions, positions[i], [&n] (size_t j, const Vector3f &r, float r2) {
+                    ++n;
+                });
+                counts[i] = n;
+            });
+        });
+        time(sph, snapshot, options, "buildNeighborLists", [&] () { sph.buildNeighborLists(); });
+        time(sph, snapshot, options, "testBoundary", [&] () { sph.testBoundary(); });
+        time(sph, snapshot, options, "initDensities", [&] () { sph.initDensities(); });
+        time(sph, snapshot, options, "initNormals", [&] () { sph.initNormals(); });
+        time(sph, snapshot, options, "initForces", [&] () { sph.initForces(); });
+        time(sph, snapshot, options, "predictVelocityAndPosition", [&] () { sph.predictVelocityAndPosition(); });
+        time(sph, snapshot, options, "updatePressures", [&] () { sph.updatePressures(); });
+        time(sph, snapshot, options, "updatePressureForces", [&] () { sph.updatePressureForces(); });
+        time(sph, snapshot, options, "setVelocityAndPosition", [&] () { sph.setVelocityAndPosition(); });
+    }
+
+private:
+    // The particle state the phases change: setVelocityAndPosition integrates, updatePressures
+    // accumulates the pressures, the grid update permutes the positions.
+    struct Snapshot {
+        PCI3Mf positions;
+        PCI3Mf velocities;
+        PCI3Mf newPositions;
+        PCI3Mf newVelocities;
+        PCI3Mf forces;
+        PCI3Mf pressureForces;
+        PCI3Mf normals;
+        PCI1Mf densities;
+        PCI1Mf pressures;
+        PCI1Mf previousPressures;
+        PCI1Mf densityVariations;
+        PCI1Mf pressureTerms;
+        PCI1Mf boundaryDensities;
+        PCI1Mf boundaryInverseSquaredDensities;
+        FluidStore store;
+        float maximumVelocity;
+        float maximumForce;
+        float maximumDensityVariance;
+        float averageDensityVariance;
+
+        void save(const SPH &sph) {
+            positions = sph.currentFluidPosition;
+            velocities = sph.currentFluidVelocity;
+            newPositions = sph.newFluidPosition;
+            newVelocities = sph.newFluidVelocity;
+            forces = sph.fluidForces;
+            pressureForces = sph.fluidPressureForces;
+            normals = sph.fluidNormals;
+            densities = sph.fluidDensities;
+            pressures = sph.fluidPressures;
+            previousPressures = sph.fluidPreviousPressures;
+            densityVariations = sph.fluidDensityVariations;
+            pressureTerms = sph.fluidPressureTerms;
+            boundaryDensities = sph.boundaryDensities;
+            boundaryInverseSquaredDensities = sph.boundaryInverseSquaredDensities;
+            store = sph.fluidStore;
+            maximumVelocity = sph.maximumVelocity;
+            maximumForce = sph.maximumForce;
+            maximumDensityVariance = sph.maximumDensityVariance;
+            averageDensityVariance = sph.averageDensityVariance;
+        }
+
+        void restore(SPH &sph) const {
+            sph.currentFluidPosition = positions;
+            sph.currentFluidVelocity = velocities;
+            sph.newFluidPosition = newPositions;
+            sph.newFluidVelocity = newVelocities;
+            sph.fluidForces = forces;
+            sph.fluidPressureForces = pressureForces;
+            sph.fluidNormals = normals;
+            sph.fluidDensities = densities;
+            sph.fluidPressures = pressures;
+            sph.fluidPreviousPressures = previousPressures;
+            sph.fluidDensityVariations = densityVariations;
+            sph.fluidPressureTerms = pressureTerms;
+            sph.boundaryDensities = boundaryDensities;
+            sph.boundaryInverseSquaredDensities = boundaryInverseSquaredDensities;
+            sph.fluidStore = store;
+            sph.maximumVelocity = maximumVelocity;
+            sph.maximumForce = maximumForce;
+            sph.maximumDensityVariance = maximumDensityVariance;
+            sph.averageDensityVariance = averageDensityVariance;
+        }
+    };
+
+    // Runs func --warmup and --reps times, restoring the snapshot (untimed) before each run.
+    static void time(SPH &sph, const Snapshot &snapshot, const Options &options, const std::string &phase, const std::function<void()> &func) {
+
+        for (int i = 0; i < options.warmup; ++i) {
+            snapshot.restore(sph);
+            func();
+        }
+
+        std::vector<double> samples;
+        for (int i = 0; i < options.reps; ++i) {
+            snapshot.restore(sph);
+            auto start = std::chrono::steady_clock::now();
+            func();
+            samples.emplace_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+        std::sort(samples.begin(), samples.end());
+
+        json11::Json::object result {
+            { "benchmark", "phase" },
+            { "phase", phase },
+            { "particles", int(sph.currentFluidPosition.size()) },
+            { "threads", options.threads },
+            { "settings", options.settings },
+            { "warmup", options.warmup },
+            { "reps", options.reps },
+            { "median", percentile(samples, 0.5) },
+            { "p95", percentile(samples, 0.95) },
+            { "min", samples.empty() ? 0.0 : samples.front() }
+        };
+        std::cout << json11::Json(result).dump() << std::endl;
+    }
+
+    // Nearest-rank percentile of sorted samples.
+    static double percentile(const std::vector<double> &sorted, double q) {
+        if (sorted.empty()) {
+            return 0.0;
+        }
+        size_t rank = size_t(std::ceil(q * sorted.size()));
+        return sorted[std::min(sorted.size(), std::max(rank, size_t(1))) - 1];
+    }
+};
+
+} // namespace cs224
+
+using namespace cs224;
+
+// Scene with a cube of about n fluid particles at rest spacing, resting on
+// the floor of a boundary box that leaves some room around the fluid.
+static Scene syntheticBlock(int n, const json11::Json::object &settings) {
+
+    const float particleRadius = 0.01f;
+    const float spacing = 2.f * particleRadius;
+    int side = std::max(1, int(std::round(std::cbrt(double(n)))));
+
+    // Slightly less than side * spacing, so the generator places exactly side particles per axis.
+    float extent = (side - 0.5f) * spacing;
+    float margin = 0.25f * extent + 4.f * spacing;
+
+    json11::Json::object sceneSettings(settings);
+    sceneSettings["particleRadius"] = particleRadius;
+    if (!sceneSettings.count("relax")) {
+        sceneSettings["relax"] = false;
+    }
+
+    json11::Json root = json11::Json::object {
+        { "settings", sceneSettings },
+        { "scene", json11::Json::object {
+            { "world", json11::Json::object {
+                { "bounds", json11::Json::array {
+                    json11::Json::array { -0.5f * extent - margin, 0.f, -0.5f * extent - margin },
+                    json11::Json::array { 0.5f * extent + margin, extent + 2.f * margin, 0.5f * extent + margin }
+                } }
+            } },
+            { "boxes", json11::Json::array {
+                json11::Json::object {
+                    { "type", "fluid" },
+                    { "bounds", json11::Json::array {
+                        json11::Json::array { -0.5f * extent, spacing, -0.5f * extent },
+                        json11::Json::array { 0.5f * extent, extent + spacing, 0.5f * extent }
+                    } }
+                }
+            } }
+        } }
+    };
+    return Scene::fromJson(root);
+}
+
+static void benchGridOrdering(PerfCounters &counters, const std::string &path, const std::string &ordering, int steps, bool neighborLists, int threads) {
+
+    Scene scene = Scene::load(path, json11::Json::object {
+        { "gridOrdering", ordering },
+        { "neighborLists", neighborLists }
+    });
+    SPH sph(scene);
+
+    counters.start();
+    auto start = std::chrono::steady_clock::now();
+    for (int step = 0; step < steps; ++step) {
+        sph.simulate();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    counters.stop();
+
+    json11::Json::object result {
+        { "benchmark", "gridOrdering" },
+        { "scene", path },
+        { "ordering", ordering },
+        { "neighborLists", neighborLists },
+        { "particles", int(sph.getFluidPositions().size()) },
+        { "threads", threads },
+        { "steps", steps },
+        { "seconds", seconds }
+    };
+    for (int e = 0; e < PerfCounters::EventCount; ++e) {
+        result[PerfCounters::name(PerfCounters::Event(e))] = double(counters.value(PerfCounters::Event(e)));
+    }
+    std::cout << json11::Json(result).dump() << std::endl;
+}
+
+// Sum of all kernel terms over the pairs, the sum keeps the evaluation from being optimized away.
+template<typename KernelType>
+static float evaluateKernel(const KernelType &W, const PCI1Mf &r2) {
+    float sum = 0.f;
+    for (float squaredR : r2) {
+        sum += W.density(squaredR) + W.densityGrad(squaredR) + W.pressureGrad(squaredR);
+        sum += W.viscosityLaplace(squaredR) + W.cohesion(squaredR);
+    }
+    return sum;
+}
+
+template<typename KernelType>
+static double timeKernel(const KernelType &W, const PCI1Mf &r2, int warmup, int reps) {
+    volatile float sink = 0.f;
+    for (int i = 0; i < warmup; ++i) {
+        sink = sink + evaluateKernel(W, r2);
+    }
+    std::vector<double> samples;
+    for (int i = 0; i < reps; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        sink = sink + evaluateKernel(W, r2);
+        samples.emplace_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    std::sort(samples.begin(), samples.end());
+    return samples.empty() ? 0.0 : samples[samples.size() / 2] / r2.size();
+}
+
+// The kernel terms scaled to what the phases use: the gradient and cohesion terms
+// are divided by r, they are compared times |r|.
+template<typename KernelType>
+static void kernelTerms(const KernelType &W, float squaredR, double terms[5]) {
+    float normalizedR = std::sqrt(squaredR);
+    terms[0] = W.densityC * W.density(squaredR);
+    terms[1] = W.densityGradC * W.densityGrad(squaredR) * normalizedR;
+    terms[2] = W.pressureGradC * W.pressureGrad(squaredR) * normalizedR;
+    terms[3] = W.viscosityGrad2 * W.viscosityLaplace(squaredR);
+    terms[4] = W.surfaceTensionConstant * W.cohesion(squaredR) * normalizedR;
+}
+
+template<typename KernelType>
+static void benchKernel(const std::string &family, const std::vector<int> &resolutions, int warmup, int reps) {
+
+    const float particleRadius = 0.01f;
+    KernelType W;
+    W.build(KERNEL_SCALE * particleRadius);
+
+    // Random pairs inside the kernel support, skipping the r -> 0 range the phases skip as well.
+    const size_t count = 1 << 18;
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> squaredDistance(1e-5f, W.squaredSmoothLength);
+    PCI1Mf r2(count);
+    for (float &squaredR : r2) {
+        squaredR = squaredDistance(rng);
+    }
+
+    double analyticTime = timeKernel(W, r2, warmup, reps);
+
+    for (int resolution : resolutions) {
+        TabulatedKernel table;
+        table.build(W, resolution);
+
+        // Maximum error and maximum analytic magnitude of every term.
+        double error[5] = { 0.0, 0.0, 0.0, 0.0, 0.0 };
+        double scale[5] = { 0.0, 0.0, 0.0, 0.0, 0.0 };
+        for (float squaredR : r2) {
+            double exact[5];
+            double approx[5];
+            kernelTerms(W, squaredR, exact);
+            kernelTerms(table, squaredR, approx);
+            for (int t = 0; t < 5; ++t) {
+                error[t] = std::max(error[t], std::abs(approx[t] - exact[t]));
+                scale[t] = std::max(scale[t], std::abs(exact[t]));
+            }
+        }
+
+        json11::Json::object result {
+            { "benchmark", "kernels" },
+            { "kernel", family },
+            { "resolution", resolution },
+            { "pairs", int(count) },
+            { "densityError", error[0] / scale[0] },
+            { "densityGradError", error[1] / scale[1] },
+            { "pressureGradError", error[2] / scale[2] },
+            { "viscosityLaplaceError", error[3] / scale[3] },
+            { "cohesionError", error[4] / scale[4] },
+            { "analyticSecondsPerPair", analyticTime },
+            { "tableSecondsPerPair", timeKernel(table, r2, warmup, reps) }
+        };
+        std::cout << json11::Json(result).dump() << std::endl;
+    }
+}
+
+static void benchKernels(const std::vector<int> &resolutions, int warmup, int reps) {
+    benchKernel<MullerKernel>("muller", resolutions, warmup, reps);
+    benchKernel<CubicSplineKernel>("cubicSpline", resolutions, warmup, reps);
+    benchKernel<WendlandC2Kernel>("wendlandC2", resolutions, warmup, reps);
+    benchKernel<WendlandC4Kernel>("wendlandC4", resolutions, warmup, reps);
+}
+
+static std::vector<int> parseSizes(const std::string &list) {
+    std::vector<int> sizes;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        sizes.emplace_back(int(std::atof(item.c_str())));
+    }
+    return sizes;
+}
+
+static bool parseSetting(const std::string &arg, json11::Json::object &settings) {
+    size_t split = arg.find('=');
+    if (split == std::string::npos) {
+        return false;
+    }
+    std::string err;
+    std::string value = arg.substr(split + 1);
+    json11::Json json = json11::Json::parse(value, err);
+    settings[arg.substr(0, split)] = err.empty() ? json : json11::Json(value);
+    return true;
+}
+
+static void usage() {
+    std::cerr << "Usage: pcisph_bench [--suite phases|ordering|kernels|all] [--particles N[,N...]] [--threads N] "
+                 "[--warmup N] [--reps N] [--steps N] [--table-sizes N[,N...]] [--set key=value ...] [--no-lists] "
+                 "[scene.json ...]" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+
+    // Open the counters before the first parallel loop, so the TBB worker threads inherit them.
+    PerfCounters counters;
+
+    std::string suite = "phases";
+    std::vector<int> sizes { 10000, 100000 };
+    std::vector<int> tableSizes { 256, 1024, 4096, 16384 };
+    int threads = tbb::task_scheduler_init::automatic;
+    int steps = 20;
+    bool neighborLists = true;
+    SPHBenchmark::Options options;
+    std::vector<std::string> scenes;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg == "--suite" && i + 1 < argc) {
+            suite = argv[++i];
+        } else if (arg == "--particles" && i + 1 < argc) {
+            sizes = parseSizes(argv[++i]);
+        } else if (arg == "--table-sizes" && i + 1 < argc) {
+            tableSizes = parseSizes(argv[++i]);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = std::atoi(argv[++i]);
+        } else if (arg == "--warmup" && i + 1 < argc) {
+            options.warmup = std::atoi(argv[++i]);
+        } else if (arg == "--reps" && i + 1 < argc) {
+            options.reps = std::atoi(argv[++i]);
+        } else if (arg == "--steps" && i + 1 < argc) {
+            steps = std::atoi(argv[++i]);
+        } else if (arg == "--set" && i + 1 < argc && parseSetting(argv[i + 1], options.settings)) {
+            ++i;
+        } else if (arg == "--no-lists") {
+            neighborLists = false;
+        } else if (arg[0] != '-') {
+            scenes.emplace_back(arg);
+        } else {
+            usage();
+            return -1;
+        }
+    }
+    if (suite != "phases" && suite != "ordering" && suite != "kernels" && suite != "all") {
+        usage();
+        return -1;
+    }
+    if (scenes.empty()) {
+        scenes.emplace_back(std::string(SCENES_DIR) + "/test.json");
+        scenes.emplace_back(std::string(SCENES_DIR) + "/test3.json");
+    }
+    if (!neighborLists) {
+        options.settings["neighborLists"] = false;
+    }
+
+    tbb::task_scheduler_init scheduler(threads);
+    options.threads = threads == tbb::task_scheduler_init::automatic ? tbb::task_scheduler_init::default_num_threads() : threads;
+
+    if (suite == "phases" || suite == "all") {
+        for (int n : sizes) {
+            SPH sph(syntheticBlock(n, options.settings));
+            SPHBenchmark::run(sph, options);
+        }
+    }
+
+    if (suite == "kernels" || suite == "all") {
+        benchKernels(tableSizes, options.warmup, options.reps);
+    }
+
+    if (suite == "ordering" || suite == "all") {
+        if (!counters.available()) {
+            std::cerr << "Hardware cache counters are not available, only timings are reported" << std::endl;
+        }
+        for (const auto &scene : scenes) {
+            benchGridOrdering(counters, scene, "linear", steps, neighborLists, options.threads);
+            benchGridOrdering(counters, scene, "morton", steps, neighborLists, options.threads);
+        }
+    }
+
+    return 0;
+}
@@ -171,8 +171,8 @@ void Engine::render() {
         m_particleShader->draw(view, proj, cs224::toMatrix(m_sph->getFluidPositions()),Eigen::Vector4f(0.8f, 0.54f, 0.54f, 1.f), particleRadius * 2);
 
         // Draw boundary meshes
-        for (const auto &shader : m_boundaryMeshShader) {
-            shader->draw(mvp, Eigen::Vector4f(0.32f, 0.32f, 0.81f, 1.f));
+        for (size_t i = 0; i < m_boundaryMeshShader.size(); ++i) {
+            m_boundaryMeshShader[i]->draw(mvp * m_sph->getBoundaryMeshTransform(i), Eigen::Vector4f(0.32f, 0.32f, 0.81f, 1.f));
         }
     }else{
         Eigen::Matrix4f mv = view;
@@ -185,8 +185,8 @@ void Engine::render() {
         m_SSFRenderer->drawQuad(view,proj,m_sph->getBounds());
 
         // Draw boundary meshes
-        for (const auto &shader : m_boundaryMeshShader) {
-            shader->draw(mvp, Eigen::Vector4f(0.32f, 0.32f, 0.81f, 1.f));
+        for (size_t i = 0; i < m_boundaryMeshShader.size(); ++i) {
+            m_boundaryMeshShader[i]->draw(mvp * m_sph->getBoundaryMeshTransform(i), Eigen::Vector4f(0.32f, 0.32f, 0.81f, 1.f));
         }
 
         m_SSFRenderer->draw(view, proj, cs224::toMatrix(m_sph->getFluidPositions()),particleRadius * 2);
@@ -1,7 +1,7 @@
 #pragma once
 
 #include "algorithm/SPH.h"
-#include "utils/Def.h"
+#include "utils/GLDef.h"
 #include "./camera/Camera.h"
 #include "shading/DomainShader.h"
 #include "shading/ParticleShader.h"
@@ -1,6 +1,6 @@
 #pragma once
 
-#include "utils/Def.h"
+#include "utils/GLDef.h"
 #include "PCIShader.h"
 
 namespace cs224 {
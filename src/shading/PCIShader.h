@@ -4,7 +4,7 @@
 
 #include <map>
 #include <Eigen/Geometry>
-#include <utils/Def.h>
+#include <utils/GLDef.h>
 
 namespace cs224 {
 
@@ -1,10 +1,13 @@
 #pragma once
 #include <tbb/parallel_for.h>
+#include <tbb/parallel_scan.h>
+#include <tbb/blocked_range.h>
 #include <tbb/enumerable_thread_specific.h>
 
 namespace cs224 {
 
 typedef tbb::enumerable_thread_specific<float> Thread_float;    
+typedef tbb::enumerable_thread_specific<int> Thread_int;
 
 namespace ConcurrentUtils{
     
@@ -15,5 +18,40 @@ namespace ConcurrentUtils{
     inline void ccLoop(size_t count, Func func) {
         tbb::parallel_for(0ul, count, 1ul, [func] (size_t i) { func(i); });
     }
+
+    // Body of the parallel prefix sum, see exclusiveScan.
+    template<typename T, typename ValueFunc, typename OutArray>
+    struct ScanBody {
+        T sum;
+        ValueFunc &value;
+        OutArray &out;
+
+        ScanBody(ValueFunc &v, OutArray &o) : sum(0), value(v), out(o) {}
+        ScanBody(ScanBody &b, tbb::split) : sum(0), value(b.value), out(b.out) {}
+
+        template<typename Tag>
+        void operator()(const tbb::blocked_range<size_t> &range, Tag) {
+            T temp = sum;
+            for (size_t i = range.begin(); i < range.end(); ++i) {
+                if (Tag::is_final_scan()) {
+                    out[i] = temp;
+                }
+                temp += value(i);
+            }
+            sum = temp;
+        }
+
+        void reverse_join(ScanBody &b) { sum = b.sum + sum; }
+        void assign(ScanBody &b) { sum = b.sum; }
+    };
+
+    // Concurrent exclusive prefix sum: out[i] = value(0) + ... + value(i - 1).
+    // Returns the sum of all values.
+    template<typename T, typename ValueFunc, typename OutArray>
+    inline T exclusiveScan(size_t count, ValueFunc value, OutArray &out) {
+        ScanBody<T, ValueFunc, OutArray> body(value, out);
+        tbb::parallel_scan(tbb::blocked_range<size_t>(0, count), body);
+        return body.sum;
+    }
+}
 }
-}
\ No newline at end of file
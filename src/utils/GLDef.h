@@ -0,0 +1,29 @@
+// OpenGL definitions for the viewer (engine, shading, gui).
+// Kept out of Def.h so the simulation library builds without GL and GLFW.
+#pragma once
+
+#if defined(__APPLE__)
+    #define GLFW_INCLUDE_GLCOREARB
+#elif defined(_WIN32)
+    #include <glad/glad.h>
+#else
+    #define GL_GLEXT_PROTOTYPES
+#endif
+
+#include <GLFW/glfw3.h>
+
+#include "Def.h"
+
+namespace cs224 {
+
+template <typename T> struct CPP2GL_types;
+template <> struct CPP2GL_types <uint32_t> { enum { type = GL_UNSIGNED_INT, integral = 1 }; };
+template <> struct CPP2GL_types <int32_t> { enum { type = GL_INT, integral = 1 }; };
+template <> struct CPP2GL_types <uint16_t> { enum { type = GL_UNSIGNED_SHORT, integral = 1 }; };
+template <> struct CPP2GL_types <int16_t> { enum { type = GL_SHORT, integral = 1 }; };
+template <> struct CPP2GL_types <uint8_t> { enum { type = GL_UNSIGNED_BYTE, integral = 1 }; };
+template <> struct CPP2GL_types <int8_t> { enum { type = GL_BYTE, integral = 1 }; };
+template <> struct CPP2GL_types <double> { enum { type = GL_DOUBLE, integral = 0 }; };
+template <> struct CPP2GL_types <float> { enum { type = GL_FLOAT, integral = 0 }; };
+
+}
@@ -123,6 +123,12 @@ static constexpr T pow2(T x) { return x*x; }
 template<typename T>
 static constexpr T pow3(T x) { return x*x*x; }
 
+template<typename T>
+static constexpr T pow4(T x) { return x*x*x*x; }
+
+template<typename T>
+static constexpr T pow5(T x) { return x*x*x*x*x; }
+
 template<typename T>
 static constexpr T pow6(T x) { return x*x*x*x*x*x; }
 
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__linux__)
+    #include <linux/perf_event.h>
+    #include <sys/ioctl.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif
+
+namespace cs224 {
+
+// Hardware cache miss counters, read through the Linux perf_event interface.
+// The counters are opened with inherit set, so they also count the TBB worker
+// threads, as long as the counters are created before the first parallel loop
+// spawns the workers. Counters that cannot be opened (other platforms, missing
+// permission, virtual machines) report -1.
+class PerfCounters {
+public:
+    enum Event {
+        L1DReadMisses,
+        LLCReadMisses,
+        CacheMisses,
+        EventCount
+    };
+
+    PerfCounters() {
+        for (int e = 0; e < EventCount; ++e) {
+            m_fd[e] = open(Event(e));
+            m_values[e] = -1;
+        }
+    }
+
+    ~PerfCounters() {
+#if defined(__linux__)
+        for (int e = 0; e < EventCount; ++e) {
+            if (m_fd[e] >= 0) close(m_fd[e]);
+        }
+#endif
+    }
+
+    bool available() const {
+        for (int e = 0; e < EventCount; ++e) {
+            if (m_fd[e] >= 0) return true;
+        }
+        return false;
+    }
+
+    void start() {
+#if defined(__linux__)
+        for (int e = 0; e < EventCount; ++e) {
+            if (m_fd[e] < 0) continue;
+            ioctl(m_fd[e], PERF_EVENT_IOC_RESET, 0);
+            ioctl(m_fd[e], PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    void stop() {
+#if defined(__linux__)
+        for (int e = 0; e < EventCount; ++e) {
+            m_values[e] = -1;
+            if (m_fd[e] < 0) continue;
+            ioctl(m_fd[e], PERF_EVENT_IOC_DISABLE, 0);
+            int64_t value;
+            if (read(m_fd[e], &value, sizeof(value)) == sizeof(value)) {
+                m_values[e] = value;
+            }
+        }
+#endif
+    }
+
+    int64_t value(Event e) const { return m_values[e]; }
+
+    static const char *name(Event e) {
+        switch (e) {
+        case L1DReadMisses: return "l1dReadMisses";
+        case LLCReadMisses: return "llcReadMisses";
+        case CacheMisses: return "cacheMisses";
+        default: return "unknown";
+        }
+    }
+
+private:
+    static int open(Event e) {
+#if defined(__linux__)
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        switch (e) {
+        case L1DReadMisses:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        case LLCReadMisses:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        default:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CACHE_MISSES;
+            break;
+        }
+        return int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+#else
+        return -1;
+#endif
+    }
+
+    int m_fd[EventCount];
+    int64_t m_values[EventCount];
+};
+
+} // namespace cs224
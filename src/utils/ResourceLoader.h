@@ -1,5 +1,5 @@
 #pragma once
-#include "utils/Def.h"
+#include "utils/GLDef.h"
 namespace cs224{
     class ResourceLoader
     {
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "utils/Def.h"
+#include "utils/ConcurrentUtils.h"
+
+namespace cs224 {
+
+// Structure-of-arrays storage for a 3D vector attribute.
+// The x, y and z components live in three separate cache line
+// aligned float arrays, so a loop over many particles can load
+// 8/16 consecutive components straight into a SIMD register.
+// operator[] returns a Vector3f by value, which lets the array be
+// passed wherever the grid queries expect a PCI3Mf.
+class SoA3f {
+public:
+    void resize(size_t n) {
+        m_x.resize(n);
+        m_y.resize(n);
+        m_z.resize(n);
+    }
+
+    size_t size() const { return m_x.size(); }
+
+    inline Vector3f operator[](size_t i) const {
+        return Vector3f(m_x[i], m_y[i], m_z[i]);
+    }
+
+    inline void set(size_t i, const Vector3f &v) {
+        m_x[i] = v.x();
+        m_y[i] = v.y();
+        m_z[i] = v.z();
+    }
+
+    // Copy an AoS array into this array (resizing it if necessary).
+    void assign(const PCI3Mf &src) {
+        resize(src.size());
+        ConcurrentUtils::ccLoop(src.size(), [this, &src] (size_t i) {
+            set(i, src[i]);
+        });
+    }
+
+    // Copy this array back into an AoS array.
+    void copyTo(PCI3Mf &dst) const {
+        dst.resize(size());
+        ConcurrentUtils::ccLoop(size(), [this, &dst] (size_t i) {
+            dst[i] = (*this)[i];
+        });
+    }
+
+    float *x() { return m_x.data(); }
+    float *y() { return m_y.data(); }
+    float *z() { return m_z.data(); }
+    const float *x() const { return m_x.data(); }
+    const float *y() const { return m_y.data(); }
+    const float *z() const { return m_z.data(); }
+
+private:
+    PCI1Maf m_x;
+    PCI1Maf m_y;
+    PCI1Maf m_z;
+};
+
+} // namespace cs224
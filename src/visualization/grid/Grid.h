@@ -1,94 +1,296 @@
 #pragma once
 
 #include "utils/Def.h"
+#include "utils/ConcurrentUtils.h"
+
+#include <tbb/parallel_sort.h>
+
 #include <vector>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
 
 namespace cs224 {
 
+// Periodic axes of the simulation domain. On a periodic axis the domain is one
+// tile of an infinite repetition: positions are wrapped into [min, max) and a
+// particle interacts with the closest image of every other particle (minimum
+// image convention), so the period has to be at least twice the query radius.
+struct PeriodicDomain {
+    Box3f tile;
+    Vector3f extents = Vector3f(0.f);
+    Vector3f inverseExtents = Vector3f(0.f);
+    bool axes[3] = { false, false, false };
+    bool enabled = false;
+
+    PeriodicDomain() {}
+
+    PeriodicDomain(const Box3f &box, bool x, bool y, bool z) : tile(box) {
+        axes[0] = x;
+        axes[1] = y;
+        axes[2] = z;
+        enabled = x || y || z;
+        extents = tile.extents();
+        for (int k = 0; k < 3; ++k) {
+            inverseExtents[k] = axes[k] ? 1.f / extents[k] : 0.f;
+        }
+    }
+
+    // Closest image of the difference r of two positions.
+    inline Vector3f minimumImage(Vector3f r) const {
+        if (enabled) {
+            for (int k = 0; k < 3; ++k) {
+                r[k] -= extents[k] * std::round(r[k] * inverseExtents[k]);
+            }
+        }
+        return r;
+    }
+
+    // Image of p inside the tile.
+    inline Vector3f wrap(Vector3f p) const {
+        for (int k = 0; k < 3; ++k) {
+            if (axes[k]) {
+                p[k] -= extents[k] * std::floor((p[k] - tile.min[k]) * inverseExtents[k]);
+                // rounding may land exactly on the upper end of the tile
+                if (p[k] >= tile.max[k]) {
+                    p[k] = tile.min[k];
+                }
+            }
+        }
+        return p;
+    }
+};
+
 class Grid {
 public:
-    void init(const Box3f &bounds, float cs) {
+    // Order in which the cells (and therefore the sorted particles) are laid out in memory.
+    // Linear : z-major, neighbouring cells in y/z are far apart in memory.
+    // Morton : z-order space filling curve, spatially close cells are also close in memory.
+    enum Ordering {
+        Linear,
+        Morton
+    };
+
+    // How the cell offsets are stored.
+    // Dense   : one offset per cell of the (power of two padded) bounding box.
+    // Compact : only the occupied cells are stored, sorted by cell key, and found
+    //           through a hash table (compact hashing). Memory scales with the number
+    //           of occupied cells, which suits large and mostly empty domains.
+    enum Storage {
+        Dense,
+        Compact
+    };
+
+    // On the periodic axes of domain the grid covers exactly the tile, with a whole number of
+    // cells no smaller than cs, and lookups wrap around the tile.
+    void init(const Box3f &bounds, float cs, Ordering order = Linear, Storage store = Dense,
+              const PeriodicDomain &domain = PeriodicDomain()) {
         boundingBox = bounds;
-        cellSize = cs;
-        inverseCellSize = 1.f / cellSize;
+        periodicDomain = domain;
+        ordering = order;
+        storage = store;
 
-        size = Vector3i(
-            nextPowerOfTwo(int(std::floor(boundingBox.extents().x() / cellSize)) + 1),
-            nextPowerOfTwo(int(std::floor(boundingBox.extents().y() / cellSize)) + 1),
-            nextPowerOfTwo(int(std::floor(boundingBox.extents().z() / cellSize)) + 1)
-        );
+        for (int k = 0; k < 3; ++k) {
+            int cells = int(std::floor(boundingBox.extents()[k] / cs)) + 1;
+            inverseCellSize[k] = 1.f / cs;
+            periodicCells[k] = 0;
+            if (periodicDomain.axes[k]) {
+                boundingBox.min[k] = periodicDomain.tile.min[k];
+                boundingBox.max[k] = periodicDomain.tile.max[k];
+                cells = std::max(1, int(std::floor(periodicDomain.extents[k] / cs)));
+                inverseCellSize[k] = cells / periodicDomain.extents[k];
+                periodicCells[k] = cells;
+            }
+            size[k] = nextPowerOfTwo(cells);
+        }
 
-        offset.resize(size.prod() + 1);
+        buildCellKeys();
+        if (storage == Dense) {
+            offset.resize(size_t(size.prod()) + 1);
+            cellCounts = std::vector<std::atomic<uint32_t>>(size_t(size.prod()));
+        } else {
+            offset.assign(1, 0);
+            cellCounts.clear();
+        }
     }
 
+    Ordering getOrdering() const { return ordering; }
+    Storage getStorage() const { return storage; }
+    const PeriodicDomain &domain() const { return periodicDomain; }
+
     inline Vector3i index(const Vector3f &pos) const {
         return Vector3i(
-            int(std::floor((pos.x() - boundingBox.min.x()) * inverseCellSize)),
-            int(std::floor((pos.y() - boundingBox.min.y()) * inverseCellSize)),
-            int(std::floor((pos.z() - boundingBox.min.z()) * inverseCellSize))
+            int(std::floor((pos.x() - boundingBox.min.x()) * inverseCellSize.x())),
+            int(std::floor((pos.y() - boundingBox.min.y()) * inverseCellSize.y())),
+            int(std::floor((pos.z() - boundingBox.min.z()) * inverseCellSize.z()))
         );
     }
 
-    inline size_t indexLinear(const Vector3f &pos) const {
-        Vector3i i = index(pos);
-        return i.z() * (size.x() * size.y()) + i.y() * size.x() + i.x();
+    // Position of a cell in the sorted cell order.
+    inline size_t cellKey(int x, int y, int z) const {
+        return keyX[x] + keyY[y] + keyZ[z];
+    }
+
+    inline size_t cellKey(const Vector3f &pos) const {
+        Vector3i i = index(pos).cwiseMax(Vector3i(0)).cwiseMin(size - Vector3i(1));
+        return cellKey(i.x(), i.y(), i.z());
     }
     
-    template<typename SwapFunc>
-    void update(const PCI3Mf &positions, SwapFunc swap) {
-        PCI1Mi cellCount(size.prod(), 0);
-        PCI1Mi cellIndex(size.prod(), 0);
-        size_t count = positions.size();
-        PCI1Mi indices(count);
+    // Sort the particles into the grid cells. Computes the permutation that orders
+    // the particles by cell and calls reorder(permutation), where permutation[i] is
+    // the previous index of the particle that moves to index i. Within a cell the
+    // particles keep their previous relative order. reorder has to apply the
+    // permutation to every per-particle array, see permute().
+    template<typename Positions, typename ReorderFunc>
+    void update(const Positions &positions, ReorderFunc reorder) {
+        if (storage == Dense) {
+            updateDense(positions);
+        } else {
+            updateCompact(positions);
+        }
+        reorder(permutation);
+    }
+
+    // Re-bin the particles at the sorted indices moved (ascending) after their positions
+    // changed, keeping the order of all other particles. Only the moved particles that left
+    // their cell move in the sorted order, so only the cells between the old and the new
+    // cells of these particles are sorted again. Calls reorder(permutation, begin, end) with
+    // the range [begin, end) of sorted indices that changed, see permute(), unless every
+    // moved particle stayed in its cell. Compact storage sorts all particles again.
+    template<typename Positions, typename ReorderFunc>
+    void updateMoved(const Positions &positions, const std::vector<uint32_t> &moved, ReorderFunc reorder) {
+        if (storage == Compact) {
+            update(positions, [&] (const std::vector<uint32_t> &permutation) {
+                reorder(permutation, size_t(0), permutation.size());
+            });
+            return;
+        }
 
-        // update particle index and count number of particles per cell
-        for (size_t i = 0; i < count; ++ i) {
-            size_t index = indexLinear(positions[i]);
-            indices[i] = index;
-            cellCount[index] += 1;
+        // the old cell of a sorted particle is the last cell starting at or before it
+        movedKeys.resize(moved.size());
+        ConcurrentUtils::ccLoop(moved.size(), [&] (size_t k) {
+            size_t i = moved[k];
+            size_t oldKey = size_t(std::upper_bound(offset.begin(), offset.end(), i) - offset.begin()) - 1;
+            movedKeys[k] = std::make_pair(oldKey, cellKey(positions[i]));
+        });
+
+        size_t minKey = std::numeric_limits<size_t>::max();
+        size_t maxKey = 0;
+        for (const auto &keys : movedKeys) {
+            if (keys.first != keys.second) {
+                minKey = std::min(minKey, std::min(keys.first, keys.second));
+                maxKey = std::max(maxKey, std::max(keys.first, keys.second));
+            }
+        }
+        if (minKey > maxKey) {
+            return;
         }
 
-        // initialize cell indices & offsets
-        size_t index = 0;
-        for (size_t i = 0; i < cellIndex.size(); ++ i) {
-            cellIndex[i] = index;
-            offset[i] = index;
-            index += cellCount[i];
+        // sort the particles of the touched cells by their new cells
+        size_t begin = offset[minKey];
+        size_t end = offset[maxKey + 1];
+        sortedKeys.resize(end - begin);
+        for (size_t c = minKey; c <= maxKey; ++c) {
+            for (size_t i = offset[c]; i < offset[c + 1]; ++i) {
+                sortedKeys[i - begin] = std::make_pair(c, uint32_t(i));
+            }
+        }
+        for (size_t k = 0; k < moved.size(); ++k) {
+            if (movedKeys[k].first != movedKeys[k].second) {
+                sortedKeys[moved[k] - begin].first = movedKeys[k].second;
+            }
         }
-        offset.back() = index;
+        std::sort(sortedKeys.begin(), sortedKeys.end());
 
-        // sort particles by index
-        for (int i = 0; i < count; ++ i) {
-            while (i >= cellIndex[indices[i]] || i < offset[indices[i]]) {
-                int j = cellIndex[indices[i]] ++;
-                std::swap(indices[i], indices[j]);
-                swap(i, j);
+        permutation.resize(positions.size());
+        size_t next = 0;
+        for (size_t c = minKey; c <= maxKey; ++c) {
+            offset[c] = begin + next;
+            while (next < sortedKeys.size() && sortedKeys[next].first == c) {
+                permutation[begin + next] = sortedKeys[next].second;
+                ++next;
             }
         }
+        reorder(permutation, begin, end);
     }
-    
+
+    // Apply a permutation computed by update() to a per-particle array in parallel.
+    // The permuted values are gathered into scratch, which is then swapped with data.
+    // data[permutation[i]] moves to index i, data takes the size of the permutation.
+    template<typename Array>
+    static void permute(Array &data, const std::vector<uint32_t> &permutation, Array &scratch) {
+        scratch.resize(permutation.size());
+        ConcurrentUtils::ccLoop(permutation.size(), [&] (size_t i) {
+            scratch[i] = data[permutation[i]];
+        });
+        std::swap(data, scratch);
+    }
+
+    template<typename Array>
+    static void permute(Array &data, const std::vector<uint32_t> &permutation) {
+        Array scratch;
+        permute(data, permutation, scratch);
+    }
+
+    // Apply the range [begin, end) of a permutation computed by updateMoved(), the particles
+    // outside of the range keep their indices.
+    template<typename Array>
+    static void permute(Array &data, const std::vector<uint32_t> &permutation, size_t begin, size_t end, Array &scratch) {
+        scratch.resize(end - begin);
+        ConcurrentUtils::ccLoop(end - begin, [&] (size_t i) {
+            scratch[i] = data[permutation[begin + i]];
+        });
+        std::copy(scratch.begin(), scratch.end(), data.begin() + begin);
+    }
+
     // method for querying the surrounding sphere geometry within the same grid.
     template<typename Func>
     void lookup(const Vector3f &pos, float radius, Func func) const {
-        Vector3i min = index(pos - Vector3f(radius)).cwiseMax(Vector3i(0));
-        Vector3i max = index(pos + Vector3f(radius)).cwiseMin(size - Vector3i(1));
+        lookupCells(pos, radius, [&] (size_t begin, size_t end) {
+            for (size_t j = begin; j < end; ++j) {
+                if (!func(j)) return false;
+            }
+            return true;
+        });
+    }
+
+    // Visit the occupied cells overlapping the box of the given radius around pos, calling
+    // func(begin, end) with the range of sorted particles of every cell. Stops as soon as
+    // func returns false.
+    // On periodic axes the box wraps around the tile, every cell is visited once.
+    template<typename Func>
+    void lookupCells(const Vector3f &pos, float radius, Func func) const {
+        Vector3i min = index(pos - Vector3f(radius));
+        Vector3i max = index(pos + Vector3f(radius));
+        for (int k = 0; k < 3; ++k) {
+            if (periodicCells[k] == 0) {
+                min[k] = std::max(min[k], 0);
+                max[k] = std::min(max[k], size[k] - 1);
+            } else if (max[k] - min[k] + 1 >= periodicCells[k]) {
+                min[k] = 0;
+                max[k] = periodicCells[k] - 1;
+            }
+        }
         for (int z = min.z(); z <= max.z(); ++ z) {
             for (int y = min.y(); y <= max.y(); ++ y) {
+                size_t yz = keyY[wrap(y, 1)] + keyZ[wrap(z, 2)];
                 for (int x = min.x(); x <= max.x(); ++ x) {
-                    int i = z * (size.x() * size.y()) + y * size.x() + x;
-                    
-                    for (size_t j = offset[i]; j < offset[i + 1]; ++j) {
-                        if (!func(j)) return;
+                    size_t begin, end;
+                    if (!cellRange(yz + keyX[wrap(x, 0)], begin, end) || begin == end) {
+                        continue;
                     }
+                    if (!func(begin, end)) return;
                 }
             }
         }
     }
     
-    template<typename Func>
-    inline void query(const float kRadius, const PCI3Mf &positions, const Vector3f &p, Func func) {
+    // positions can be any array whose operator[] yields a Vector3f (PCI3Mf or SoA3f).
+    template<typename Positions, typename Func>
+    inline void query(const float kRadius, const Positions &positions, const Vector3f &p, Func func) {
         lookup(p, kRadius, [&] (size_t j) {
-            Vector3f r = p - positions[j];
+            Vector3f r = periodicDomain.minimumImage(p - positions[j]);
             float r2 = r.squaredNorm();
             if (r2 < pow2(kRadius)) {
                 func(j, r, r2);
@@ -98,10 +300,10 @@ public:
     }
     
     // iterate over all neighbours around p, calling func(j, r, r2)
-    template<typename Func>
-    inline void queryPair(const float kRadius, const PCI3Mf &positionsNew, const Vector3f &p, const Vector3f &pNew, Func func) {
+    template<typename Positions, typename Func>
+    inline void queryPair(const float kRadius, const Positions &positionsNew, const Vector3f &p, const Vector3f &pNew, Func func) {
         lookup(p, kRadius, [&](size_t j) {
-            Vector3f r = pNew - positionsNew[j];
+            Vector3f r = periodicDomain.minimumImage(pNew - positionsNew[j]);
             float r2 = r.squaredNorm();
             if (r2 < pow2(kRadius)) func(j, r, r2);
             return true;
@@ -110,10 +312,11 @@ public:
 
     // method for detecting whether the current particle is isolated
     // a particle is considered as isolated iff it has no neighbouring particles within a given range.
-    inline bool isAlive(const float kRadius, const PCI3Mf &positions, const Vector3f &p) {
+    template<typename Positions>
+    inline bool isAlive(const float kRadius, const Positions &positions, const Vector3f &p) {
         bool result = false;
         lookup(p, kRadius, [&](size_t j) {
-            if ((p - positions[j]).squaredNorm() < pow2(kRadius)) {
+            if (periodicDomain.minimumImage(p - positions[j]).squaredNorm() < pow2(kRadius)) {
                 result = true;
                 return false;
             } else {
@@ -124,11 +327,190 @@ public:
     }
 
 private:
+    // Dense storage: parallel counting sort over all cells.
+    template<typename Positions>
+    void updateDense(const Positions &positions) {
+        size_t count = positions.size();
+        size_t cellCount = size_t(size.prod());
+        particleKeys.resize(count);
+        particleSlots.resize(count);
+        permutation.resize(count);
+
+        // compute the cell of every particle and count the particles per cell,
+        // the returned count is the slot of the particle within its cell
+        ConcurrentUtils::ccLoop(count, [&] (size_t i) {
+            size_t key = cellKey(positions[i]);
+            particleKeys[i] = key;
+            particleSlots[i] = cellCounts[key].fetch_add(1, std::memory_order_relaxed);
+        });
+
+        // cell offsets are the prefix sum of the cell counts
+        offset.back() = ConcurrentUtils::exclusiveScan<size_t>(cellCount, [this] (size_t c) {
+            return size_t(cellCounts[c].load(std::memory_order_relaxed));
+        }, offset);
+
+        // scatter the particle indices into their cells
+        ConcurrentUtils::ccLoop(count, [&] (size_t i) {
+            permutation[offset[particleKeys[i]] + particleSlots[i]] = uint32_t(i);
+        });
+
+        // the slots were handed out in arbitrary thread order, sort the indices within
+        // each cell to keep the result deterministic and reset the counts for the next update
+        ConcurrentUtils::ccLoop(cellCount, [&] (size_t c) {
+            if (cellCounts[c].load(std::memory_order_relaxed) > 1) {
+                std::sort(permutation.begin() + offset[c], permutation.begin() + offset[c + 1]);
+            }
+            cellCounts[c].store(0, std::memory_order_relaxed);
+        });
+    }
+
+    // Compact storage: sort the (cell key, index) pairs, then extract the occupied
+    // cells and insert them into the hash table.
+    template<typename Positions>
+    void updateCompact(const Positions &positions) {
+        size_t count = positions.size();
+        sortedKeys.resize(count);
+        particleSlots.resize(count);
+        permutation.resize(count);
+
+        ConcurrentUtils::ccLoop(count, [&] (size_t i) {
+            sortedKeys[i] = std::make_pair(cellKey(positions[i]), uint32_t(i));
+        });
+        tbb::parallel_sort(sortedKeys.begin(), sortedKeys.end());
+
+        // number the occupied cells, a new cell starts wherever the key changes
+        auto cellStart = [this] (size_t i) {
+            return i == 0 || sortedKeys[i].first != sortedKeys[i - 1].first;
+        };
+        size_t cellCount = ConcurrentUtils::exclusiveScan<size_t>(count, [&] (size_t i) {
+            return size_t(cellStart(i) ? 1 : 0);
+        }, particleSlots);
+
+        offset.resize(cellCount + 1);
+        compactKeys.resize(cellCount);
+        offset.back() = count;
+        ConcurrentUtils::ccLoop(count, [&] (size_t i) {
+            permutation[i] = sortedKeys[i].second;
+            if (cellStart(i)) {
+                offset[particleSlots[i]] = i;
+                compactKeys[particleSlots[i]] = sortedKeys[i].first;
+            }
+        });
+
+        // hash table with open addressing and linear probing, at most half full
+        size_t tableSize = std::max<size_t>(16, nextPowerOfTwo(uint32_t(2 * cellCount)));
+        if (hashTable.size() != tableSize) {
+            hashTable = std::vector<std::atomic<uint32_t>>(tableSize);
+        }
+        hashMask = tableSize - 1;
+        ConcurrentUtils::ccLoop(tableSize, [this] (size_t h) {
+            hashTable[h].store(EmptyCell, std::memory_order_relaxed);
+        });
+        ConcurrentUtils::ccLoop(cellCount, [this] (size_t c) {
+            size_t h = hash(compactKeys[c]);
+            uint32_t expected = EmptyCell;
+            while (!hashTable[h].compare_exchange_strong(expected, uint32_t(c))) {
+                h = (h + 1) & hashMask;
+                expected = EmptyCell;
+            }
+        });
+    }
+
+    // Range [begin, end) of the sorted particles in the cell with the given key.
+    inline bool cellRange(size_t key, size_t &begin, size_t &end) const {
+        if (storage == Dense) {
+            begin = offset[key];
+            end = offset[key + 1];
+            return true;
+        }
+        for (size_t h = hash(key); ; h = (h + 1) & hashMask) {
+            uint32_t c = hashTable[h].load(std::memory_order_relaxed);
+            if (c == EmptyCell) {
+                return false;
+            }
+            if (compactKeys[c] == key) {
+                begin = offset[c];
+                end = offset[c + 1];
+                return true;
+            }
+        }
+    }
+
+    // Cell index on the given axis, wrapped around the tile on periodic axes.
+    inline int wrap(int i, int axis) const {
+        int n = periodicCells[axis];
+        return n == 0 ? i : ((i % n) + n) % n;
+    }
+
+    inline size_t hash(size_t key) const {
+        return size_t((uint64_t(key) * 0x9E3779B97F4A7C15ull) >> 32) & hashMask;
+    }
+
+    // Precompute the per-axis contributions to the cell key, so that
+    // key(x, y, z) = keyX[x] + keyY[y] + keyZ[z] for either ordering.
+    // The grid size is a power of two on every axis, so interleaving the
+    // bits of the three indices (skipping axes that ran out of bits) maps
+    // the cells one-to-one onto [0, size.prod()), even for non-cubic grids.
+    void buildCellKeys() {
+        keyX.assign(size.x(), 0);
+        keyY.assign(size.y(), 0);
+        keyZ.assign(size.z(), 0);
+
+        if (ordering == Linear) {
+            for (int x = 0; x < size.x(); ++x) keyX[x] = x;
+            for (int y = 0; y < size.y(); ++y) keyY[y] = size_t(y) * size.x();
+            for (int z = 0; z < size.z(); ++z) keyZ[z] = size_t(z) * size.x() * size.y();
+            return;
+        }
+
+        std::vector<size_t> *keys[3] = { &keyX, &keyY, &keyZ };
+        int bits[3];
+        for (int axis = 0; axis < 3; ++axis) {
+            bits[axis] = 0;
+            while ((1 << bits[axis]) < size[axis]) ++bits[axis];
+        }
+
+        int outBit = 0;
+        for (int bit = 0; bit < std::max(bits[0], std::max(bits[1], bits[2])); ++bit) {
+            for (int axis = 0; axis < 3; ++axis) {
+                if (bit >= bits[axis]) {
+                    continue;
+                }
+                std::vector<size_t> &key = *keys[axis];
+                for (size_t i = 0; i < key.size(); ++i) {
+                    if (i & (size_t(1) << bit)) {
+                        key[i] |= size_t(1) << outBit;
+                    }
+                }
+                ++outBit;
+            }
+        }
+    }
+
     Box3f boundingBox;
-    float cellSize;
-    float inverseCellSize;
+    Vector3f inverseCellSize;
     Vector3i size;
+    PeriodicDomain periodicDomain;
+    Vector3i periodicCells = Vector3i(0);  // cells of the tile on periodic axes, 0 on the others
+    Ordering ordering = Linear;
+    Storage storage = Dense;
+    std::vector<size_t> keyX, keyY, keyZ;
     std::vector<size_t> offset;
+
+    // buffers of the counting sort
+    std::vector<std::atomic<uint32_t>> cellCounts;
+    std::vector<size_t> particleKeys;
+    std::vector<uint32_t> particleSlots;
+    std::vector<uint32_t> permutation;
+
+    // compact storage: keys of the occupied cells and the hash table mapping keys to cells,
+    // the sorted keys are reused by updateMoved for the touched cells
+    static const uint32_t EmptyCell = 0xffffffffu;
+    std::vector<std::pair<size_t, uint32_t>> sortedKeys;
+    std::vector<std::pair<size_t, size_t>> movedKeys;  // old and new cell of the particles moved by updateMoved
+    std::vector<size_t> compactKeys;
+    std::vector<std::atomic<uint32_t>> hashTable;
+    size_t hashMask = 0;
 };
 
 } // namespace cs224
@@ -99,26 +99,11 @@ ParticleGenerator::Boundary ParticleGenerator::generateFromBoundaryMesh(const Me
 
     float density = 1.f / (PI * pow2(particleRadius));
 
-    // compute bounds of mesh and expand by 10%
+    VoxelGrid<float> sdf = generateSDF(mesh, cells);
+
     Box3f bounds = mesh.bound();
     bounds = bounds.expanded(bounds.extents());
 
-    // compute cell and grid size for signed distance field
-    float cellSize = bounds.extents()[bounds.majorAxis()] / cells;
-
-    Vector3i size(
-        int(std::ceil(bounds.extents().x() / cellSize)),
-        int(std::ceil(bounds.extents().y() / cellSize)),
-        int(std::ceil(bounds.extents().z() / cellSize))
-    );
-
-    VoxelGrid<float> sdf(size);
-    sdf.setOrigin(bounds.min);
-    sdf.setCellSize(cellSize);
-
-    // build signed distance field
-    SDF::build(mesh, sdf);
-
     // generate initial point distribution
     Boundary ret;
     float totalArea = 0.f;
@@ -153,16 +138,17 @@ ParticleGenerator::Boundary ParticleGenerator::generateFromBoundaryMesh(const Me
     float radius = std::sqrt(totalArea / ret.positions.size() * 10.f / PI);
     float radius_sq = pow2(radius);
 
+    // the samples only cover the surface of the mesh, so most of the 128^3 cells are empty
     Grid grid;
-    grid.init(bounds, bounds.extents().maxCoeff() / 128.f);
+    grid.init(bounds, bounds.extents().maxCoeff() / 128.f, Grid::Linear, Grid::Compact);
 
     // keep doing 10 times to smooth particle positions
     for (int iteration = 0; iteration < 10; ++ iteration) {
         int count = 0;
         std::vector<Vector3f> velocities(ret.positions.size(), Vector3f());
 
-        grid.update(ret.positions, [&](size_t i, size_t j) {
-            std::swap(ret.positions[i], ret.positions[j]);
+        grid.update(ret.positions, [&](const std::vector<uint32_t> &permutation) {
+            Grid::permute(ret.positions, permutation);
         });
 
         // relax positions
@@ -199,9 +185,37 @@ ParticleGenerator::Boundary ParticleGenerator::generateFromBoundaryMesh(const Me
         ret.normals[i] = sdf.gradient(sdf.toVoxelSpace(ret.positions[i])).normalized();
     }
 
+    // keep the distance field for the collisions against the mesh
+    ret.sdf = std::move(sdf);
+
     return ret;
 }
 
+VoxelGrid<float> ParticleGenerator::generateSDF(const Mesh &mesh, int cells) {
+
+    // compute bounds of mesh and expand by 10%
+    Box3f bounds = mesh.bound();
+    bounds = bounds.expanded(bounds.extents());
+
+    // compute cell and grid size for signed distance field
+    float cellSize = bounds.extents()[bounds.majorAxis()] / cells;
+
+    Vector3i size(
+        int(std::ceil(bounds.extents().x() / cellSize)),
+        int(std::ceil(bounds.extents().y() / cellSize)),
+        int(std::ceil(bounds.extents().z() / cellSize))
+    );
+
+    VoxelGrid<float> sdf(size);
+    sdf.setOrigin(bounds.min);
+    sdf.setCellSize(cellSize);
+
+    // build signed distance field
+    SDF::build(mesh, sdf);
+
+    return sdf;
+}
+
 ParticleGenerator::Volume ParticleGenerator::generateFromVolumeBox(const Box3f &box, float particleRadius) {
 
     Volume ret;
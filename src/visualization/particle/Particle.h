@@ -1,5 +1,7 @@
 #pragma once
 
+#include "visualization/geometry/VoxelGrid.h"
+
 #include "utils/Def.h"
 #include "utils/Math.h"
 
@@ -16,11 +18,15 @@ public:
     struct Boundary {
         std::vector<Vector3f> positions;
         std::vector<Vector3f> normals;
+        VoxelGrid<float> sdf;  // signed distance field of a boundary mesh
     };
 
     static Boundary generateFromBoundaryBox(const Box3f &box, float particleRadius, bool innerNormal = false);
     static Boundary generateFromBoundaryMesh(const Mesh &mesh, float particleRadius, int cells = 100);
 
+    // signed distance field of a mesh on its bounds expanded by their extents, cells voxels along the major axis
+    static VoxelGrid<float> generateSDF(const Mesh &mesh, int cells = 100);
+
     // fluid particles
     struct Volume {
         std::vector<Vector3f> positions;
@@ -6,6 +6,7 @@
 #include <json11.h>
 
 #include <fstream>
+#include <limits>
 #include <sstream>
 
 using namespace json11;
@@ -26,8 +27,17 @@ Scene::World::World(const Settings &props) {
     bounds = props.getBox3("bounds", bounds);
 }
 
+Scene::Keyframe::Keyframe(const Settings &props) {
+    time = props.getFloat("time", 0.f);
+    translation = props.getVector3("translation", Vector3f(0.f));
+    rotation = props.getVector3("rotation", Vector3f(0.f));
+}
+
 Scene::Shape::Shape(const Settings &props) {
     type = typeFromString(props.getString("type", "fluid"));
+    for (auto jsonKeyframe : props.json()["keyframes"].array_items()) {
+        keyframes.emplace_back(Keyframe(Settings(jsonKeyframe)));
+    }
 }
 
 Scene::Box::Box(const Settings &props) : Shape(props) {
@@ -43,6 +53,58 @@ Scene::Mesh::Mesh(const Settings &props) : Shape(props) {
     filename = props.getString("filename");
 }
 
+Scene::Collider::Collider(const Settings &props) {
+    std::string type = props.getString("type", "box");
+    if (type == "plane") {
+        kind = Plane;
+    } else {
+        if (type != "box") {
+            std::cout << "Unknown collider type " << type << std::endl;
+        }
+        kind = Box;
+    }
+    bounds = props.getBox3("bounds", Box3f(Vector3f(-1.f), Vector3f(1.f)));
+    rotation = props.getVector3("rotation", Vector3f(0.f));
+    point = props.getVector3("point", Vector3f(0.f));
+    normal = props.getVector3("normal", Vector3f(0.f, 1.f, 0.f));
+}
+
+Scene::Emitter::Emitter(const Settings &props) {
+    std::string type = props.getString("type", "nozzle");
+    if (type == "plane") {
+        kind = Plane;
+    } else {
+        if (type != "nozzle") {
+            std::cout << "Unknown emitter type " << type << std::endl;
+        }
+        kind = Nozzle;
+    }
+    position = props.getVector3("position", Vector3f(0.f));
+    direction = props.getVector3("direction", Vector3f(0.f, -1.f, 0.f));
+    up = props.getVector3("up", Vector3f(0.f, 1.f, 0.f));
+    speed = props.getFloat("speed", 1.f);
+    radius = props.getFloat("radius", 0.05f);
+    width = props.getFloat("width", 0.1f);
+    height = props.getFloat("height", 0.1f);
+    start = props.getFloat("start", 0.f);
+    end = props.getFloat("end", std::numeric_limits<float>::infinity());
+}
+
+Scene::Sink::Sink(const Settings &props) {
+    std::string type = props.getString("type", "box");
+    if (type == "plane") {
+        kind = Plane;
+    } else {
+        if (type != "box") {
+            std::cout << "Unknown sink type " << type << std::endl;
+        }
+        kind = Box;
+    }
+    bounds = props.getBox3("bounds", Box3f(Vector3f(-1.f), Vector3f(1.f)));
+    point = props.getVector3("point", Vector3f(0.f));
+    normal = props.getVector3("normal", Vector3f(0.f, 1.f, 0.f));
+}
+
 Scene Scene::load(const std::string &filename, const json11::Json &settings) {
     
     std::ifstream is(filename);
@@ -54,6 +116,11 @@ Scene Scene::load(const std::string &filename, const json11::Json &settings) {
     if (jsonRoot.is_null()) {
         std::cout<<"Failed to load the scene" <<std::endl;
     }
+    return fromJson(jsonRoot, settings);
+}
+
+Scene Scene::fromJson(const json11::Json &jsonRoot, const json11::Json &settings) {
+
     Scene scene;
     
     // Patch settings
@@ -85,6 +152,15 @@ Scene Scene::load(const std::string &filename, const json11::Json &settings) {
         for (auto jsonMesh : jsonScene["meshes"].array_items()) {
             scene.meshes.emplace_back(Mesh(Settings(jsonMesh)));
         }
+        for (auto jsonCollider : jsonScene["colliders"].array_items()) {
+            scene.colliders.emplace_back(Collider(Settings(jsonCollider)));
+        }
+        for (auto jsonEmitter : jsonScene["emitters"].array_items()) {
+            scene.emitters.emplace_back(Emitter(Settings(jsonEmitter)));
+        }
+        for (auto jsonSink : jsonScene["sinks"].array_items()) {
+            scene.sinks.emplace_back(Sink(Settings(jsonSink)));
+        }
         for (auto jsonCameraKeyframe : jsonScene["cameraKeyframes"].array_items()) {
             scene.cameraKeyframes.emplace_back(Camera(Settings(jsonCameraKeyframe)));
         }
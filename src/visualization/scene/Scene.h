@@ -38,8 +38,19 @@ public:
         std::string toString() const;
     };
 
+    // Pose of a moving boundary at "time": the shape is rotated by "rotation" (euler angles
+    // in degrees, applied in x, y, z order) around the centre of its bounds and moved by
+    // "translation". Poses between keyframes are interpolated.
+    struct Keyframe {
+        float time;
+        Vector3f translation;
+        Vector3f rotation;
+        Keyframe(const Settings &props);
+    };
+
     struct Shape {
         Type type;
+        std::vector<Keyframe> keyframes;  // boundaries only, a boundary without keyframes is static
         Shape(const Settings &props);
     };
 
@@ -62,6 +73,58 @@ public:
         std::string toString() const;
     };
 
+    // Collision primitive of the clamp-and-reflect pass, not sampled with boundary particles.
+    // "type" is "box" (keeps particles inside the rotated box) or "plane".
+    struct Collider {
+        enum Kind {
+            Box,
+            Plane
+        };
+        Kind kind;
+        Box3f bounds;
+        Vector3f rotation;  // euler angles in degrees
+        Vector3f point;
+        Vector3f normal;
+        Collider(const Settings &props);
+    };
+
+    // Inflow of fluid particles. Layers of particles leave the emitter along "direction"
+    // with "speed" between the "start" and "end" times. "type" is "nozzle" (disc of
+    // "radius") or "plane" (rectangle of "width" times "height", "width" runs along
+    // up x direction).
+    struct Emitter {
+        enum Kind {
+            Nozzle,
+            Plane
+        };
+        Kind kind;
+        Vector3f position;
+        Vector3f direction;
+        Vector3f up;
+        float speed;
+        float radius;
+        float width;
+        float height;
+        float start;
+        float end;
+        Emitter(const Settings &props);
+    };
+
+    // Outflow of fluid particles, removes the particles that enter it. "type" is "box"
+    // (removes the particles inside the bounds) or "plane" (removes the particles
+    // behind the plane, the normal points to the fluid side).
+    struct Sink {
+        enum Kind {
+            Box,
+            Plane
+        };
+        Kind kind;
+        Box3f bounds;
+        Vector3f point;
+        Vector3f normal;
+        Sink(const Settings &props);
+    };
+
     Settings settings;
 
     Camera camera;
@@ -69,9 +132,14 @@ public:
     std::vector<Box> boxes;
     std::vector<Sphere> spheres;
     std::vector<Mesh> meshes;
+    std::vector<Collider> colliders;
+    std::vector<Emitter> emitters;
+    std::vector<Sink> sinks;
     std::vector<Camera> cameraKeyframes;
 
     static Scene load(const std::string &filename, const json11::Json &settings = json11::Json());
+    // Build a scene from an already parsed scene document (same layout as the scene files).
+    static Scene fromJson(const json11::Json &root, const json11::Json &settings = json11::Json());
 
     std::string toString() const;
 